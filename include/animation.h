@@ -0,0 +1,47 @@
+#pragma once
+#include "scene.h"
+#include <glm/glm.hpp>
+#include <glm/gtx/quaternion.hpp>
+#include <vector>
+
+namespace scene {
+
+// Keyframed animation stored SoA: every channel's key times and values sit
+// back to back in two contiguous arrays, so a clip evaluates in one pass
+// with cache-friendly, vectorizable mix/slerp over adjacent key pairs.
+// Each channel caches a playback cursor — advancing monotonically is
+// amortized O(1), and only a backwards jump (looping) reseeks with a
+// binary search — instead of rescanning every keyframe every frame.
+// Sampled values go through set_translation/set_rotation and land in the
+// owning Scene's flat local-transform arrays via the dirty window.
+class Animation {
+private:
+    enum class Path : uint8_t {
+        Translation,
+        Rotation,
+    };
+    struct channel {
+        Node* m_target;
+        Path m_path;
+        uint32_t m_first_key;
+        uint32_t m_key_count;
+        uint32_t m_cursor = 0; // last key at or before the previous sample time
+    };
+
+    std::vector<channel> m_channels;
+    std::vector<float> m_times; // all channels' key times, back to back
+    std::vector<glm::vec4> m_values; // vec3 keys leave w unused; quat keys are (x, y, z, w)
+    float m_duration = 0.f;
+
+    uint32_t add_channel(Node* target, Path path, const std::vector<float>& times);
+
+public:
+    Animation& add_translation_channel(Translation* target, std::vector<float>&& times, std::vector<glm::vec3>&& values);
+    Animation& add_rotation_channel(Rotation* target, std::vector<float>&& times, std::vector<glm::quat>&& values);
+
+    inline float duration() const { return m_duration; }
+    // Samples every channel at time and pushes the results into the targets.
+    void evaluate(float time);
+};
+
+}
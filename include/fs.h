@@ -29,6 +29,46 @@ public:
     file parent() const;
     file relative(std::string_view rel_path) const;
     std::vector<file> children() const;
+
+    // One bulk read of the whole file: sized with PHYSFS_fileLength and
+    // issued as a single read, skipping the stream buffer entirely.
+    std::vector<char> read_all() const;
+    // Same, into a caller-provided buffer; returns the number of bytes
+    // written, at most capacity.
+    size_t read_all(void* buffer, size_t capacity) const;
+};
+
+// Background read-ahead: enqueue files known to be needed soon (the next
+// level's manifest, say) and an I/O thread warms them into a bounded
+// in-memory cache. The next mapped_view or read_all of the same path
+// adopts the cached bytes instead of touching the filesystem. Past its
+// byte budget (default 64 MiB) the cache evicts oldest-first.
+void prefetch(std::string_view filename);
+inline void prefetch(const file& f) { prefetch(std::string_view(f.path())); }
+void set_prefetch_budget(size_t bytes);
+
+// Read-only view of a whole file's bytes. Members of directory mounts are
+// memory-mapped straight from disk; archive members (and platforms without
+// mmap) fall back to one bulk read into an owned buffer, which still skips
+// the streambuf's fixed-size window and per-read copies.
+class mapped_view {
+private:
+    const void* m_data;
+    size_t m_length;
+    bool m_mapped; // backed by an OS mapping rather than an owned buffer
+
+public:
+    mapped_view(std::string_view filename);
+    mapped_view(const file& f)
+        : mapped_view(std::string_view(f.path()))
+    {
+    }
+    mapped_view(const mapped_view&) = delete;
+    mapped_view(mapped_view&& other);
+    ~mapped_view();
+
+    const void* data() const { return m_data; }
+    size_t length() const { return m_length; }
 };
 
 class base_stream {
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Always-on scoped CPU instrumentation. PROF_ZONE("name") drops an RAII
+// marker that records its enclosing scope's wall time as one fixed-size
+// event in the calling thread's lock-free ring buffer; a background thread
+// aggregates the rings into per-zone counts and percentiles. Markers never
+// block and never allocate on the hot path, so they are cheap enough to
+// leave in shipping builds; define PROF_DISABLE to compile them away
+// entirely.
+
+namespace prof {
+
+class Zone {
+private:
+    const char* m_name; // must be a string literal; aggregation keys on the pointer
+    uint64_t m_begin_ns;
+
+public:
+    explicit Zone(const char* name);
+    Zone(const Zone&) = delete;
+    ~Zone();
+};
+
+struct ZoneReport {
+    const char* m_name;
+    uint64_t m_samples;
+    double m_avg_us, m_max_us;
+    // Approximate, read from a log2(ns) histogram: each value is the midpoint
+    // of the bucket the requested rank lands in.
+    double m_p50_us, m_p95_us, m_p99_us;
+};
+
+// Drains every ring and returns the per-zone statistics gathered so far,
+// busiest zone first.
+std::vector<ZoneReport> report();
+// Events lost to writers lapping the aggregator; nonzero means a hotter
+// drain cadence or a bigger ring is warranted.
+uint64_t dropped_events();
+
+// Retains the newest max_events drained events (default 0: retention off) so
+// write_chrome_trace() can export them as a chrome://tracing "traceEvents"
+// JSON file through fs::ostream. Returns false when nothing was retained.
+void set_trace_capacity(size_t max_events);
+bool write_chrome_trace(const std::string& path);
+
+}
+
+#ifdef PROF_DISABLE
+#define PROF_ZONE(name)
+#else
+#define PROF_CONCAT2(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT2(a, b)
+#define PROF_ZONE(name) ::prof::Zone PROF_CONCAT(prof_zone_, __LINE__)(name)
+#endif
@@ -1,17 +1,30 @@
 #pragma once
+#include <functional>
 #include <glm/glm.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include <list>
 #include <stack>
+#include <vector>
 #include <vkw/render.h>
 
+namespace vkw {
+class UploadEngine;
+}
+
 namespace scene {
 
 class Mesh {
 public:
-    virtual void initialize_buffers(vkw::CommandBuffer& cmd) = 0;
+    virtual void initialize_buffers(vkw::UploadEngine& uploads) = 0;
     virtual void cleanup_initialize_buffers() = 0;
-    virtual void draw(vkw::CommandBuffer& cmd) const = 0;
+    virtual void draw(vkw::CommandBuffer& cmd, uint32_t instance_count = 1, uint32_t first_instance = 0) const = 0;
+    // Conservative bounding sphere in mesh-local space (xyz center, w radius);
+    // a non-positive radius opts the mesh out of frustum culling.
+    virtual glm::vec4 bounding_sphere() const { return glm::vec4(0.f); }
+    // Parameters of this mesh's one indexed draw, relative to its own buffer
+    // bindings, for GPU-driven submission; meshes that cannot be drawn
+    // indirectly return false and stay on the CPU path.
+    virtual bool indirect_draw_params(VkDrawIndexedIndirectCommand& cmd) const { return false; }
 };
 
 class Material {
@@ -26,12 +39,28 @@ public:
     virtual void initialize_buffers(vkw::CommandBuffer& cmd) = 0;
     virtual void cleanup_initialize_buffers() = 0;
     virtual const vkw::DescriptorSet& descriptor_set() const { return m_descriptor_set; }
+    // Pipeline this material draws with; nullptr keeps whatever the caller
+    // bound, but materials that answer let DrawList sort and rebind for them.
+    virtual const vkw::Pipeline* pipeline() const { return nullptr; }
 };
 
+class Scene;
+
 class Node {
 protected:
     Node* m_parent;
     std::list<Node*> m_children;
+    // assigned when the owning Scene compiles its flat transform arrays
+    Scene* m_scene = nullptr;
+    uint32_t m_flat_index = 0;
+
+    friend class Scene;
+
+    // Pushes this node's (changed) local transform into the owning Scene's
+    // flat arrays and widens its dirty range; a no-op before compilation.
+    void notify_transform();
+    // Structural change: the owning Scene must recompile before next use.
+    void notify_structure();
 
 public:
     enum class Type {
@@ -53,8 +82,16 @@ public:
     virtual glm::mat4 transform() const { return glm::mat4(); }
     const std::list<Node*>& children() const { return m_children; }
 
-    void add_child(Node* n) { m_children.push_back(n); }
-    void remove_child(Node* n) { m_children.remove(n); }
+    void add_child(Node* n)
+    {
+        m_children.push_back(n);
+        notify_structure();
+    }
+    void remove_child(Node* n)
+    {
+        m_children.remove(n);
+        notify_structure();
+    }
 };
 
 class Group : public Node {
@@ -114,6 +151,7 @@ public:
     void set_rotation(const glm::quat& new_rotation)
     {
         m_rotation = new_rotation;
+        notify_transform();
     }
 };
 
@@ -133,12 +171,33 @@ public:
     void set_translation(const glm::vec3& new_translation)
     {
         m_translation = new_translation;
+        notify_transform();
     }
 };
 
+// Owns the graph and a flattened mirror of its transforms: compile() walks
+// the graph once and lays nodes out in contiguous parent-indexed arrays in
+// depth-first preorder, so every subtree occupies one contiguous index range.
+// World matrices then update with a single linear multiply sweep over the
+// dirty window — set_rotation/set_translation widen it by their subtree, and
+// untouched (static) subtrees outside the window cost nothing per frame.
 class Scene {
     Group m_root;
 
+    std::vector<Node*> m_nodes; // depth-first preorder; parents precede children
+    std::vector<int32_t> m_parents; // -1 for the root
+    std::vector<uint32_t> m_subtree_sizes; // this node plus all descendants
+    std::vector<glm::mat4> m_local_transforms, m_world_transforms;
+    std::vector<std::pair<Geometry*, uint32_t>> m_geometry;
+    uint32_t m_dirty_begin = 0, m_dirty_end = 0;
+    bool m_compiled = false;
+
+    friend class Node;
+
+    uint32_t flatten(Node* node, int32_t parent);
+    void mark_transform_dirty(uint32_t index);
+    void invalidate() { m_compiled = false; }
+
 public:
     Scene()
         : m_root(nullptr)
@@ -146,21 +205,168 @@ public:
     }
 
     inline Node* root() { return &m_root; }
+
+    // (Re)builds the flat arrays; happens automatically on the first visit
+    // and after any add_child/remove_child.
+    void compile();
+    // Sweeps the dirty window, multiplying each local transform by its
+    // parent's already-updated world transform.
+    void update_transforms();
+
+    inline bool compiled() const { return m_compiled; }
+    inline size_t node_count() const { return m_nodes.size(); }
+    inline const glm::mat4& world_transform(uint32_t index) const { return m_world_transforms[index]; }
+    inline const std::vector<std::pair<Geometry*, uint32_t>>& geometries() const { return m_geometry; }
+};
+
+// Six view-frustum planes extracted from a projection * view matrix
+// (Gribb & Hartmann), normalized so a plane dotted with a point gives a
+// signed distance.
+class Frustum {
+    glm::vec4 m_planes[6];
+
+public:
+    explicit Frustum(const glm::mat4& view_proj);
+    // sphere is (center, radius) in world space; a non-positive radius
+    // always passes
+    bool intersects(const glm::vec4& sphere) const;
+    // six (normal, distance) planes, in push-constant-ready order
+    inline const glm::vec4* planes() const { return m_planes; }
+};
+
+// Turns a compiled Scene into a sorted, batched draw list: geometries are
+// culled against the view frustum using their mesh bounding spheres,
+// survivors are sorted by pipeline then material descriptor set so every
+// state bind is shared by a whole run, and adjacent draws of the same
+// mesh+material collapse into one instanced draw. Per-instance world
+// transforms come out in batch order, ready for a storage buffer that the
+// vertex shader indexes with gl_InstanceIndex.
+class DrawList {
+public:
+    struct Batch {
+        const Mesh* m_mesh;
+        const Material* m_material;
+        uint32_t m_first_instance;
+        uint32_t m_instance_count;
+    };
+
+private:
+    std::vector<std::pair<Geometry*, uint32_t>> m_visible;
+    std::vector<Batch> m_batches;
+    std::vector<glm::mat4> m_transforms;
+
+public:
+    // Compiles and updates the scene if needed, then culls, sorts and
+    // batches. transforms() must reach the instance storage buffer before
+    // the batches are recorded.
+    void build(Scene& scene, const Frustum& frustum);
+    // Rebinds pipeline and material descriptor set only when they change
+    // from the previous batch, then issues one instanced draw per batch.
+    void record(vkw::CommandBuffer& cmd, uint32_t material_set) const;
+
+    inline const std::vector<Batch>& batches() const { return m_batches; }
+    inline const std::vector<glm::mat4>& transforms() const { return m_transforms; }
+};
+
+// GPU-driven submission: object bounds and indexed-draw parameters go to a
+// storage buffer in one linear pass per frame (no CPU culling), a compute
+// pass (shaders/cull.comp.glsl) tests each object against the frustum and
+// compacts survivors into VkDrawIndexedIndirectCommands plus a device-side
+// count, and draw() consumes both with a single
+// vkCmdDrawIndexedIndirectCount — constant CPU cost regardless of scene
+// size. Requires features12().drawIndirectCount and meshes that answer
+// indirect_draw_params(); the caller binds vertex/index buffers and
+// descriptor sets once, so culled geometry must share one set of bindings.
+class GpuCuller {
+public:
+    struct Object { // std430 mirror of cull.comp.glsl's CullObject
+        glm::vec4 m_bounds; // world-space sphere; w <= 0 always draws
+        uint32_t m_index_count;
+        uint32_t m_first_index;
+        int32_t m_vertex_offset;
+        uint32_t m_first_instance; // slot in the instance transform buffer
+    };
+
+private:
+    vkw::HostBuffer<2> m_objects;
+    vkw::Buffer<2> m_commands;
+    vkw::Buffer<2> m_count;
+    std::vector<Object> m_staging;
+    std::vector<glm::mat4> m_transforms;
+    uint32_t m_capacity;
+    uint32_t m_object_count = 0;
+
+public:
+    GpuCuller(vkw::Allocator& allocator, uint32_t capacity);
+
+    // One linear pass over the scene's flat arrays: world-space bounds and
+    // draw parameters per geometry, world transforms in slot order for the
+    // instance storage buffer.
+    void upload(Scene& scene);
+    // Zeroes the count, dispatches the culling pipeline (built through
+    // PipelineFactory::ComputePipelineSpecification) and barriers the
+    // command and count buffers for indirect consumption; record before the
+    // render pass. descriptor_set binds objects()/commands()/count() at
+    // bindings 0/1/2.
+    void dispatch(vkw::CommandBuffer& cmd, const vkw::Pipeline& pipeline, VkDescriptorSet descriptor_set, const Frustum& frustum);
+    // Issues every surviving draw; record inside the render pass after
+    // binding geometry buffers and descriptor sets.
+    void draw(vkw::CommandBuffer& cmd) const;
+
+    inline const vkw::HostBuffer<2>& objects() const { return m_objects; }
+    inline const vkw::Buffer<2>& commands() const { return m_commands; }
+    inline const vkw::Buffer<2>& count() const { return m_count; }
+    inline const std::vector<glm::mat4>& transforms() const { return m_transforms; }
 };
 
 class SceneVisitor {
     std::stack<glm::mat4> m_matrix_stack;
+    const glm::mat4* m_current = nullptr; // flat path; stack top otherwise
 
 public:
     SceneVisitor();
 
-    void visit(Scene& scene) { visit(scene.root()); }
+    // Compiles and updates the scene's flat arrays, then walks the geometry
+    // list in index order — no recursion, no virtual transform() calls.
+    void visit(Scene& scene);
     void visit(Node* node);
-    inline const glm::mat4& current_matrix() const { return m_matrix_stack.top(); }
+    inline const glm::mat4& current_matrix() const { return m_current ? *m_current : m_matrix_stack.top(); }
 
     virtual void visitGeometry(Geometry& geometry) = 0;
 };
 
+// Records a scene across a worker pool. One cheap single-threaded walk
+// flattens the graph into a draw list; the per-draw recording — the
+// expensive part — is then partitioned across worker threads, each filling
+// its own secondary command buffer, and the results are stitched into the
+// primary buffer with one vkCmdExecuteCommands. The primary's render pass
+// must be begun with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS.
+class ParallelSceneRecorder {
+public:
+    struct DrawItem {
+        Geometry* m_geometry;
+        glm::mat4 m_transform; // flattened world transform
+    };
+
+private:
+    class GatherVisitor : public SceneVisitor {
+    public:
+        std::vector<DrawItem>* m_items = nullptr;
+        virtual void visitGeometry(Geometry& geometry)
+        {
+            m_items->push_back({ &geometry, current_matrix() });
+        }
+    };
+
+    std::vector<DrawItem> m_items;
+
+public:
+    // record_item runs on worker threads; it must only touch the item and
+    // the secondary buffer it is handed.
+    void record(Scene& scene, vkw::ParallelCommandPool& pools, const vkw::RenderPass& render_pass, size_t subpass, const vkw::Framebuffer& framebuffer,
+        vkw::CommandBuffer& primary, const std::function<void(const DrawItem&, vkw::CommandBuffer&)>& record_item);
+};
+
 }
 
 using Scene = scene::Scene;
@@ -1,5 +1,6 @@
 #pragma once
 #include "fs.h"
+#include <array>
 #include <atomic>
 #include <cstdint>
 #include <deque>
@@ -12,7 +13,10 @@
 namespace vkw {
 
 class Allocator;
+class CommandBuffer;
+class Defragmenter;
 class GarbageCollector;
+struct BenchmarkAccess; // defined by the benchmark suite only
 
 enum class MemoryUsage {
     DeviceLocal,
@@ -31,7 +35,9 @@ private:
     VkDeviceSize m_size;
 
     friend class Allocator;
+    friend class Defragmenter;
     friend class GarbageCollector;
+    friend struct BenchmarkAccess;
 
 public:
     SingleAllocation();
@@ -78,20 +84,39 @@ private:
         VkDeviceAddress m_offset;
         Type m_ty;
         uint64_t m_prev, m_next;
+        uint64_t m_free_prev, m_free_next;
+        bool m_in_index;
     };
     class DMemBlock {
     private:
+        // Two-level segregated-fit (TLSF) free-chunk index. The first level
+        // separates chunks by power-of-two size class, the second subdivides
+        // each class into SL_INDEX_COUNT linear bins.
+        static constexpr uint32_t FL_INDEX_COUNT = 40;
+        static constexpr uint32_t SL_INDEX_COUNT = 16;
+        static constexpr uint32_t SL_INDEX_SHIFT = 4;
+
         VkDeviceMemory m_handle;
         size_t m_size;
         bool m_best_fit;
+        std::atomic_bool m_arena; // pinned as some thread's active arena block
+        std::atomic<VkDeviceSize> m_used;
         std::atomic_uint8_t m_map_count;
         std::atomic_uint64_t m_counter;
         void* m_address;
         std::mutex m_mtx;
         std::map<uint64_t, Subchunk> m_chunks;
+        uint64_t m_fl_bitmap;
+        std::array<uint16_t, FL_INDEX_COUNT> m_sl_bitmap;
+        std::array<std::array<uint64_t, SL_INDEX_COUNT>, FL_INDEX_COUNT> m_free_bins;
 
         uint64_t next_chunk_id();
         void merge_free_chunks(uint64_t left, uint64_t right);
+        static void size_class(VkDeviceSize size, uint32_t& fl, uint32_t& sl);
+        void index_insert(uint64_t id);
+        void index_remove(uint64_t id);
+        uint64_t first_free_chunk(uint32_t& fl, uint32_t& sl) const;
+        uint64_t next_free_chunk(uint64_t id, uint32_t& fl, uint32_t& sl) const;
 
         friend class Allocator;
 
@@ -99,41 +124,112 @@ private:
         DMemBlock(VkDeviceMemory handle, VkDeviceSize size, bool best_fit);
         DMemBlock(const DMemBlock&) = delete;
         bool allocate(VkDeviceSize size, VkDeviceSize alignment, bool linear, VkDeviceSize granularity, SingleAllocation&);
-        void free(uint64_t id);
+        VkDeviceSize free(uint64_t id);
         VkDeviceSize allocated() const;
+        VkDeviceSize largest_free_hint() const;
     };
     using Pool = std::vector<std::unique_ptr<DMemBlock>>;
 
+    // Per-thread arena state: one pinned active block per memory type for
+    // small linear allocations, so loader threads never touch the pool mutex
+    // on the hot path. m_epoch names the allocator instance the entry was
+    // built for, so an entry left behind by a destroyed allocator is never
+    // mistaken for this one's.
+    struct ThreadArena {
+        uint64_t m_epoch = 0;
+        std::vector<DMemBlock*> m_active;
+        std::vector<size_t> m_active_index;
+    };
+    // One per thread, destroyed at thread exit: hands each still-live
+    // allocator its arena back so pinned blocks do not outlive their owner
+    // thread.
+    struct ThreadArenaHolder {
+        std::map<Allocator*, ThreadArena> m_arenas;
+        ~ThreadArenaHolder();
+    };
+    // Node of the lock-free MPSC stack that frees are routed through while
+    // arena mode is active.
+    struct PendingFree {
+        PendingFree* m_next;
+        size_t m_type_index, m_block_index;
+        uint64_t m_chunk_id;
+    };
+    static constexpr VkDeviceSize ARENA_BLOCK_SIZE = 1 << 24;
+    static constexpr VkDeviceSize ARENA_MAX_ALLOCATION = 1 << 20;
+
+    // Per-type statistics counters, updated on the allocation paths and
+    // readable without taking any pool mutex.
+    struct TypeCounters {
+        std::atomic<VkDeviceSize> m_used { 0 };
+        std::atomic<VkDeviceSize> m_reserved { 0 };
+        std::atomic_uint32_t m_blocks { 0 };
+    };
+
+    // The live-allocator set lets a departing thread tell whether the
+    // allocator behind one of its arena entries still exists (and whether it
+    // is the same instance, not a successor reusing the address) before it
+    // touches any block pointers.
+    static std::mutex s_arena_mtx;
+    static uint64_t s_arena_epoch_counter;
+    static std::map<const Allocator*, uint64_t> s_live_allocators;
+
     const Device& m_device;
     VkDeviceSize m_buffer_image_granularity;
     bool m_best_fit;
     bool m_integrated_gpu;
+    bool m_use_thread_arenas;
+    uint64_t m_arena_epoch;
 
     std::vector<VkMemoryHeap> m_heaps;
     std::vector<VkMemoryType> m_types;
     std::vector<Pool> m_pools;
     std::deque<std::mutex> m_pool_mtx;
+    std::deque<TypeCounters> m_counters;
+    std::atomic<PendingFree*> m_free_queue;
 
     bool allocate_defensive(VkMemoryRequirements requirements, VkMemoryPropertyFlags r_flags, VkMemoryPropertyFlags p_flags, bool linear, bool dedicated, SingleAllocation& out);
     bool allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags flags, size_t type_index, bool linear, bool dedicated, SingleAllocation& out);
+    bool allocate_from_arena(VkMemoryRequirements requirements, size_t type_index, SingleAllocation& out);
     size_t find_type_index(VkMemoryRequirements requirements, VkMemoryPropertyFlags flags) const;
     std::unique_ptr<DMemBlock> create_memory_block(VkDeviceSize size, size_t type_index);
     size_t insert_block(Pool& pool, std::unique_ptr<DMemBlock>& block);
+    ThreadArena& thread_arena();
+    void abandon_arena(ThreadArena& arena);
+    void release(size_t type_index, size_t block_index, uint64_t chunk_id);
     void clear();
 
     VkMemoryPropertyFlags required_flags(MemoryUsage usage) const;
     VkMemoryPropertyFlags preferred_flags(MemoryUsage usage) const;
 
+    friend class Defragmenter;
+    friend struct BenchmarkAccess; // drives DMemBlock and the allocation path directly
+
 public:
-    Allocator(const Device& device, bool best_fit = false);
+    struct TypeStats {
+        VkDeviceSize m_used; // bytes handed out to live allocations
+        VkDeviceSize m_reserved; // bytes of VkDeviceMemory backing the pool
+        uint32_t m_block_count;
+        float m_fragmentation; // 0: free space is one contiguous range; toward 1: shattered
+    };
+    struct HeapStats {
+        VkDeviceSize m_size = 0; // total heap size reported by the implementation
+        VkDeviceSize m_used = 0, m_reserved = 0; // summed over the heap's memory types
+        VkDeviceSize m_budget = 0, m_usage = 0; // from VK_EXT_memory_budget; zero when unsupported
+    };
+
+    Allocator(const Device& device, bool best_fit = false, bool thread_arenas = false);
     Allocator(const Allocator&) = delete;
     ~Allocator();
 
     const Device& device() const { return m_device; }
+    size_t type_count() const { return m_types.size(); }
+    TypeStats type_stats(size_t type_index);
+    std::vector<HeapStats> heap_stats() const;
 
     bool allocate(VkBuffer buffer, MemoryUsage usage, SingleAllocation& out);
     bool allocate(VkImage image, MemoryUsage usage, SingleAllocation& out);
     void free(SingleAllocation&);
+    void drain_free_queue();
 
     void* map_memory(const SingleAllocation&);
     void unmap_memory(const SingleAllocation&);
@@ -141,4 +237,37 @@ public:
     void invalidate(const SingleAllocation&) const;
 };
 
+// Incrementally compacts fragmented device-memory pools. Callers register
+// relocatable buffers with watch(); each run() drains mostly-empty blocks by
+// recording buffer copies (up to a per-frame byte budget) into the given
+// command buffer, which should be submitted on the Transfer queue, then
+// rebinds the registered buffers to their new memory. Old handles and chunks
+// go through the GarbageCollector, so they outlive any in-flight frames that
+// still reference them. Registered buffers must have been created with both
+// VK_BUFFER_USAGE_TRANSFER_SRC_BIT and VK_BUFFER_USAGE_TRANSFER_DST_BIT, and
+// descriptor sets referring to a moved buffer must be rewritten by the caller
+// before the next frame is recorded.
+class Defragmenter {
+private:
+    struct WatchedBuffer {
+        Buffer<1>* m_buffer;
+        VkBufferUsageFlags m_usage;
+        MemoryUsage m_mem_usage;
+    };
+
+    Allocator& m_allocator;
+    VkDeviceSize m_byte_budget;
+    std::vector<WatchedBuffer> m_watched;
+
+    bool should_move(const SingleAllocation& a);
+
+public:
+    Defragmenter(Allocator& allocator, VkDeviceSize byte_budget_per_frame);
+    Defragmenter(const Defragmenter&) = delete;
+
+    void watch(Buffer<1>& buffer, VkBufferUsageFlags usage, MemoryUsage mem_usage);
+    void unwatch(Buffer<1>& buffer);
+    bool run(CommandBuffer& cmd, GarbageCollector& gc);
+};
+
 }
@@ -6,9 +6,11 @@
 #include <GLFW/glfw3.h>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace vkw {
@@ -28,18 +30,22 @@ private:
 
     VkSwapchainKHR m_handle;
     VkSurfaceFormatKHR m_surface_format;
+    VkPresentModeKHR m_present_mode;
     VkExtent2D m_extent;
     std::vector<VkImage> m_images;
     std::vector<VkImageView> m_image_views;
 
 public:
-    Swapchain(VkDevice device, VkSurfaceKHR surface, GLFWwindow* window, VkPhysicalDevice hwd, VkSwapchainKHR old_swapchain = VK_NULL_HANDLE);
+    // present_mode_preference lists modes most-preferred first; the first one
+    // the surface supports wins, with FIFO (always available) as fallback.
+    Swapchain(VkDevice device, VkSurfaceKHR surface, GLFWwindow* window, VkPhysicalDevice hwd, const std::vector<VkPresentModeKHR>& present_mode_preference, VkSwapchainKHR old_swapchain = VK_NULL_HANDLE);
     Swapchain(const Swapchain&) = delete;
     ~Swapchain();
 
     inline operator VkSwapchainKHR() const { return m_handle; }
     inline size_t image_count() const { return m_images.size(); }
     inline VkFormat format() const { return m_surface_format.format; }
+    inline VkPresentModeKHR present_mode() const { return m_present_mode; }
     inline uint32_t width() const { return m_extent.width; }
     inline uint32_t height() const { return m_extent.height; }
     inline const VkImageView& image_view(size_t i) const { return m_image_views[i]; }
@@ -58,6 +64,7 @@ private:
     friend class Device;
 
     std::unique_ptr<Swapchain> m_swapchain;
+    std::vector<VkBuffer> m_buffers;
     std::vector<VkFramebuffer> m_framebuffers;
     std::vector<VkImage> m_images;
     std::vector<VkImageView> m_image_views;
@@ -67,6 +74,15 @@ private:
 
 public:
     void add(std::unique_ptr<Swapchain>&& s) { m_swapchain = std::move(s); }
+    void add(VkBuffer b) { m_buffers.push_back(b); }
+    void add(VkImage i) { m_images.push_back(i); }
+    void add(Allocator& allocator, SingleAllocation& a)
+    {
+        auto& allocation = m_allocations.emplace_back();
+        allocation.first = &allocator;
+        allocation.second = a;
+        a.reset();
+    }
     template <unsigned int N>
     void add(Image<N>& x)
     {
@@ -88,6 +104,58 @@ public:
     void add(Framebuffer& x);
 };
 
+// Timestamp-query GPU profiler. Each frame in flight owns a VkQueryPool;
+// zones record paired vkCmdWriteTimestamp queries, and a slot's results are
+// read back when the slot is reused — after the pacing wait, so
+// frames_in_flight frames later and without ever stalling — then folded into
+// per-zone statistics calibrated with the device's timestampPeriod. When the
+// device lacks hostQueryReset or timestamps on the combined family, every
+// call is a cheap no-op, so zones can stay compiled into release builds.
+class GpuProfiler {
+public:
+    struct ZoneStats {
+        std::string m_name;
+        uint64_t m_samples = 0;
+        double m_min_us = 0, m_avg_us = 0, m_max_us = 0;
+    };
+
+private:
+    friend class Device;
+
+    static constexpr uint32_t MAX_ZONES = 128; // per frame; two queries apiece
+
+    struct frame_queries {
+        VkQueryPool m_pool = VK_NULL_HANDLE;
+        std::vector<std::string> m_zones; // in issue order
+    };
+    struct zone_accum {
+        std::string m_name;
+        uint64_t m_samples = 0;
+        double m_total_us = 0, m_min_us = 0, m_max_us = 0;
+    };
+
+    const Device* m_owner = nullptr;
+    VkDevice m_device = VK_NULL_HANDLE;
+    double m_timestamp_period = 0; // nanoseconds per tick
+    std::vector<frame_queries> m_frames;
+    std::vector<zone_accum> m_zones;
+
+    void initialize(const Device& device);
+    void destroy();
+    zone_accum& accumulator(const std::string& name);
+
+public:
+    inline bool enabled() const { return m_device != VK_NULL_HANDLE; }
+    // Reclaims the current frame slot's pool: folds its now-complete results
+    // into the statistics and resets it for rerecording. Call once per frame,
+    // after Device::wait_frame_slot.
+    void begin_frame();
+    uint32_t begin_zone(VkCommandBuffer cmd, const char* name);
+    void end_zone(VkCommandBuffer cmd, uint32_t zone);
+    std::vector<ZoneStats> results() const;
+    void reset_statistics();
+};
+
 class QueueSubmission {
 private:
     typedef struct {
@@ -98,8 +166,10 @@ private:
 
     const Device& m_device;
     std::vector<one_submission_t> m_submits;
+    bool m_signal_frame = false;
 
     friend class Device;
+    friend class SubmissionChain; // wires chain semaphores into first/last batch
 
     QueueSubmission(const Device& device)
         : m_device(device)
@@ -110,12 +180,32 @@ private:
 public:
     QueueSubmission& wait_on(VkSemaphore sem, VkPipelineStageFlags stage);
     QueueSubmission& signal(VkSemaphore sem);
+    // Signals the device's frame timeline with current_frame() + 1 when this
+    // submission finishes executing; Device::wait_frame_slot blocks on it.
+    QueueSubmission& signal_frame();
     QueueSubmission& add(const CommandBuffer& cb);
     QueueSubmission& next();
     void to_queue(QueueFamilyType ty, size_t index, VkFence signal = VK_NULL_HANDLE);
 };
 
+// Frame-pacing statistics sampled on the CPU around acquire_next_image and
+// present_image, cheap enough to stay on in the field: how long the acquire
+// blocked, the latest present-to-present interval, and a rolling histogram
+// of intervals for spotting pacing regressions.
+struct FramePacingStats {
+    static constexpr size_t INTERVAL_BUCKET_COUNT = 32;
+    static constexpr double INTERVAL_BUCKET_MS = 0.5; // the last bucket is open-ended
+
+    uint64_t m_acquire_samples = 0, m_interval_samples = 0;
+    double m_last_acquire_block_ms = 0, m_avg_acquire_block_ms = 0, m_max_acquire_block_ms = 0;
+    double m_last_interval_ms = 0;
+    std::array<uint32_t, INTERVAL_BUCKET_COUNT> m_interval_histogram {};
+};
+
 class Device {
+public:
+    static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+
 private:
     static PFN_vkDestroyDebugUtilsMessengerEXT s_vkDestroyDebugUtilsMessenger;
     static constexpr int num_required_device_extensions = 1;
@@ -130,9 +220,13 @@ private:
     VkPhysicalDevice m_hwd;
     VkDevice m_device;
     std::unique_ptr<Swapchain> m_swapchain;
+    std::vector<VkPresentModeKHR> m_present_mode_preference { VK_PRESENT_MODE_MAILBOX_KHR };
     std::deque<std::pair<GarbageCollector, uint32_t>> m_retiring;
     uint32_t m_swapchain_image_index;
+    uint32_t m_frames_in_flight;
     std::atomic_uint32_t m_frame_number = 0;
+    VkSemaphore m_frame_timeline = VK_NULL_HANDLE;
+    GpuProfiler m_gpu_profiler;
     std::function<void(const Device&, GarbageCollector&)> m_recreate_swapchain_cb;
     struct {
         int32_t combined, compute, transfer;
@@ -140,19 +234,25 @@ private:
     } m_queue_family_indexes;
 
     VkPhysicalDeviceLimits m_device_limits {};
+    VkPhysicalDeviceVulkan12Properties m_device_limits12 {};
     VkPhysicalDeviceFeatures2 m_device_features {};
     VkPhysicalDeviceVulkan11Features m_device_features11 {};
     VkPhysicalDeviceVulkan12Features m_device_features12 {};
 
     float m_max_anisotropy = 0;
+    bool m_memory_budget = false;
+
+    FramePacingStats m_pacing {};
+    std::chrono::steady_clock::time_point m_last_present_time {};
 
     VkPhysicalDevice pick_physical_device();
     std::vector<VkDeviceQueueCreateInfo> describe_device_queues();
     void create_logical_device();
+    void recreate_swapchain();
     void wait_for_window_foreground();
 
 public:
-    Device(GLFWwindow*);
+    Device(GLFWwindow*, uint32_t frames_in_flight = 2);
     ~Device();
 
     inline GLFWwindow* window() const { return m_window; }
@@ -163,21 +263,43 @@ public:
     inline const Swapchain& swapchain() const { return *m_swapchain; }
 
     inline const VkPhysicalDeviceLimits& limits() const { return m_device_limits; }
+    inline const VkPhysicalDeviceVulkan12Properties& limits12() const { return m_device_limits12; }
     inline const VkPhysicalDeviceFeatures& features10() const { return m_device_features.features; }
     inline const VkPhysicalDeviceVulkan11Features& features11() const { return m_device_features11; }
     inline const VkPhysicalDeviceVulkan12Features& features12() const { return m_device_features12; }
     inline const float max_anisotropy() const { return m_max_anisotropy; }
+    inline bool has_memory_budget() const { return m_memory_budget; }
 
     int32_t queue_family_index(QueueFamilyType t) const;
     uint32_t queue_count(QueueFamilyType t) const;
     VkQueue queue(QueueFamilyType t, size_t index = 0) const;
+    // True when the hardware exposes a compute-only family distinct from the
+    // combined graphics family, so compute submissions can overlap graphics.
+    inline bool has_async_compute() const { return m_queue_family_indexes.compute != -1; }
 
     void acquire_next_image(VkSemaphore ready_signal);
     inline uint32_t current_frame() const { return m_frame_number; }
     inline uint32_t current_frame_image() const { return m_swapchain_image_index; }
+    inline uint32_t frames_in_flight() const { return m_frames_in_flight; }
+    // Which per-frame resource slot the current frame uses.
+    inline uint32_t frame_index() const { return m_frame_number % m_frames_in_flight; }
+    inline VkSemaphore frame_timeline() const { return m_frame_timeline; }
+    // Blocks until the frame that last used this frame's resource slot has
+    // finished executing, as reported by the frame timeline semaphore; a no-op
+    // for the first frames_in_flight() frames. Returns false on timeout.
+    bool wait_frame_slot(uint64_t timeout = UINT64_MAX) const;
+    inline GpuProfiler& gpu_profiler() { return m_gpu_profiler; }
+    inline const GpuProfiler& gpu_profiler() const { return m_gpu_profiler; }
     QueueSubmission submit_commands() const;
     void present_image(const std::initializer_list<VkSemaphore>& wait_sem);
     void on_recreate_swapchain(const std::function<void(const Device&, GarbageCollector&)>& cb) { m_recreate_swapchain_cb = cb; }
+    // Preferred present modes, most preferred first (say MAILBOX for latency
+    // on mains power, FIFO on battery); unsupported entries are skipped and
+    // FIFO is the final fallback. Applied immediately when recreate is true,
+    // otherwise at the next swapchain recreation.
+    void set_present_mode_preference(std::vector<VkPresentModeKHR>&& preference, bool recreate = false);
+    inline const FramePacingStats& pacing_stats() const { return m_pacing; }
+    inline void reset_pacing_stats() { m_pacing = FramePacingStats {}; }
 
     bool wait_for_fences(const std::initializer_list<VkFence>& fences, bool wait_all, uint64_t timeout) const;
 };
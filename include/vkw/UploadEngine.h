@@ -0,0 +1,67 @@
+#pragma once
+#include "Device.h"
+#include "resource.h"
+#include <array>
+#include <functional>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkw {
+
+// Streams buffer data to device-local memory over the transfer queue while
+// rendering continues, instead of recording copies on the graphics queue and
+// idling the whole device. Copies are staged into a persistent ring buffer
+// (or recorded straight out of an existing host buffer), batched, and
+// submitted with a semaphore handoff and queue-family ownership transfer to
+// graphics. A batch's completion callback fires from poll() or finish() once
+// the GPU is done with it, which is where staging cleanup belongs.
+class UploadEngine {
+private:
+    static constexpr size_t BATCH_COUNT = 2;
+    struct Batch {
+        VkCommandBuffer m_transfer_cmd, m_acquire_cmd;
+        VkSemaphore m_handoff, m_done;
+        VkFence m_fence;
+        std::function<void()> m_on_complete;
+        VkDeviceSize m_reclaim; // ring cursor released when this batch retires
+        bool m_submitted;
+    };
+
+    const Device& m_device;
+    Allocator& m_allocator;
+    HostBuffer<1> m_staging;
+    void* m_staging_map;
+    VkDeviceSize m_head, m_tail;
+
+    VkCommandPool m_transfer_pool, m_acquire_pool;
+    std::array<Batch, BATCH_COUNT> m_batches;
+    size_t m_current, m_retire, m_in_flight;
+    bool m_recording;
+    std::vector<VkBufferMemoryBarrier> m_release_barriers, m_acquire_barriers;
+
+    void begin_batch();
+    VkDeviceSize reserve(VkDeviceSize length);
+    void add_ownership_transfer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size);
+    void retire_oldest(bool wait);
+
+public:
+    UploadEngine(const Device& device, Allocator& allocator, VkDeviceSize staging_size = 1 << 24);
+    UploadEngine(const UploadEngine&) = delete;
+    ~UploadEngine();
+
+    // Stage `length` bytes in the ring and record a copy into dst.
+    void upload(Buffer<1>& dst, const void* data, size_t length, VkDeviceSize dst_offset = 0);
+    void upload(Buffer<1>& dst, fs::istream&& input, size_t length, VkDeviceSize dst_offset = 0);
+    // Record a copy out of an already host-visible buffer; the source must
+    // stay alive until the batch's completion callback runs.
+    void copy(Buffer<1>& dst, Buffer<1>& src_buffer, VkDeviceSize src_offset = 0);
+
+    // Submit everything recorded since the last submit. `on_complete` fires
+    // from poll() or finish() once the copies have landed; the returned
+    // semaphore gates the first submission that consumes the data.
+    VkSemaphore submit(std::function<void()>&& on_complete = nullptr);
+    void poll();
+    void finish();
+};
+
+}
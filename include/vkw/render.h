@@ -3,7 +3,11 @@
 #include "Device.h"
 #include "resource.h"
 #include <array>
+#include <atomic>
+#include <deque>
 #include <list>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <vulkan/vulkan.h>
@@ -22,13 +26,13 @@ static constexpr size_t DESCRIPTOR_SET_COUNT = 4;
 class Fence {
 private:
     const Device& m_device;
-    std::array<VkFence, 2> m_handle;
+    std::vector<VkFence> m_handle;
 
 public:
     Fence(const Device&, bool signaled = false);
     ~Fence();
 
-    inline operator VkFence() const { return m_handle[m_device.current_frame() % 2]; }
+    inline operator VkFence() const { return m_handle[m_device.frame_index()]; }
     bool wait(uint64_t timeout = std::numeric_limits<uint64_t>::max()) const;
     void reset() const;
 };
@@ -36,13 +40,45 @@ public:
 class Semaphore {
 private:
     const Device& m_device;
-    std::array<VkSemaphore, 2> m_handle;
+    std::vector<VkSemaphore> m_handle;
 
 public:
     Semaphore(const Device&);
     ~Semaphore();
 
-    inline operator VkSemaphore() const { return m_handle[m_device.current_frame() % 2]; }
+    inline operator VkSemaphore() const { return m_handle[m_device.frame_index()]; }
+};
+
+// Orders one frame's submissions across queues, e.g. graphics feeding async
+// compute feeding graphics. Each link is a QueueSubmission bound for one
+// queue; submit() wires a binary semaphore between adjacent links (waited at
+// the stage the later link declared) and flushes them in order, then clears
+// the links so the chain can be rebuilt next frame. The semaphores are owned
+// by the chain and recycled per frame slot. Resources handed between queue
+// families in exclusive sharing mode must also transfer ownership through
+// CommandBuffer's release/acquire_*_ownership helpers.
+class SubmissionChain {
+private:
+    struct link {
+        QueueFamilyType m_family;
+        size_t m_queue_index;
+        VkPipelineStageFlags m_wait_stage;
+        QueueSubmission m_submission;
+    };
+
+    const Device& m_device;
+    std::deque<link> m_links;
+    std::deque<Semaphore> m_semaphores;
+
+public:
+    SubmissionChain(const Device& device)
+        : m_device(device)
+    {
+    }
+    SubmissionChain(const SubmissionChain&) = delete;
+
+    QueueSubmission& add(QueueFamilyType ty, size_t queue_index = 0, VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void submit();
 };
 
 class Sampler {
@@ -80,34 +116,68 @@ public:
     inline operator VkSampler() const { return m_handle; }
 };
 
+class DescriptorPool;
+
 class DescriptorSet {
 private:
+    // last contents written to one binding, kept per frame slot so a rebind
+    // with identical contents never produces a descriptor write
+    struct binding_state {
+        uint32_t m_binding = 0;
+        VkDescriptorType m_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        bool m_is_image = false;
+        std::array<VkDescriptorBufferInfo, Device::MAX_FRAMES_IN_FLIGHT> m_buffers {};
+        std::array<VkDescriptorImageInfo, Device::MAX_FRAMES_IN_FLIGHT> m_images {};
+        std::array<bool, Device::MAX_FRAMES_IN_FLIGHT> m_dirty {};
+        // whether a slot has ever been given real contents; per-frame bind
+        // overloads only fill the current slot, and a slot that was never
+        // filled must not be written (its info is zeroed, buffer/view null)
+        std::array<bool, Device::MAX_FRAMES_IN_FLIGHT> m_written {};
+    };
+
     const Device& m_device;
+    DescriptorPool& m_pool;
+    VkDescriptorSetLayout m_layout;
     VkSampler m_active_sampler;
-    std::array<VkDescriptorSet, 2> m_handle;
-
-    std::vector<VkWriteDescriptorSet> m_writes;
-    std::vector<VkDescriptorBufferInfo> m_buffers;
-    std::vector<VkDescriptorImageInfo> m_images;
+    std::vector<VkDescriptorSet> m_handle; // one per frame in flight
+    std::vector<binding_state> m_bindings; // sorted by binding number
 
     friend class DescriptorPool;
 
-    DescriptorSet(const Device& device, VkDescriptorSet h0, VkDescriptorSet h1)
+    DescriptorSet(const Device& device, DescriptorPool& pool, VkDescriptorSetLayout layout, std::vector<VkDescriptorSet>&& handles)
         : m_device(device)
+        , m_pool(pool)
+        , m_layout(layout)
         , m_active_sampler(VK_NULL_HANDLE)
-        , m_handle({ h0, h1 })
+        , m_handle(std::move(handles))
     {
     }
 
+    binding_state& binding(uint32_t binding, VkDescriptorType type, bool is_image);
+    void append_writes(size_t slot, std::vector<VkWriteDescriptorSet>& writes);
+
 public:
     DescriptorSet(DescriptorSet&&) = default;
-    inline operator VkDescriptorSet() const { return m_handle[m_device.current_frame() % 2]; }
+    // Returns the underlying handles to the pool's per-layout free list for
+    // reuse — no vkFreeDescriptorSets, no pool reset. Destroy a set only
+    // after the frames that bound it have retired.
+    ~DescriptorSet();
+    inline operator VkDescriptorSet() const { return m_handle[m_device.frame_index()]; }
 
     void bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<1>& buffer, VkDeviceSize offset, VkDeviceSize range = VK_WHOLE_SIZE);
     void bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<2>& buffer, VkDeviceSize offset, VkDeviceSize range = VK_WHOLE_SIZE);
+    void bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<3>& buffer, VkDeviceSize offset, VkDeviceSize range = VK_WHOLE_SIZE);
+    void bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<1>& arena, const BufferArena<1>::SubRange& range);
+    void bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<2>& arena, const BufferArena<2>::SubRange& range);
+    void bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<3>& arena, const BufferArena<3>::SubRange& range);
     void bind_image(uint32_t binding, VkDescriptorType type, const ImageView<1>& image, VkImageLayout layout, VkSampler sampler = VK_NULL_HANDLE);
     inline void bind_image_sampler(VkSampler sampler) { m_active_sampler = sampler; }
+    // Writes this set's dirty slots through a descriptor update template
+    // shared by both frame handles; a no-op when nothing changed.
     void update();
+    // Batches every dirty binding of every given set into a single
+    // vkUpdateDescriptorSets call.
+    static void update(const std::initializer_list<DescriptorSet*>& sets);
 };
 
 class Pipeline;
@@ -115,25 +185,94 @@ class Pipeline;
 class DescriptorPool {
 private:
     constexpr static uint32_t POOL_SIZE = 64;
-    static const std::vector<VkDescriptorPoolSize> s_pool_size;
+    static const std::vector<VkDescriptorPoolSize> s_pool_size; // floor for new pools
+
+    // update templates are cached per layout (and entry composition) and
+    // shared by every set allocated from it
+    struct cached_template {
+        VkDescriptorSetLayout m_layout;
+        uint64_t m_hash;
+        VkDescriptorUpdateTemplate m_handle;
+    };
 
     const Device& m_device;
+    // one short-held mutex over pool bookkeeping, the free lists and the
+    // template cache, so loader threads can allocate concurrently
+    std::mutex m_mutex;
     std::list<VkDescriptorPool> m_pools;
     std::list<VkDescriptorPool>::iterator m_current;
-
-    void append_next_pool();
+    std::vector<cached_template> m_templates;
+    // per-layout free lists: handles from destroyed sets are reused by the
+    // next allocate of the same layout, no pool reset needed
+    std::unordered_map<VkDescriptorSetLayout, std::vector<std::vector<VkDescriptorSet>>> m_free_sets;
+    // observed allocation mix, fed back from set bindings; new pools are
+    // sized from it instead of the static table alone
+    std::vector<VkDescriptorPoolSize> m_observed;
+    uint32_t m_sets_allocated = 0;
+
+    // bindless mode: one variable-count, partially-bound, update-after-bind
+    // combined-image-sampler array that the whole scene can index into
+    VkDescriptorPool m_bindless_pool = VK_NULL_HANDLE;
+    VkDescriptorSetLayout m_bindless_layout = VK_NULL_HANDLE;
+    VkDescriptorSet m_bindless_set = VK_NULL_HANDLE;
+    uint32_t m_bindless_capacity = 0, m_bindless_watermark = 0;
+    std::vector<uint32_t> m_bindless_free;
+
+    friend class DescriptorSet;
+
+    void append_next_pool(); // caller holds m_mutex (or is the constructor)
+    void recycle(VkDescriptorSetLayout layout, std::vector<VkDescriptorSet>&& handles);
+    void note_descriptor(VkDescriptorType type, uint32_t count);
+    VkDescriptorUpdateTemplate update_template(VkDescriptorSetLayout layout, const std::vector<VkDescriptorUpdateTemplateEntry>& entries);
 
 public:
     DescriptorPool(const Device&);
     ~DescriptorPool();
 
+    // Thread-safe; recycles a free-listed set of the same layout when one
+    // exists, and grows with an adaptively sized pool when the current pool
+    // runs out.
     DescriptorSet allocate(VkDescriptorSetLayout layout);
+    // Returns every pool's capacity at once; outstanding DescriptorSets and
+    // free-listed handles are invalidated, so this is for teardown-scale
+    // moments only — individual sets recycle themselves on destruction.
     void reset();
+
+    // Creates the global descriptor array; false when the device lacks the
+    // descriptor-indexing features. Slots handed out by bindless_bind stay
+    // stable for an ImageView's lifetime, so materials can address their
+    // textures with a push-constant index instead of a per-draw set bind.
+    bool init_bindless(uint32_t capacity);
+    inline bool has_bindless() const { return m_bindless_set != VK_NULL_HANDLE; }
+    inline VkDescriptorSetLayout bindless_layout() const { return m_bindless_layout; }
+    inline VkDescriptorSet bindless_set() const { return m_bindless_set; }
+    uint32_t bindless_bind(const ImageView<1>& image, VkSampler sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    void bindless_release(uint32_t slot);
 };
 
+class PipelineLayout;
+
 // TODO: Fold into Device class?
 using Shader = size_t;
 class ShaderFactory {
+public:
+    // Interface data reflected from a module's SPIR-V when it is opened.
+    struct ReflectedBinding {
+        uint32_t m_set, m_binding;
+        VkDescriptorType m_type;
+        uint32_t m_count;
+    };
+    struct ReflectedVertexInput {
+        uint32_t m_location;
+        VkFormat m_format;
+        uint32_t m_size;
+    };
+    struct Reflection {
+        std::vector<ReflectedBinding> m_bindings;
+        std::vector<ReflectedVertexInput> m_vertex_inputs; // sorted by location
+        uint32_t m_push_constant_size = 0;
+    };
+
 private:
     struct module {
         VkPipelineShaderStageCreateInfo m_createinfo {};
@@ -151,10 +290,23 @@ private:
         specialization_data(const void* specialization, size_t size, std::vector<VkSpecializationMapEntry>&& index);
     };
 
+    struct cached_set_layout {
+        uint64_t m_hash;
+        std::vector<VkDescriptorSetLayoutBinding> m_bindings;
+        VkDescriptorSetLayout m_handle;
+    };
+    struct cached_pipeline_layout {
+        uint64_t m_hash;
+        std::unique_ptr<PipelineLayout> m_layout;
+    };
+
     VkDevice m_device;
     std::unordered_map<std::string, Shader> m_cache;
     std::vector<specialization_data> m_specialization_data;
     std::vector<module> m_shaders;
+    std::vector<Reflection> m_reflections;
+    std::vector<cached_set_layout> m_set_layouts;
+    std::vector<cached_pipeline_layout> m_pipeline_layouts;
 
 public:
     using Handle = size_t;
@@ -169,6 +321,13 @@ public:
     Shader open(const fs::file& path, VkShaderStageFlagBits stage);
     Shader open(const fs::file& path, VkShaderStageFlagBits stage, const void* specialization, size_t size, std::vector<VkSpecializationMapEntry>&& index);
     inline const module& get(Shader s) const { return m_shaders.at(s); }
+    inline const Reflection& reflection(Shader s) const { return m_reflections.at(s); }
+    // Builds (or reuses) the pipeline layout implied by the given stages'
+    // reflected bindings and push constants. Both the per-set layouts and the
+    // pipeline layout are deduplicated in content-hashed caches, so shaders
+    // with identical interfaces share handles and their descriptor sets stay
+    // bind-compatible across pipelines.
+    const PipelineLayout& reflect_pipeline_layout(const Device& device, const std::vector<Shader>& stages);
 };
 
 class RenderPass;
@@ -179,8 +338,8 @@ private:
     VkExtent2D m_extent;
     std::vector<VkFramebuffer> m_handles;
 
-    void initialize(VkFramebufferCreateInfo&, std::array<std::vector<VkImageView>, 2>& attachments);
-    void initialize(VkFramebufferCreateInfo&, std::array<std::vector<VkImageView>, 2>& attachments, int32_t swapchain_attachment_index);
+    void initialize(VkFramebufferCreateInfo&, std::array<std::vector<VkImageView>, Device::MAX_FRAMES_IN_FLIGHT>& attachments);
+    void initialize(VkFramebufferCreateInfo&, std::array<std::vector<VkImageView>, Device::MAX_FRAMES_IN_FLIGHT>& attachments, int32_t swapchain_attachment_index);
 
     friend class GarbageCollector;
 
@@ -198,12 +357,12 @@ public:
     inline uint32_t height() const { return m_extent.height; }
     inline operator VkFramebuffer() const
     {
-        if (m_handles.size() == 2)
-            return m_handles[m_device.current_frame() % 2];
+        if (m_handles.size() == m_device.frames_in_flight())
+            return m_handles[m_device.frame_index()];
         else if (m_handles.size() == m_device.swapchain().image_count())
             return m_handles[m_device.current_frame_image()];
         else
-            return m_handles[(m_device.current_frame() % 2) * m_device.swapchain().image_count() + m_device.current_frame_image()];
+            return m_handles[m_device.frame_index() * m_device.swapchain().image_count() + m_device.current_frame_image()];
     }
 
     class Builder {
@@ -211,7 +370,7 @@ public:
         uint32_t m_attachment_counter;
         int32_t m_swapchain_attachment_index;
         VkFramebufferCreateInfo m_createinfo;
-        std::array<std::vector<VkImageView>, 2> m_attachments;
+        std::array<std::vector<VkImageView>, Device::MAX_FRAMES_IN_FLIGHT> m_attachments;
 
     public:
         Builder(const RenderPass&);
@@ -219,7 +378,7 @@ public:
         Builder& with_layers(uint32_t layers);
         Builder& with_swapchain_attachment();
         Builder& with_swapchain_attachment(uint32_t index);
-        Builder& with_bound_attachment(uint32_t index, VkImageView, VkImageView);
+        Builder& with_bound_attachment(uint32_t index, VkImageView, VkImageView, VkImageView);
         template <unsigned int N>
         Builder& with_bound_attachment(const vkw::ImageView<N>& image);
 
@@ -336,15 +495,24 @@ private:
     VkDevice m_device;
     VkPipelineLayout m_layout;
     std::array<VkDescriptorSetLayout, DESCRIPTOR_SET_COUNT> m_descriptor_set_layouts;
+    // set layouts shared from elsewhere (ShaderFactory's reflection caches,
+    // DescriptorPool's bindless array) are owned and destroyed by their source
+    std::array<bool, DESCRIPTOR_SET_COUNT> m_owns_set_layouts;
+
+    friend class ShaderFactory;
 
     class Builder {
     private:
         std::array<std::vector<VkDescriptorSetLayoutBinding>, DESCRIPTOR_SET_COUNT> m_bindings;
+        std::array<VkDescriptorSetLayout, DESCRIPTOR_SET_COUNT> m_external_layouts {};
         std::vector<VkPushConstantRange> m_push_constants;
         std::vector<std::vector<VkSampler>> m_immutable_samplers;
 
     public:
         Builder& with_descriptor_binding(uint32_t set, uint32_t binding, VkDescriptorType type, uint32_t count, VkShaderStageFlags stage = VK_SHADER_STAGE_ALL, std::initializer_list<VkSampler> immutable_samplers = {});
+        // Uses an externally owned layout (e.g. DescriptorPool's bindless
+        // array) for one set instead of building it from bindings.
+        Builder& with_external_set_layout(uint32_t set, VkDescriptorSetLayout layout);
         Builder& with_push_constant_range(uint32_t offset, uint32_t size, VkShaderStageFlags stage);
         PipelineLayout build(const Device&);
     };
@@ -352,6 +520,7 @@ private:
     PipelineLayout(const Device& device, VkPipelineLayout layout, std::array<VkDescriptorSetLayout, DESCRIPTOR_SET_COUNT>&& descriptor_set_layouts);
 
 public:
+    PipelineLayout(PipelineLayout&&);
     ~PipelineLayout();
     inline VkDescriptorSetLayout descriptor_set_layout(size_t i) const { return m_descriptor_set_layouts[i]; }
     inline operator VkPipelineLayout() const { return m_layout; }
@@ -388,6 +557,9 @@ public:
     private:
         std::vector<Shader> m_shaders;
         VkPipelineLayout m_layout;
+        uint64_t m_hash = 0;
+
+        void rehash();
 
         friend class PipelineFactory;
 
@@ -396,9 +568,11 @@ public:
             : m_shaders(shaders)
             , m_layout(layout)
         {
+            rehash();
         }
 
         bool operator==(const ComputePipelineSpecification& other) const;
+        inline uint64_t content_hash() const { return m_hash; }
     };
 
     class GraphicsPipelineSpecification {
@@ -419,6 +593,10 @@ public:
         std::vector<VkVertexInputAttributeDescription> m_vertex_input_attributes;
         std::vector<VkVertexInputBindingDescription> m_vertex_input_bindings;
         std::vector<VkPipelineColorBlendAttachmentState> m_color_blend_attachments;
+        uint64_t m_hash = 0;
+
+        // every mutator keeps m_hash current, so factory lookups never hash
+        GraphicsPipelineSpecification& rehash();
 
         GraphicsPipelineSpecification& set_stencil_test_parameters(bool front_face, VkCompareOp compare_op,
             VkStencilOp pass_op, VkStencilOp fail_op, VkStencilOp depth_fail_op,
@@ -429,9 +607,26 @@ public:
     public:
         GraphicsPipelineSpecification(std::vector<Shader>&& shaders, VkPipelineLayout layout);
         bool operator==(const GraphicsPipelineSpecification& other) const;
+        inline uint64_t content_hash() const { return m_hash; }
 
         GraphicsPipelineSpecification& set_vertex_input_attribute(uint32_t location, uint32_t binding, VkFormat format, size_t offset);
         GraphicsPipelineSpecification& set_vertex_input_binding(uint32_t binding, size_t stride, bool by_instance = false);
+        // Declares a compile-time VertexFormat's (vertex.h) planar bindings
+        // and attributes in one call; runs through the ordinary mutators, so
+        // the content hash stays current.
+        template <typename Format>
+        GraphicsPipelineSpecification& set_vertex_format()
+        {
+            for (const auto& binding : Format::bindings())
+                set_vertex_input_binding(binding.binding, binding.stride);
+            for (const auto& attribute : Format::attributes())
+                set_vertex_input_attribute(attribute.location, attribute.binding, attribute.format, attribute.offset);
+            return *this;
+        }
+        // Declares one tightly-packed binding per vertex input reflected from
+        // the shader (binding index == location), matching the planar vertex
+        // layout the meshes here use.
+        GraphicsPipelineSpecification& set_vertex_inputs_from(const ShaderFactory& factory, Shader vertex_shader);
         GraphicsPipelineSpecification& set_primitive_topology(VkPrimitiveTopology topology, bool enable_restart = false);
         GraphicsPipelineSpecification& set_tessellation_patch_control_points(uint32_t n_points);
         GraphicsPipelineSpecification& set_depth_clamp(bool enable);
@@ -477,18 +672,69 @@ private:
     static constexpr VkViewport s_viewport_state_viewport {};
     static constexpr VkRect2D s_viewport_state_scissor {};
 
+    // One submitted compile batch: each worker thread builds its slice of the
+    // specifications with a single vkCreateGraphicsPipelines call against its
+    // own VkPipelineCache; poll_async() merges the caches and adopts results.
+    struct AsyncBatch {
+        std::vector<GraphicsPipelineSpecification> m_specs;
+        std::vector<VkPipeline> m_results;
+        std::vector<VkPipelineCache> m_caches;
+        std::vector<std::thread> m_threads;
+        std::atomic_uint32_t m_remaining { 0 };
+        bool m_integrated = false;
+        std::vector<size_t> m_final_indexes;
+    };
+
+    // Open-addressing index over the spec tables: each slot maps a content
+    // hash to that spec's position in m_compute/m_graphics. Linear probing,
+    // no deletion, grown at 3/4 load; full spec equality runs only when two
+    // hashes collide.
+    struct IndexSlot {
+        uint64_t m_hash = 0;
+        size_t m_index = SIZE_MAX;
+    };
+
     const Device& m_device;
     const ShaderFactory& m_shaders;
     VkPipelineCache m_persistent_cache;
 
-    size_t m_bucket_count;
     std::vector<Pipeline> m_compute, m_graphics;
     std::vector<ComputePipelineSpecification> m_compute_specs;
     std::vector<GraphicsPipelineSpecification> m_graphics_specs;
+    std::vector<IndexSlot> m_compute_index, m_graphics_index;
+    std::deque<AsyncBatch> m_async_batches;
 
-    size_t spec_bucket(const std::vector<Shader>& shaders);
+    template <typename Specification>
+    size_t index_find(const std::vector<IndexSlot>& slots, const std::vector<Specification>& specs, const Specification& spec) const;
+    void index_insert(std::vector<IndexSlot>& slots, uint64_t hash, size_t index);
+    void bake_graphics_createinfo(const GraphicsPipelineSpecification& spec, VkGraphicsPipelineCreateInfo& createinfo,
+        VkPipelineVertexInputStateCreateInfo& vertex_input_state, VkPipelineColorBlendStateCreateInfo& color_blend_state,
+        std::vector<VkPipelineShaderStageCreateInfo>& shader_stages) const;
+    void compile_batch_slice(AsyncBatch& batch, size_t begin, size_t end, size_t cache_index);
 
 public:
+    // Pollable handle for one asynchronously compiled pipeline; get() returns
+    // the fallback until the owning batch has been integrated by poll_async().
+    class FuturePipeline {
+        friend class PipelineFactory;
+
+    private:
+        PipelineFactory* m_factory;
+        const AsyncBatch* m_batch;
+        size_t m_index;
+
+        FuturePipeline(PipelineFactory* factory, const AsyncBatch* batch, size_t index)
+            : m_factory(factory)
+            , m_batch(batch)
+            , m_index(index)
+        {
+        }
+
+    public:
+        inline bool ready() const { return m_batch != nullptr && m_batch->m_integrated; }
+        Pipeline& get(Pipeline& fallback) const;
+    };
+
     PipelineFactory(const Device&, const ShaderFactory&, size_t bucket_count = 16);
     PipelineFactory(const PipelineFactory&) = delete;
     ~PipelineFactory();
@@ -496,13 +742,17 @@ public:
     void write_cache() const;
     Pipeline& get(const ComputePipelineSpecification&);
     Pipeline& get(const GraphicsPipelineSpecification&);
+    std::vector<FuturePipeline> compile_async(std::vector<GraphicsPipelineSpecification>&& specs, size_t worker_count = 0);
+    // Adopts finished worker batches into the factory; returns true while any
+    // batch is still compiling.
+    bool poll_async();
 };
 
 class CommandPool {
 private:
     const Device& m_device;
-    std::array<VkCommandPool, 2> m_handle;
-    std::array<std::vector<CommandBuffer>, 4> m_buffers;
+    std::vector<VkCommandPool> m_handle; // one per frame in flight
+    std::vector<std::vector<CommandBuffer>> m_buffers; // two (primary, secondary) per pool
 
     friend class CommandBuffer; // for m_device field
 
@@ -515,6 +765,23 @@ public:
     CommandBuffer& get(VkCommandBufferLevel level, size_t index);
 };
 
+// One CommandPool per worker thread. Command pools are externally
+// synchronized, so parallel scene recording gives each worker its own pool
+// and secondary buffers; the caller keeps a single primary buffer and
+// stitches the workers' output together with vkCmdExecuteCommands.
+class ParallelCommandPool {
+private:
+    const Device& m_device;
+    std::deque<CommandPool> m_pools;
+
+public:
+    ParallelCommandPool(const Device& device, QueueFamilyType ty, size_t workers, size_t secondary_per_worker, bool transient = false);
+
+    inline size_t worker_count() const { return m_pools.size(); }
+    inline CommandPool& worker(size_t i) { return m_pools[i]; }
+    void reset(bool release_resources = true);
+};
+
 class CommandBuffer {
 private:
     VkCommandBuffer m_handle;
@@ -523,6 +790,11 @@ private:
     VkPipelineBindPoint m_bound_pipeline_bind_point;
     VkPipelineLayout m_bound_pipeline_layout;
 
+    // barriers accumulated by defer_* until the next flush_barriers()
+    std::vector<VkImageMemoryBarrier> m_pending_image_barriers;
+    std::vector<VkBufferMemoryBarrier> m_pending_buffer_barriers;
+    VkPipelineStageFlags m_pending_src_stages = 0, m_pending_dst_stages = 0;
+
     friend class CommandPool;
 
     CommandBuffer(VkCommandBuffer buffer, VkCommandBufferLevel level)
@@ -561,8 +833,35 @@ public:
     void push_constants(VkShaderStageFlags stage, uint32_t offset, uint32_t size, const void* data);
     void bind_vertex_buffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset);
     void set_image_layout(VkImage image, VkImageLayout from, VkImageLayout to, VkImageSubresourceRange& subresource, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    // Accumulates a barrier instead of issuing it; flush_barriers() emits
+    // everything pending as a single vkCmdPipelineBarrier whose stage masks
+    // are the union of the batch. Back-to-back transitions of independent
+    // subresources should be deferred and flushed together.
+    void defer_image_layout(VkImage image, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void defer_buffer_barrier(VkBuffer buffer, VkAccessFlags src_access, VkAccessFlags dst_access, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    // Queue-ownership transfer for exclusive-mode resources: the source queue
+    // records release_*_ownership, the destination queue records the matching
+    // acquire_*_ownership with identical families and layouts, and the two
+    // submissions are ordered with a semaphore (see SubmissionChain). The
+    // barriers join the deferred batch, so follow up with flush_barriers().
+    void release_buffer_ownership(VkBuffer buffer, uint32_t src_family, uint32_t dst_family, VkAccessFlags src_access, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void acquire_buffer_ownership(VkBuffer buffer, uint32_t src_family, uint32_t dst_family, VkAccessFlags dst_access, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void release_image_ownership(VkImage image, uint32_t src_family, uint32_t dst_family, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkAccessFlags src_access, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void acquire_image_ownership(VkImage image, uint32_t src_family, uint32_t dst_family, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkAccessFlags dst_access, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    void flush_barriers();
+    // GPU timing zone; the returned handle closes it in end_zone. A cheap
+    // no-op when the profiler is disabled.
+    inline uint32_t begin_zone(GpuProfiler& profiler, const char* name) { return profiler.begin_zone(*this, name); }
+    inline void end_zone(GpuProfiler& profiler, uint32_t zone) { profiler.end_zone(*this, zone); }
     void set_viewport(float x, float y, float width, float height, float min_depth, float max_depth);
     void set_scissor(int32_t x, int32_t y, uint32_t width, uint32_t height);
+    // Draws up to max_draw_count VkDrawIndexedIndirectCommands from buffer,
+    // taking the actual count from count_buffer; the caller must have
+    // checked features12().drawIndirectCount.
+    void draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer count_buffer, VkDeviceSize count_offset, uint32_t max_draw_count, uint32_t stride = sizeof(VkDrawIndexedIndirectCommand));
+    // Only valid on a primary buffer inside a render pass begun with
+    // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS.
+    void execute_commands(const std::vector<VkCommandBuffer>& buffers);
 
     void end();
 };
@@ -1,6 +1,10 @@
 #pragma once
 #include "Allocator.h"
 #include "Device.h"
+#include <condition_variable>
+#include <future>
+#include <string>
+#include <thread>
 
 namespace vkw {
 
@@ -22,6 +26,16 @@ public:
         : m_allocator(allocator)
     {
     }
+    Allocation(const Allocation&) = delete;
+    // Moving transfers ownership of the allocations: the source is reset so its
+    // eventual free() is a no-op and the memory is released exactly once.
+    Allocation(Allocation&& other)
+        : m_allocator(other.m_allocator)
+        , m_allocations(other.m_allocations)
+    {
+        for (unsigned int i = 0; i < N; i++)
+            other.m_allocations[i].reset();
+    }
     Allocator& allocator() { return m_allocator; }
     const Allocator& allocator() const { return m_allocator; }
     SingleAllocation& operator[](size_t n) { return m_allocations[n]; }
@@ -57,7 +71,7 @@ public:
 
 template <unsigned int N>
 class Buffer {
-    static_assert(N == 1 || N == 2);
+    static_assert(N >= 1 && N <= Device::MAX_FRAMES_IN_FLIGHT);
 
 protected:
     std::array<VkBuffer, N> m_handle;
@@ -67,12 +81,14 @@ protected:
     const Device& device() const { return m_allocation.allocator().device(); }
     void create_empty(Allocator& allocator, MemoryUsage mem_usage, VkBufferUsageFlags usage, VkDeviceSize size, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkBufferCreateFlags flags = 0);
 
+    friend class Defragmenter;
+
 public:
     Buffer(Allocator& allocator, VkDeviceSize size = 0);
     Buffer(Allocator& allocator, MemoryUsage mem_usage, VkBufferUsageFlags usage, VkDeviceSize size, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkBufferCreateFlags flags = 0);
     Buffer(Buffer& src_buffer, MemoryUsage mem_usage, VkBufferUsageFlags usage, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkBufferCreateFlags flags = 0);
     Buffer(const Buffer&) = delete;
-    Buffer(Buffer&&) = default;
+    Buffer(Buffer&& other);
     virtual ~Buffer();
 
     inline operator VkBuffer() const { return m_handle[device().current_frame() % N]; }
@@ -86,11 +102,12 @@ public:
 
 template <unsigned int N>
 class HostBuffer : public Buffer<N> {
-    static_assert(N == 1 || N == 2);
+    static_assert(N >= 1 && N <= Device::MAX_FRAMES_IN_FLIGHT);
 
 public:
     HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, size_t length);
     HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, fs::istream&& input, size_t length);
+    HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, const fs::mapped_view& input);
     HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, const void* input, size_t length);
     HostBuffer(HostBuffer&&) = default;
     virtual ~HostBuffer() { }
@@ -98,6 +115,43 @@ public:
     void write_mapped(const void* data, size_t length);
 };
 
+// Owns one large buffer per usage class and hands out aligned sub-ranges, so
+// small per-material uniform or vertex data does not pay a VkBuffer and a
+// SingleAllocation apiece. Sub-ranges are bump-allocated and recycled all at
+// once with reset(); offsets honor the device's minimum offset alignments for
+// the arena's usage flags.
+template <unsigned int N>
+class BufferArena {
+    static_assert(N >= 1 && N <= Device::MAX_FRAMES_IN_FLIGHT);
+
+public:
+    struct SubRange {
+        VkDeviceSize m_offset = 0;
+        VkDeviceSize m_size = 0;
+
+        inline operator bool() const { return m_size != 0; }
+    };
+
+private:
+    Allocator& m_allocator;
+    Buffer<N> m_buffer;
+    VkDeviceSize m_alignment;
+    VkDeviceSize m_head;
+
+public:
+    BufferArena(Allocator& allocator, MemoryUsage mem_usage, VkBufferUsageFlags usage, VkDeviceSize size, const std::initializer_list<QueueFamilyType>& queue_families = {});
+    BufferArena(const BufferArena&) = delete;
+
+    inline Buffer<N>& buffer() { return m_buffer; }
+    inline const Buffer<N>& buffer() const { return m_buffer; }
+    inline VkDeviceSize capacity() const { return m_buffer.size(); }
+
+    SubRange suballocate(VkDeviceSize size);
+    // Valid only for host-visible arenas; writes into the current frame's buffer.
+    void write(const SubRange& range, const void* data, size_t length);
+    void reset() { m_head = 0; }
+};
+
 class HostImage : public Buffer<1> {
 public:
     enum class InputFormat {
@@ -114,6 +168,8 @@ private:
 
     HostImage(Allocator& allocator);
     HostImage(Allocator& allocator, InputFormat format, fs::istream* input, const void* encoded, size_t encoded_length, bool mipmap);
+    bool read_decode_cache(Allocator& allocator, const char* name, uint64_t source_hash, size_t source_length);
+    void write_decode_cache(const char* name, uint64_t source_hash, size_t source_length, const void* payload, size_t payload_length) const;
 
     template <unsigned int>
     friend class Image;
@@ -123,6 +179,10 @@ public:
         : HostImage(allocator, format, &input, nullptr, 0, mipmap)
     {
     }
+    HostImage(Allocator& allocator, InputFormat format, const fs::mapped_view& input, bool mipmap)
+        : HostImage(allocator, format, nullptr, input.data(), input.length(), mipmap)
+    {
+    }
     HostImage(Allocator& allocator, InputFormat format, const void* encoded, size_t encoded_length, bool mipmap)
         : HostImage(allocator, format, nullptr, encoded, encoded_length, mipmap)
     {
@@ -137,6 +197,47 @@ public:
     inline uint32_t mip_levels() const { return m_createinfo.mipLevels; }
 };
 
+// Decodes batches of encoded images on a pool of worker threads. Each worker
+// runs the normal HostImage construction path, which writes decoded texels
+// straight into mapped staging memory, so texture-heavy loads scale with core
+// count instead of paying one synchronous decode per texture. Results are
+// delivered as futures: poll with wait_for(0) or block in get().
+class ImageDecoder {
+public:
+    struct Request {
+        std::string m_path;
+        HostImage::InputFormat m_format;
+        bool m_mipmap;
+    };
+
+private:
+    struct Job {
+        Request m_request;
+        std::promise<HostImage> m_result;
+    };
+
+    Allocator& m_allocator;
+    std::vector<std::thread> m_workers;
+    std::deque<Job> m_jobs;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    bool m_shutdown;
+
+    void worker_main();
+
+public:
+    ImageDecoder(Allocator& allocator, size_t worker_count = 0);
+    ImageDecoder(const ImageDecoder&) = delete;
+    ~ImageDecoder();
+
+    std::future<HostImage> enqueue(const fs::file& f, HostImage::InputFormat format, bool mipmap);
+    std::future<HostImage> enqueue(const fs::file& f, bool mipmap)
+    {
+        return enqueue(f, HostImage::input_format(f.extension()), mipmap);
+    }
+    std::vector<std::future<HostImage>> enqueue(const std::vector<Request>& batch);
+};
+
 template <unsigned int N>
 class Image {
 private:
@@ -144,16 +245,23 @@ private:
     std::array<VkImage, N> m_handle;
     MemoryUsage m_mem_usage;
     Allocation<N> m_allocation;
+    uint32_t m_base_mip = 0; // source mip level that this image's mip 0 corresponds to
 
     const Device& device() const { return m_allocation.allocator().device(); }
+    void rebuild_mips(HostImage* src_image, uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout);
 
 public:
     Image(Allocator& allocator);
     Image(Allocator& allocator, MemoryUsage mem_usage, VkImageType type, VkImageUsageFlags usage, const VkExtent3D& extent, VkFormat format, int samples, int mip_levels, int layers,
         VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkImageLayout initial_layout = VK_IMAGE_LAYOUT_UNDEFINED, VkImageCreateFlags flags = 0);
     Image(Allocator& allocator, HostImage& src_image, MemoryUsage mem_usage, VkImageUsageFlags usage, VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkImageCreateFlags flags = 0);
+    // Streaming mode: only mips [base_mip, src mip count) are resident; the source must
+    // supply every mip level, since mipmap generation needs a graphics queue. Pass
+    // queue_families = { Graphics, Transfer } if restreaming will be recorded on the
+    // transfer queue, so no ownership transfers are needed.
+    Image(Allocator& allocator, HostImage& src_image, MemoryUsage mem_usage, VkImageUsageFlags usage, uint32_t base_mip, VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL, const std::initializer_list<QueueFamilyType>& queue_families = {}, VkImageCreateFlags flags = 0);
     Image(const Image&) = delete;
-    Image(Image&&) = default;
+    Image(Image&& other);
     ~Image();
 
     inline operator VkImage() const { return m_handle[device().current_frame() % N]; }
@@ -163,15 +271,30 @@ public:
     inline VkFormat format() const { return m_createinfo.format; }
     inline uint32_t layers() const { return m_createinfo.arrayLayers; }
     inline uint32_t mip_levels() const { return m_createinfo.mipLevels; }
+    inline uint32_t base_mip() const { return m_base_mip; }
     inline Allocation<N>& allocation() { return m_allocation; }
     inline const Allocation<N>& allocation() const { return m_allocation; }
 
     void copy_from(HostImage& image, CommandBuffer& cmd);
+    // Change the resident mip floor of a streamed image. A replacement image holding mips
+    // [new_base_mip, src mip count) is created; surviving mips are copied on the GPU, newly
+    // resident mips are uploaded from the source's staging buffer, and the replacement is
+    // returned to current_layout. The old image and its memory are retired through the
+    // garbage collector, so in-flight frames keep rendering from it; recreate any image
+    // views (and rebind descriptors) after the swap. evict_to needs no source since it
+    // only drops mips.
+    void stream_in(HostImage& src_image, uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    void evict_to(uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     void generate_mipmaps(CommandBuffer& cmd, uint32_t mip_start, uint32_t mip_end, const VkExtent3D& extent, uint32_t layer_count, VkImageLayout initial_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VkImageLayout final_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     void resize(const VkExtent3D& new_extent);
     void set_layout(VkImageLayout from, VkImageLayout to, CommandBuffer& cmd, VkImageAspectFlags aspect_flags = VK_IMAGE_ASPECT_COLOR_BIT, VkPipelineStageFlags src_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VkPipelineStageFlags dst_stage_mask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
 };
 
+// How many mip levels streamed images should shed, judged from how close the
+// allocator's heaps sit to their reported budgets. Returns 0 while usage stays
+// under 90% of budget; each step above that corresponds to one mip floor raise.
+uint32_t streaming_mip_pressure(const Allocator& allocator);
+
 template <unsigned int N>
 class ImageView {
 private:
@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <vulkan/vulkan.h>
+
+namespace vkw {
+
+// Bytes per element of the vertex formats the meshes here use; extend the
+// switch as loaders grow new attribute types.
+constexpr uint32_t vertex_format_size(VkFormat format)
+{
+    switch (format) {
+    case VK_FORMAT_R32_SFLOAT:
+    case VK_FORMAT_R32_UINT:
+    case VK_FORMAT_R32_SINT:
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_UINT:
+        return 4;
+    case VK_FORMAT_R32G32_SFLOAT:
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+        return 8;
+    case VK_FORMAT_R32G32B32_SFLOAT:
+        return 12;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+        return 16;
+    default:
+        return 0; // unsupported in a compile-time layout
+    }
+}
+
+// Planar vertex layout declared once, at compile time: attribute i lives in
+// its own tightly packed binding i — the convention the meshes and
+// set_vertex_inputs_from() already follow — and one mesh's streams sit back
+// to back in a single buffer. The generated binding/attribute arrays feed
+// GraphicsPipelineSpecification::set_vertex_format(), which routes them
+// through the ordinary mutators so they land in the specification's content
+// hash, and stream_offset()/size() give meshes their bind offsets and buffer
+// sizes without hand-computed byte counts.
+template <VkFormat... Formats>
+class VertexFormat {
+public:
+    static constexpr uint32_t ATTRIBUTE_COUNT = sizeof...(Formats);
+    static_assert(ATTRIBUTE_COUNT > 0, "a vertex format needs at least one attribute");
+
+    static constexpr std::array<VkFormat, ATTRIBUTE_COUNT> s_formats { Formats... };
+
+    // stride of one attribute's packed stream
+    static constexpr uint32_t stride(uint32_t binding)
+    {
+        return vertex_format_size(s_formats[binding]);
+    }
+
+    static constexpr std::array<VkVertexInputBindingDescription, ATTRIBUTE_COUNT> bindings()
+    {
+        std::array<VkVertexInputBindingDescription, ATTRIBUTE_COUNT> out {};
+        for (uint32_t i = 0; i < ATTRIBUTE_COUNT; i++)
+            out[i] = { i, stride(i), VK_VERTEX_INPUT_RATE_VERTEX };
+        return out;
+    }
+
+    static constexpr std::array<VkVertexInputAttributeDescription, ATTRIBUTE_COUNT> attributes()
+    {
+        std::array<VkVertexInputAttributeDescription, ATTRIBUTE_COUNT> out {};
+        for (uint32_t i = 0; i < ATTRIBUTE_COUNT; i++)
+            out[i] = { i, i, s_formats[i], 0 }; // planar: every in-stream offset is 0
+        return out;
+    }
+
+    // Byte offset of one attribute's stream within a mesh's packed region of
+    // vertex_count vertices.
+    static constexpr VkDeviceSize stream_offset(uint32_t binding, uint32_t vertex_count)
+    {
+        VkDeviceSize offset = 0;
+        for (uint32_t i = 0; i < binding; i++)
+            offset += VkDeviceSize(stride(i)) * vertex_count;
+        return offset;
+    }
+
+    // Total bytes of one mesh's packed vertex streams.
+    static constexpr VkDeviceSize size(uint32_t vertex_count)
+    {
+        return stream_offset(ATTRIBUTE_COUNT, vertex_count);
+    }
+};
+
+}
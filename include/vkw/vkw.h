@@ -4,3 +4,5 @@
 #include "Device.h"
 #include "render.h"
 #include "resource.h"
+#include "UploadEngine.h"
+#include "vertex.h"
@@ -0,0 +1,50 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+struct CullObject { // mirrors scene::GpuCuller::Object
+    vec4 bounds; // world-space sphere (xyz center, w radius); w <= 0 always draws
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint first_instance;
+};
+struct DrawCommand { // VkDrawIndexedIndirectCommand
+    uint index_count;
+    uint instance_count;
+    uint first_index;
+    int vertex_offset;
+    uint first_instance;
+};
+
+layout(set = 0, binding = 0) readonly buffer Objects {
+    CullObject objects[];
+};
+layout(set = 0, binding = 1) writeonly buffer Commands {
+    DrawCommand commands[];
+};
+layout(set = 0, binding = 2) buffer Count {
+    uint draw_count;
+};
+layout(push_constant) uniform Cull {
+    vec4 planes[6];
+    uint object_count;
+};
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= object_count)
+        return;
+
+    CullObject obj = objects[i];
+    if (obj.bounds.w > 0.0) {
+        for (int p = 0; p < 6; p++) {
+            if (dot(planes[p], vec4(obj.bounds.xyz, 1.0)) < -obj.bounds.w)
+                return;
+        }
+    }
+
+    uint slot = atomicAdd(draw_count, 1);
+    commands[slot] = DrawCommand(obj.index_count, 1, obj.first_index, obj.vertex_offset, obj.first_instance);
+}
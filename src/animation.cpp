@@ -0,0 +1,79 @@
+#include "animation.h"
+#include <algorithm>
+#include <cassert>
+
+namespace scene {
+
+uint32_t Animation::add_channel(Node* target, Path path, const std::vector<float>& times)
+{
+    assert(!times.empty());
+    channel& ch = m_channels.emplace_back();
+    ch.m_target = target;
+    ch.m_path = path;
+    ch.m_first_key = m_times.size();
+    ch.m_key_count = times.size();
+    m_times.insert(m_times.end(), times.begin(), times.end());
+    m_duration = std::max(m_duration, times.back());
+    return ch.m_first_key;
+}
+
+Animation& Animation::add_translation_channel(Translation* target, std::vector<float>&& times, std::vector<glm::vec3>&& values)
+{
+    assert(times.size() == values.size());
+    add_channel(target, Path::Translation, times);
+    for (const glm::vec3& v : values)
+        m_values.push_back(glm::vec4(v, 0.f));
+    return *this;
+}
+
+Animation& Animation::add_rotation_channel(Rotation* target, std::vector<float>&& times, std::vector<glm::quat>&& values)
+{
+    assert(times.size() == values.size());
+    add_channel(target, Path::Rotation, times);
+    for (const glm::quat& q : values)
+        m_values.push_back(glm::vec4(q.x, q.y, q.z, q.w));
+    return *this;
+}
+
+void Animation::evaluate(float time)
+{
+    for (channel& ch : m_channels) {
+        const float* times = m_times.data() + ch.m_first_key;
+        const glm::vec4* values = m_values.data() + ch.m_first_key;
+
+        // cursor advance: O(1) while time moves forward; a backwards jump
+        // (looping playback) reseeks with one binary search
+        if (time < times[ch.m_cursor])
+            ch.m_cursor = std::upper_bound(times, times + ch.m_key_count, time) - times - (time >= times[0] ? 1 : 0);
+        while (ch.m_cursor + 1 < ch.m_key_count && times[ch.m_cursor + 1] <= time)
+            ch.m_cursor++;
+
+        glm::vec4 sample;
+        if (time <= times[0]) {
+            sample = values[0];
+        } else if (ch.m_cursor + 1 == ch.m_key_count) {
+            sample = values[ch.m_key_count - 1];
+        } else {
+            // adjacent key pair, contiguous in memory
+            float u = (time - times[ch.m_cursor]) / (times[ch.m_cursor + 1] - times[ch.m_cursor]);
+            if (ch.m_path == Path::Rotation) {
+                const glm::vec4 &a = values[ch.m_cursor], &b = values[ch.m_cursor + 1];
+                glm::quat q = glm::slerp(glm::quat(a.w, a.x, a.y, a.z), glm::quat(b.w, b.x, b.y, b.z), u);
+                sample = glm::vec4(q.x, q.y, q.z, q.w);
+            } else {
+                sample = glm::mix(values[ch.m_cursor], values[ch.m_cursor + 1], u);
+            }
+        }
+
+        switch (ch.m_path) {
+        case Path::Translation:
+            static_cast<Translation*>(ch.m_target)->set_translation(glm::vec3(sample));
+            break;
+        case Path::Rotation:
+            static_cast<Rotation*>(ch.m_target)->set_rotation(glm::quat(sample.w, sample.x, sample.y, sample.z));
+            break;
+        }
+    }
+}
+
+}
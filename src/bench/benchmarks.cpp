@@ -0,0 +1,339 @@
+#include "fs.h"
+#include "scene.h"
+#include "vkw/vkw.h"
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <thread>
+#include <vector>
+
+// Microbenchmarks for the engine's CPU hot paths. The suballocator and scene
+// benchmarks are pure bookkeeping and run anywhere; the ones that need a
+// VkDevice (allocator contention, pipeline lookup, image decode) are skipped
+// when Vulkan is unavailable, so the suite still runs on headless CI boxes.
+
+namespace vkw {
+
+// Friend of Allocator and SingleAllocation (declared in Allocator.h): lets
+// the suite drive DMemBlock's TLSF bookkeeping without a device, and the
+// allocation path with synthesized requirements instead of per-op buffers.
+struct BenchmarkAccess {
+    using DMemBlock = Allocator::DMemBlock;
+
+    static uint64_t chunk_id(const SingleAllocation& a) { return a.m_chunk_id; }
+    static bool allocate(Allocator& allocator, const VkMemoryRequirements& requirements, MemoryUsage usage, SingleAllocation& out)
+    {
+        return allocator.allocate_defensive(requirements, allocator.required_flags(usage), allocator.preferred_flags(usage), true, false, out);
+    }
+};
+
+}
+
+namespace {
+
+// Runs the sample functor a few untimed warm-up passes and then SAMPLES timed
+// ones, reporting the median and best per-operation cost; the median filters
+// scheduler and page-fault noise better than one long averaged run.
+template <typename F>
+void run_bench(const char* name, uint64_t ops_per_sample, F&& sample)
+{
+    constexpr int WARMUP = 2, SAMPLES = 9;
+    std::array<double, SAMPLES> times;
+    for (int i = 0; i < WARMUP; i++)
+        sample();
+    for (int i = 0; i < SAMPLES; i++) {
+        auto t0 = std::chrono::steady_clock::now();
+        sample();
+        times[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    }
+    std::sort(times.begin(), times.end());
+    spdlog::info("{:<44} median {:>10.3f} us/op  best {:>10.3f} us/op  ({} ops/sample)",
+        name, times[SAMPLES / 2] / ops_per_sample, times.front() / ops_per_sample, ops_per_sample);
+}
+
+// Mixed request sizes: mostly small uniform-scale blocks, some mesh-sized
+// ones, the occasional multi-megabyte request — roughly what a loading frame
+// asks the allocator for.
+VkDeviceSize mixed_size(std::mt19937_64& rng)
+{
+    switch (rng() % 8) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        return 256 + rng() % (4 << 10);
+    case 5:
+    case 6:
+        return (16 << 10) + rng() % (240 << 10);
+    default:
+        return (1 << 20) + rng() % (3 << 20);
+    }
+}
+
+void bench_dmem_block(bool best_fit)
+{
+    using DMemBlock = vkw::BenchmarkAccess::DMemBlock;
+    constexpr VkDeviceSize BLOCK_SIZE = VkDeviceSize(1) << 28;
+    constexpr size_t LIVE_TARGET = 512, OPS = 16384;
+
+    // The handle is never dereferenced at this level; allocate()/free() are
+    // pure TLSF bookkeeping, so the block runs without any device memory.
+    DMemBlock block(VK_NULL_HANDLE, BLOCK_SIZE, best_fit);
+    std::mt19937_64 rng(12345);
+    std::vector<uint64_t> live;
+    live.reserve(LIVE_TARGET * 2);
+
+    run_bench(best_fit ? "DMemBlock alloc/free churn (best fit)" : "DMemBlock alloc/free churn (first fit)", OPS, [&]() {
+        for (size_t i = 0; i < OPS; i++) {
+            if (live.size() < LIVE_TARGET || rng() % 2 == 0) {
+                vkw::SingleAllocation a;
+                // a full block just skews later iterations toward frees
+                if (block.allocate(mixed_size(rng), 256, rng() % 4 != 0, 4096, a))
+                    live.push_back(vkw::BenchmarkAccess::chunk_id(a));
+            } else {
+                size_t victim = rng() % live.size();
+                block.free(live[victim]);
+                live[victim] = live.back();
+                live.pop_back();
+            }
+        }
+    });
+}
+
+// The benchmark scene is transform-only — Geometry nodes need a live device
+// for their material descriptor set — so visit() cost here is the compile
+// check plus the world-transform sweep, which is also its per-frame hot path.
+class CountingVisitor : public scene::SceneVisitor {
+public:
+    size_t m_count = 0;
+    virtual void visitGeometry(scene::Geometry& geometry) { m_count++; }
+};
+
+void bench_scene()
+{
+    // 11,111 nodes: branching factor 10, four levels below the root,
+    // alternating Translation and Rotation levels.
+    Scene scene;
+    std::deque<scene::Translation> translations;
+    std::deque<scene::Rotation> rotations;
+    std::vector<scene::Node*> level { scene.root() };
+    for (int depth = 0; depth < 4; depth++) {
+        std::vector<scene::Node*> next;
+        for (scene::Node* parent : level) {
+            for (int i = 0; i < 10; i++) {
+                if (depth % 2 == 0)
+                    next.push_back(&translations.emplace_back(parent, glm::vec3(i, depth, 0.f)));
+                else
+                    next.push_back(&rotations.emplace_back(parent));
+            }
+        }
+        level.swap(next);
+    }
+
+    run_bench("Scene::compile (11k nodes)", 1, [&]() {
+        scene.compile();
+    });
+
+    scene.update_transforms();
+    float phase = 0.f;
+    run_bench("Scene::update_transforms (full dirty sweep)", 1, [&]() {
+        phase += 0.25f;
+        for (int i = 0; i < 10; i++) // dirty every top-level subtree
+            translations[i].set_translation({ phase, float(i), 0.f });
+        scene.update_transforms();
+    });
+    run_bench("Scene::update_transforms (one dirty leaf)", 1, [&]() {
+        phase += 0.25f;
+        rotations.back().set_rotation(glm::quat(glm::vec3(phase, 0.f, 0.f)));
+        scene.update_transforms();
+    });
+
+    CountingVisitor visitor;
+    run_bench("SceneVisitor::visit (11k nodes)", 1, [&]() {
+        phase += 0.25f;
+        translations.back().set_translation({ 0.f, phase, 0.f }); // one depth-2 subtree dirty
+        visitor.visit(scene);
+    });
+}
+
+void bench_allocator_contention(const vkw::Device& device, bool thread_arenas)
+{
+    vkw::Allocator allocator(device, true, thread_arenas);
+
+    // One probe buffer yields the memoryTypeBits that every synthesized
+    // request reuses, keeping vkCreateBuffer out of the timed loop.
+    VkBufferCreateInfo createinfo {};
+    createinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    createinfo.size = 1 << 16;
+    createinfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    createinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VkBuffer probe;
+    VkResult res;
+    if ((res = vkCreateBuffer(device, &createinfo, nullptr, &probe)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateBuffer: {}", res);
+        abort();
+    }
+    VkMemoryRequirements probe_requirements;
+    vkGetBufferMemoryRequirements(device, probe, &probe_requirements);
+    vkDestroyBuffer(device, probe, nullptr);
+
+    constexpr size_t THREADS = 4, OPS = 8192, LIVE_TARGET = 64;
+    run_bench(thread_arenas ? "Allocator::allocate x4 threads (arenas)" : "Allocator::allocate x4 threads (shared pool)", THREADS * OPS, [&]() {
+        std::array<std::thread, THREADS> workers;
+        for (size_t t = 0; t < THREADS; t++) {
+            workers[t] = std::thread([&allocator, &probe_requirements, t]() {
+                std::mt19937_64 rng(1000 + t);
+                std::vector<vkw::SingleAllocation> live;
+                live.reserve(LIVE_TARGET * 2);
+                for (size_t i = 0; i < OPS; i++) {
+                    if (live.size() < LIVE_TARGET || rng() % 2 == 0) {
+                        VkMemoryRequirements requirements = probe_requirements;
+                        requirements.size = std::min<VkDeviceSize>(mixed_size(rng), 1 << 20);
+                        requirements.alignment = 256;
+                        vkw::SingleAllocation a;
+                        if (vkw::BenchmarkAccess::allocate(allocator, requirements, vkw::MemoryUsage::DeviceLocal, a))
+                            live.push_back(a);
+                    } else {
+                        size_t victim = rng() % live.size();
+                        allocator.free(live[victim]);
+                        live[victim] = live.back();
+                        live.pop_back();
+                    }
+                }
+                for (auto& a : live)
+                    allocator.free(a);
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+        allocator.drain_free_queue();
+    });
+}
+
+void bench_pipeline_lookup(const vkw::Device& device)
+{
+    vkw::ShaderFactory shader_factory(device);
+    vkw::Shader vert = shader_factory.open(fs::file("/rs/shaders/box.vert.spv"), VK_SHADER_STAGE_VERTEX_BIT),
+                frag = shader_factory.open(fs::file("/rs/shaders/box.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT);
+
+    // Minimal render pass compatible with the box pipeline.
+    vkw::RenderPass render_pass(device);
+    vkw::RenderPass::Builder render_pass_builder;
+    auto& color_att = render_pass_builder.add_attachment(device.swapchain().format(), 1)
+                          .with_color_operations(VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE)
+                          .final_layout(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    auto& depth_att = render_pass_builder.add_attachment(VK_FORMAT_D24_UNORM_S8_UINT, 1)
+                          .with_color_operations(VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE)
+                          .final_layout(VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    render_pass_builder.add_subpass(VK_PIPELINE_BIND_POINT_GRAPHICS)
+        .with_color_attachment(color_att, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+        .with_depth_attachment(depth_att, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    render_pass.build(render_pass_builder);
+
+    vkw::PipelineLayout pipeline_layout = vkw::PipelineLayout::build()
+                                              .with_descriptor_binding(1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+                                              .with_descriptor_binding(2, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+                                              .with_descriptor_binding(3, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
+                                              .build(device);
+
+    vkw::PipelineFactory pipeline_factory(device, shader_factory);
+    constexpr size_t SPEC_COUNT = 1024;
+    std::vector<vkw::PipelineFactory::GraphicsPipelineSpecification> specs;
+    specs.reserve(SPEC_COUNT);
+    spdlog::info("compiling {} pipeline variants...", SPEC_COUNT);
+    using BenchVertexFormat = vkw::VertexFormat<VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT>;
+    for (size_t i = 0; i < SPEC_COUNT; i++) {
+        auto& spec = specs.emplace_back(std::vector<vkw::Shader> { vert, frag }, pipeline_layout);
+        spec.set_vertex_format<BenchVertexFormat>();
+        spec.set_primitive_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+        spec.set_cull_mode(VK_CULL_MODE_BACK_BIT);
+        spec.set_depth_test(true, VK_COMPARE_OP_LESS);
+        spec.set_depth_write(true);
+        // Distinct depth-bias constants give every spec its own content hash
+        // without making the variants any more expensive to build.
+        spec.set_depth_bias(true, 0.0001f * (i + 1), 0.f, 0.f);
+        spec.set_attachment_color_blend_info(0, false);
+        spec.set_render_pass(render_pass, 0);
+        pipeline_factory.get(spec);
+    }
+
+    std::mt19937_64 rng(777);
+    std::vector<size_t> order(8192);
+    for (auto& index : order)
+        index = rng() % SPEC_COUNT;
+    uintptr_t sink = 0;
+    run_bench("PipelineFactory::get (1k cached specs)", order.size(), [&]() {
+        for (size_t index : order)
+            sink ^= reinterpret_cast<uintptr_t>(&pipeline_factory.get(specs[index]));
+    });
+    spdlog::debug("lookup checksum {:x}", sink); // keeps the lookups observable
+}
+
+void bench_image_decode(vkw::Allocator& allocator)
+{
+    struct {
+        const char* m_path;
+        vkw::HostImage::InputFormat m_format;
+        const char* m_label;
+    } sources[] = {
+        { "/rs/DuckCM.png", vkw::HostImage::InputFormat::PNG, "HostImage decode (PNG)" },
+        { "/rs/DuckCM.ktx2", vkw::HostImage::InputFormat::KTX2, "HostImage decode (KTX2)" },
+    };
+    for (const auto& source : sources) {
+        if (fs::file(source.m_path).exists() == false) {
+            spdlog::info("{:<44} skipped: {} not present", source.m_label, source.m_path);
+            continue;
+        }
+        fs::mapped_view encoded(source.m_path);
+        run_bench(source.m_label, 1, [&]() {
+            // decodes straight into freshly allocated mapped staging memory,
+            // the same path a texture load takes
+            vkw::HostImage image(allocator, source.m_format, encoded.data(), encoded.length(), false);
+        });
+    }
+}
+
+}
+
+static inline void glfw_error_callback(int code, const char* description)
+{
+    spdlog::error("[glfw] {}: {}", code, description);
+}
+
+int main(int argc, char** argv)
+{
+    fs::init(argv[0]);
+
+    bench_dmem_block(false);
+    bench_dmem_block(true);
+    bench_scene();
+
+    glfwSetErrorCallback(glfw_error_callback);
+    if (glfwInit() == GLFW_FALSE || glfwVulkanSupported() == GLFW_FALSE) {
+        spdlog::info("Vulkan unavailable; skipping the device-dependent benchmarks");
+        return 0;
+    }
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    atexit(glfwTerminate);
+    GLFWwindow* window = glfwCreateWindow(720, 480, "benchmarks", nullptr, nullptr);
+    if (window == nullptr) {
+        spdlog::info("window creation failed; skipping the device-dependent benchmarks");
+        return 0;
+    }
+
+    vkw::Device device(window);
+    bench_allocator_contention(device, false);
+    bench_allocator_contention(device, true);
+    bench_pipeline_lookup(device);
+    {
+        vkw::Allocator allocator(device, true);
+        bench_image_decode(allocator);
+    }
+    vkDeviceWaitIdle(device);
+}
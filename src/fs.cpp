@@ -1,8 +1,20 @@
 #include "fs.h"
 #include "config.h"
+#include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <physfs.h>
 #include <spdlog/spdlog.h>
+#include <string.h>
+#include <thread>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using std::ios_base;
 
@@ -90,6 +102,125 @@ public:
     }
 };
 
+// one sized read of an entire file into a new[]'d buffer; false on any failure
+static bool read_whole_file(const char* path, const char*& data, size_t& length)
+{
+    PHYSFS_File* f = PHYSFS_openRead(path);
+    if (f == nullptr)
+        return false;
+    PHYSFS_sint64 file_length = PHYSFS_fileLength(f);
+    if (file_length < 0) {
+        PHYSFS_close(f);
+        return false;
+    }
+    char* buffer = new char[file_length];
+    if (PHYSFS_readBytes(f, buffer, file_length) < file_length) {
+        delete[] buffer;
+        PHYSFS_close(f);
+        return false;
+    }
+    PHYSFS_close(f);
+    data = buffer;
+    length = file_length;
+    return true;
+}
+
+// ---- background prefetch ----
+
+struct prefetch_entry {
+    std::string m_path;
+    const char* m_data; // new[]'d; ownership passes to the first consumer
+    size_t m_length;
+};
+
+static std::mutex s_prefetch_mutex;
+static std::condition_variable s_prefetch_cv;
+static std::deque<std::string> s_prefetch_queue;
+static std::deque<prefetch_entry> s_prefetch_cache; // insertion order doubles as the eviction order
+static size_t s_prefetch_cached_bytes = 0;
+static size_t s_prefetch_budget = 64 << 20;
+static std::thread s_prefetch_thread;
+static bool s_prefetch_exit = false;
+
+static void prefetch_worker()
+{
+    std::unique_lock<std::mutex> lock(s_prefetch_mutex);
+    while (true) {
+        s_prefetch_cv.wait(lock, []() { return s_prefetch_exit || s_prefetch_queue.empty() == false; });
+        if (s_prefetch_exit)
+            return;
+
+        std::string path = std::move(s_prefetch_queue.front());
+        s_prefetch_queue.pop_front();
+        if (std::any_of(s_prefetch_cache.begin(), s_prefetch_cache.end(), [&path](const prefetch_entry& e) { return e.m_path == path; }))
+            continue;
+
+        lock.unlock();
+        const char* data = nullptr;
+        size_t length = 0;
+        bool ok = read_whole_file(path.c_str(), data, length);
+        if (ok == false)
+            spdlog::error("prefetch: failed to read {}: {}", path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        lock.lock();
+        if (ok == false)
+            continue;
+
+        s_prefetch_cached_bytes += length;
+        s_prefetch_cache.push_back({ std::move(path), data, length });
+        while (s_prefetch_cached_bytes > s_prefetch_budget && s_prefetch_cache.size() > 1) {
+            prefetch_entry& victim = s_prefetch_cache.front();
+            s_prefetch_cached_bytes -= victim.m_length;
+            delete[] victim.m_data;
+            s_prefetch_cache.pop_front();
+        }
+    }
+}
+
+// hands ownership of the cached bytes to the first consumer, so a warm open
+// costs one lock and no copy
+static const char* take_prefetched(std::string_view path, size_t& length)
+{
+    std::lock_guard<std::mutex> lock(s_prefetch_mutex);
+    for (auto it = s_prefetch_cache.begin(); it != s_prefetch_cache.end(); ++it) {
+        if (it->m_path == path) {
+            const char* data = it->m_data;
+            length = it->m_length;
+            s_prefetch_cached_bytes -= it->m_length;
+            s_prefetch_cache.erase(it);
+            return data;
+        }
+    }
+    return nullptr;
+}
+
+void prefetch(std::string_view filename)
+{
+    std::lock_guard<std::mutex> lock(s_prefetch_mutex);
+    if (s_prefetch_thread.joinable() == false) {
+        s_prefetch_thread = std::thread(prefetch_worker);
+        // registered after init()'s PHYSFS_deinit handler, so this runs first
+        atexit([]() {
+            {
+                std::lock_guard<std::mutex> lock(s_prefetch_mutex);
+                s_prefetch_exit = true;
+            }
+            s_prefetch_cv.notify_all();
+            s_prefetch_thread.join();
+            for (prefetch_entry& e : s_prefetch_cache)
+                delete[] e.m_data;
+            s_prefetch_cache.clear();
+        });
+    }
+    s_prefetch_queue.emplace_back(filename);
+    s_prefetch_cv.notify_one();
+}
+
+void set_prefetch_budget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(s_prefetch_mutex);
+    s_prefetch_budget = bytes;
+}
+
 bool file::exists() const
 {
     return PHYSFS_exists(m_path.c_str());
@@ -190,6 +321,150 @@ std::vector<file> file::children() const
     return out;
 }
 
+std::vector<char> file::read_all() const
+{
+    size_t cached_length = 0;
+    const char* cached = take_prefetched(m_path, cached_length);
+    if (cached != nullptr) {
+        std::vector<char> out(cached, cached + cached_length);
+        delete[] cached;
+        return out;
+    }
+
+    PHYSFS_File* f = PHYSFS_openRead(m_path.c_str());
+    if (f == nullptr) {
+        spdlog::critical("read_all: failed to open {}: {}", m_path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        abort();
+    }
+    PHYSFS_sint64 length = PHYSFS_fileLength(f);
+    if (length < 0) {
+        spdlog::critical("read_all: {} has unknown length", m_path);
+        abort();
+    }
+    std::vector<char> out(length);
+    if (PHYSFS_readBytes(f, out.data(), length) < length) {
+        spdlog::critical("read_all: short read of {}: {}", m_path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        abort();
+    }
+    PHYSFS_close(f);
+    return out;
+}
+
+size_t file::read_all(void* buffer, size_t capacity) const
+{
+    size_t cached_length = 0;
+    const char* cached = take_prefetched(m_path, cached_length);
+    if (cached != nullptr) {
+        size_t n = std::min(cached_length, capacity);
+        memcpy(buffer, cached, n);
+        delete[] cached;
+        return n;
+    }
+
+    PHYSFS_File* f = PHYSFS_openRead(m_path.c_str());
+    if (f == nullptr) {
+        spdlog::critical("read_all: failed to open {}: {}", m_path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        abort();
+    }
+    PHYSFS_sint64 length = PHYSFS_fileLength(f);
+    size_t to_read = length < 0 ? capacity : std::min<size_t>(length, capacity);
+    PHYSFS_sint64 got = PHYSFS_readBytes(f, buffer, to_read);
+    if (got < 0) {
+        spdlog::critical("read_all: failed to read {}: {}", m_path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        abort();
+    }
+    PHYSFS_close(f);
+    return got;
+}
+
+static const void* try_map_native(const char* vpath, size_t& length)
+{
+#ifndef _WIN32
+    const char* real_dir = PHYSFS_getRealDir(vpath);
+    if (real_dir == nullptr)
+        return nullptr;
+    struct stat st;
+    if (::stat(real_dir, &st) != 0 || S_ISDIR(st.st_mode) == false)
+        return nullptr; // mounted from an archive, not a directory
+
+    const char* mount_point = PHYSFS_getMountPoint(real_dir);
+    std::string native(real_dir);
+    native += '/';
+    native += vpath + (mount_point ? strlen(mount_point) : 1);
+    if (::stat(native.c_str(), &st) != 0 || S_ISREG(st.st_mode) == false || st.st_size == 0)
+        return nullptr;
+
+    int fd = ::open(native.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    void* mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+        return nullptr;
+    length = st.st_size;
+    return mapping;
+#else
+    return nullptr;
+#endif
+}
+
+mapped_view::mapped_view(std::string_view filename)
+    : m_data(nullptr)
+    , m_length(0)
+    , m_mapped(false)
+{
+    std::vector<char> filename_buffer(filename.size() + 1);
+    sprintf(filename_buffer.data(), "%.*s", static_cast<int>(filename.size()), filename.data());
+
+    size_t cached_length = 0;
+    const char* cached = take_prefetched(filename, cached_length);
+    if (cached != nullptr) { // warmed by the prefetch thread; adopt its buffer
+        m_data = cached;
+        m_length = cached_length;
+        return;
+    }
+
+    size_t mapped_length = 0;
+    const void* mapping = try_map_native(filename_buffer.data(), mapped_length);
+    if (mapping != nullptr) {
+        m_data = mapping;
+        m_length = mapped_length;
+        m_mapped = true;
+        return;
+    }
+
+    const char* data = nullptr;
+    size_t length = 0;
+    if (read_whole_file(filename_buffer.data(), data, length) == false) {
+        spdlog::critical("mapped_view: failed to read {}: {}", filename, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        abort();
+    }
+    m_data = data;
+    m_length = length;
+}
+
+mapped_view::mapped_view(mapped_view&& other)
+    : m_data(other.m_data)
+    , m_length(other.m_length)
+    , m_mapped(other.m_mapped)
+{
+    other.m_data = nullptr;
+    other.m_length = 0;
+}
+
+mapped_view::~mapped_view()
+{
+    if (m_data == nullptr)
+        return;
+#ifndef _WIN32
+    if (m_mapped) {
+        ::munmap(const_cast<void*>(m_data), m_length);
+        return;
+    }
+#endif
+    delete[] reinterpret_cast<const char*>(m_data);
+}
+
 base_stream::base_stream(void* handle)
     : m_handle(handle)
 {
@@ -4,7 +4,9 @@
 #include <chrono>
 #include <fstream>
 #define GLM_FORCE_RADIANS
+#include "animation.h"
 #include "fs.h"
+#include "profile.h"
 #include "scene.h"
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -16,22 +18,27 @@ static inline void glfw_error_callback(int code, const char* description)
     spdlog::error("[glfw] {}: {}", code, description);
 }
 
+// position, normal, texcoord — each in its own tightly packed stream
+using DuckVertexFormat = vkw::VertexFormat<VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32_SFLOAT>;
+
 class DuckMesh : public scene::Mesh {
 public:
+    static constexpr uint32_t VERTEX_COUNT = 2399, INDEX_COUNT = 12636;
+
     vkw::HostBuffer<1> host_buffer;
     vkw::Buffer<1> vertex_buffer, index_buffer;
 
     DuckMesh(vkw::Allocator& allocator)
-        : host_buffer(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, fs::istream("/rs/Duck0.bin"), 102040)
-        , vertex_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 76768)
-        , index_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 25272)
+        : host_buffer(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, fs::mapped_view("/rs/Duck0.bin"))
+        , vertex_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, DuckVertexFormat::size(VERTEX_COUNT))
+        , index_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, INDEX_COUNT * sizeof(uint16_t))
     {
     }
 
-    void initialize_buffers(vkw::CommandBuffer& cmd)
+    void initialize_buffers(vkw::UploadEngine& uploads)
     {
-        vertex_buffer.copy_from(host_buffer, cmd, 0);
-        index_buffer.copy_from(host_buffer, cmd, 76768);
+        uploads.copy(vertex_buffer, host_buffer, 0);
+        uploads.copy(index_buffer, host_buffer, DuckVertexFormat::size(VERTEX_COUNT)); // indices directly follow the streams in Duck0.bin
     }
 
     void cleanup_initialize_buffers()
@@ -39,14 +46,16 @@ public:
         host_buffer.destroy();
     }
 
-    void draw(vkw::CommandBuffer& cbuffer) const
+    void draw(vkw::CommandBuffer& cbuffer, uint32_t instance_count, uint32_t first_instance) const
     {
-        cbuffer.bind_vertex_buffer(0, vertex_buffer, 0);
-        cbuffer.bind_vertex_buffer(1, vertex_buffer, 28788);
-        cbuffer.bind_vertex_buffer(2, vertex_buffer, 57576);
+        cbuffer.bind_vertex_buffer(0, vertex_buffer, DuckVertexFormat::stream_offset(0, VERTEX_COUNT));
+        cbuffer.bind_vertex_buffer(1, vertex_buffer, DuckVertexFormat::stream_offset(1, VERTEX_COUNT));
+        cbuffer.bind_vertex_buffer(2, vertex_buffer, DuckVertexFormat::stream_offset(2, VERTEX_COUNT));
         cbuffer.bind_index_buffer(index_buffer, 0, VK_INDEX_TYPE_UINT16);
-        vkCmdDrawIndexed(cbuffer, 12636, 1, 0, 0, 0);
+        vkCmdDrawIndexed(cbuffer, INDEX_COUNT, instance_count, 0, 0, first_instance);
     }
+
+    glm::vec4 bounding_sphere() const { return { 0.f, 85.f, 0.f, 120.f }; } // generous; raw positions are in centimeters
 };
 
 class DuckMaterial : public scene::Material {
@@ -58,7 +67,7 @@ public:
 
     DuckMaterial(vkw::Allocator& allocator, vkw::Sampler& sampler, vkw::DescriptorSet&& d)
         : Material(std::move(d))
-        , texture_data(allocator, vkw::HostImage::InputFormat::PNG, fs::istream("/rs/DuckCM.png"), true)
+        , texture_data(allocator, vkw::HostImage::InputFormat::PNG, fs::mapped_view("/rs/DuckCM.png"), true)
         , texture_image(allocator, texture_data, vkw::MemoryUsage::DeviceLocal, VK_IMAGE_USAGE_SAMPLED_BIT)
         , texture_image_view(allocator.device(), texture_image, VK_IMAGE_VIEW_TYPE_2D, texture_image.format())
         , sampler(sampler)
@@ -80,22 +89,32 @@ public:
     }
 };
 
+// position, normal
+using BoxVertexFormat = vkw::VertexFormat<VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT>;
+
 class OuterBoxMesh : public scene::Mesh {
 public:
+    // The inner box's streams and indices come first in BoxAnimated0.bin,
+    // then the outer box's; both meshes draw from the same pair of buffers.
+    static constexpr uint32_t INNER_VERTEX_COUNT = 96, OUTER_VERTEX_COUNT = 224;
+    static constexpr uint32_t INNER_INDEX_COUNT = 186, OUTER_INDEX_COUNT = 576;
+    static constexpr VkDeviceSize OUTER_VERTEX_BASE = BoxVertexFormat::size(INNER_VERTEX_COUNT);
+    static constexpr VkDeviceSize BIN_VERTEX_OFFSET = 80, BIN_INDEX_OFFSET = 7784; // glTF buffer views
+
     vkw::HostBuffer<1> host_buffer;
     vkw::Buffer<1> vertex_buffer, index_buffer;
 
     OuterBoxMesh(vkw::Allocator& allocator)
-        : host_buffer(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, fs::istream("/rs/BoxAnimated0.bin"), 9308)
-        , vertex_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 7680)
-        , index_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 1524)
+        : host_buffer(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, fs::mapped_view("/rs/BoxAnimated0.bin"))
+        , vertex_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, OUTER_VERTEX_BASE + BoxVertexFormat::size(OUTER_VERTEX_COUNT))
+        , index_buffer(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, (INNER_INDEX_COUNT + OUTER_INDEX_COUNT) * sizeof(uint16_t))
     {
     }
 
-    void initialize_buffers(vkw::CommandBuffer& cmd)
+    void initialize_buffers(vkw::UploadEngine& uploads)
     {
-        vertex_buffer.copy_from(host_buffer, cmd, 80);
-        index_buffer.copy_from(host_buffer, cmd, 7784);
+        uploads.copy(vertex_buffer, host_buffer, BIN_VERTEX_OFFSET);
+        uploads.copy(index_buffer, host_buffer, BIN_INDEX_OFFSET);
     }
 
     void cleanup_initialize_buffers()
@@ -103,13 +122,15 @@ public:
         host_buffer.destroy();
     }
 
-    void draw(vkw::CommandBuffer& cmd) const
+    void draw(vkw::CommandBuffer& cmd, uint32_t instance_count, uint32_t first_instance) const
     {
-        cmd.bind_vertex_buffer(0, vertex_buffer, 2304);
-        cmd.bind_vertex_buffer(1, vertex_buffer, 4992);
-        cmd.bind_index_buffer(index_buffer, 372, VK_INDEX_TYPE_UINT16);
-        vkCmdDrawIndexed(cmd, 576, 1, 0, 0, 0);
+        cmd.bind_vertex_buffer(0, vertex_buffer, OUTER_VERTEX_BASE + BoxVertexFormat::stream_offset(0, OUTER_VERTEX_COUNT));
+        cmd.bind_vertex_buffer(1, vertex_buffer, OUTER_VERTEX_BASE + BoxVertexFormat::stream_offset(1, OUTER_VERTEX_COUNT));
+        cmd.bind_index_buffer(index_buffer, INNER_INDEX_COUNT * sizeof(uint16_t), VK_INDEX_TYPE_UINT16);
+        vkCmdDrawIndexed(cmd, OUTER_INDEX_COUNT, instance_count, 0, 0, first_instance);
     }
+
+    glm::vec4 bounding_sphere() const { return { 0.f, 2.f, 0.f, 4.f }; } // generous
 };
 
 class InnerBoxMesh : public scene::Mesh {
@@ -124,27 +145,31 @@ public:
         // everything is borrowed from OuterBoxMesh
     }
 
-    void initialize_buffers(vkw::CommandBuffer& cmd) { }
+    void initialize_buffers(vkw::UploadEngine& uploads) { }
     void cleanup_initialize_buffers() { }
 
-    void draw(vkw::CommandBuffer& cmd) const
+    void draw(vkw::CommandBuffer& cmd, uint32_t instance_count, uint32_t first_instance) const
     {
-        cmd.bind_vertex_buffer(0, vertex_buffer, 0);
-        cmd.bind_vertex_buffer(1, vertex_buffer, 1152);
+        cmd.bind_vertex_buffer(0, vertex_buffer, BoxVertexFormat::stream_offset(0, OuterBoxMesh::INNER_VERTEX_COUNT));
+        cmd.bind_vertex_buffer(1, vertex_buffer, BoxVertexFormat::stream_offset(1, OuterBoxMesh::INNER_VERTEX_COUNT));
         cmd.bind_index_buffer(index_buffer, 0, VK_INDEX_TYPE_UINT16);
-        vkCmdDrawIndexed(cmd, 186, 1, 0, 0, 0);
+        vkCmdDrawIndexed(cmd, OuterBoxMesh::INNER_INDEX_COUNT, instance_count, 0, 0, first_instance);
     }
+
+    glm::vec4 bounding_sphere() const { return { 0.f, 0.5f, 0.f, 1.f }; }
 };
 
 class BoxMaterial : public scene::Material {
-    vkw::HostBuffer<1> m_data;
+    vkw::BufferArena<1>& m_arena;
+    vkw::BufferArena<1>::SubRange m_data;
 
 public:
-    BoxMaterial(vkw::Allocator& allocator, vkw::DescriptorSet&& d, const std::array<float, 3>& color)
+    BoxMaterial(vkw::BufferArena<1>& arena, vkw::DescriptorSet&& d, const std::array<float, 3>& color)
         : Material(std::move(d))
-        , m_data(allocator, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 12)
+        , m_arena(arena)
+        , m_data(arena.suballocate(12))
     {
-        m_data.write_mapped(color.data(), color.size() * sizeof(float));
+        m_arena.write(m_data, color.data(), color.size() * sizeof(float));
     }
 
     void initialize_buffers(vkw::CommandBuffer& cmd)
@@ -153,58 +178,11 @@ public:
 
     void cleanup_initialize_buffers()
     {
-        m_descriptor_set.bind_buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, m_data, 0);
+        m_descriptor_set.bind_buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, m_arena, m_data);
         m_descriptor_set.update();
     }
 };
 
-template <class T>
-class LinearInterpolation {
-private:
-    std::vector<float> m_inputs;
-    std::vector<T> m_outputs;
-
-public:
-    LinearInterpolation(std::vector<float>&& inputs, std::vector<T>&& outputs)
-        : m_inputs(inputs)
-        , m_outputs(outputs)
-    {
-        assert(inputs.size() == outputs.size());
-    }
-
-    T get(float time)
-    {
-        if (time < m_inputs.front())
-            return m_outputs.front();
-        if (time >= m_inputs.back())
-            return m_outputs.back();
-
-        for (size_t i = 0; i < m_inputs.size() - 1; i++) {
-            if (m_inputs[i] <= time && time < m_inputs[i + 1]) {
-                return glm::mix(m_outputs[i], m_outputs[i + 1], (time - m_inputs[i]) / (m_inputs[i + 1] - m_inputs[i]));
-            }
-        }
-        abort();
-    }
-};
-
-class CoolVisitor : public scene::SceneVisitor {
-    vkw::CommandBuffer* m_cmd = nullptr;
-
-public:
-    void set_command_info(vkw::CommandBuffer& cmd)
-    {
-        m_cmd = &cmd;
-    }
-
-    virtual void visitGeometry(scene::Geometry& geometry)
-    {
-        m_cmd->bind_descriptor_set(3, geometry.material().descriptor_set());
-        m_cmd->push_constants(VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &current_matrix());
-        geometry.mesh().draw(*m_cmd);
-    }
-};
-
 GLFWwindow* create_window()
 {
     glfwSetErrorCallback(glfw_error_callback);
@@ -235,7 +213,6 @@ int main(int argc, char** argv)
     GLFWwindow* window = create_window();
     vkw::Device device(window);
     vkw::Semaphore image_available(device), render_finished(device);
-    vkw::Fence fence(device, true);
     vkw::ShaderFactory shader_factory(device);
     vkw::Shader vert = shader_factory.open(fs::file("/rs/shaders/box.vert.spv"), VK_SHADER_STAGE_VERTEX_BIT),
                 frag = shader_factory.open(fs::file("/rs/shaders/box.frag.spv"), VK_SHADER_STAGE_FRAGMENT_BIT);
@@ -291,15 +268,12 @@ int main(int argc, char** argv)
     vkw::PipelineFactory pipeline_factory(device, shader_factory);
     vkw::PipelineLayout pipeline_layout = vkw::PipelineLayout::build()
                                               .with_descriptor_binding(1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
+                                              .with_descriptor_binding(2, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT)
                                               .with_descriptor_binding(3, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
-                                              .with_push_constant_range(0, sizeof(glm::mat4), VK_SHADER_STAGE_VERTEX_BIT)
                                               .build(device);
 
     vkw::PipelineFactory::GraphicsPipelineSpecification pb({ vert, frag }, pipeline_layout);
-    pb.set_vertex_input_binding(0, 12);
-    pb.set_vertex_input_binding(1, 12);
-    pb.set_vertex_input_attribute(0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0);
-    pb.set_vertex_input_attribute(1, 1, VK_FORMAT_R32G32B32_SFLOAT, 0);
+    pb.set_vertex_format<BoxVertexFormat>();
     pb.set_primitive_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
     pb.set_depth_clamp(false);
     pb.set_polygon_mode(VK_POLYGON_MODE_FILL);
@@ -322,41 +296,54 @@ int main(int argc, char** argv)
 
     OuterBoxMesh outer_box(allocator);
     InnerBoxMesh inner_box(outer_box);
-    BoxMaterial outer_box_material(allocator, std::move(descriptor_set_outerboxmtl), { 0.8, 0.4, 0.8 }),
-        inner_box_material(allocator, std::move(descriptor_set_innerboxmtl), { 0.3, 0.5, 0.8 });
+    vkw::BufferArena<1> material_arena(allocator, vkw::MemoryUsage::HostLocal, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 4096);
+    BoxMaterial outer_box_material(material_arena, std::move(descriptor_set_outerboxmtl), { 0.8, 0.4, 0.8 }),
+        inner_box_material(material_arena, std::move(descriptor_set_innerboxmtl), { 0.3, 0.5, 0.8 });
     vkw::HostBuffer<2> uniform_buffer(allocator, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 2 * sizeof(glm::mat4)); // probably this is gonna get split up
+    vkw::HostBuffer<2> instance_buffer(allocator, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 64 * sizeof(glm::mat4)); // generous for this scene
 
     Scene box_scene;
     scene::Geometry o_node(box_scene.root(), outer_box, outer_box_material);
     scene::Translation t_node(box_scene.root());
     scene::Rotation r_node(&t_node);
     scene::Geometry i_node(&r_node, inner_box, inner_box_material);
-    LinearInterpolation<glm::vec3> t_anim({ 0, 1.25, 2.5, 3.70833 }, { { 0, 0, 0 }, { 0, 2.5, 0 }, { 0, 2.5, 0 }, { 0, 0, 0 } });
-    LinearInterpolation<glm::quat> r_anim({ 1.25, 2.5 }, { { 1, 0, 0, 0 }, { 0, 1, 0, 0 } });
+    scene::Animation box_anim;
+    box_anim.add_translation_channel(&t_node, { 0, 1.25, 2.5, 3.70833 }, { { 0, 0, 0 }, { 0, 2.5, 0 }, { 0, 2.5, 0 }, { 0, 0, 0 } })
+        .add_rotation_channel(&r_node, { 1.25, 2.5 }, { { 1, 0, 0, 0 }, { 0, 1, 0, 0 } });
 
-    CoolVisitor visitor;
+    scene::DrawList draw_list;
 
+    // Image initialization still records on the graphics queue (mipmap blits
+    // require it); buffer uploads go through the transfer-queue engine and
+    // overlap with the first frames instead of idling the device.
     auto& cmd = command_pool.get(VK_COMMAND_BUFFER_LEVEL_PRIMARY, 0);
     cmd.begin(true);
-    outer_box.initialize_buffers(cmd);
-    inner_box.initialize_buffers(cmd);
     outer_box_material.initialize_buffers(cmd);
     inner_box_material.initialize_buffers(cmd);
     cmd.end();
+    vkw::Fence material_fence(device);
     device.submit_commands()
         .add(cmd)
-        .to_queue(vkw::QueueFamilyType::Graphics, 0);
-    vkDeviceWaitIdle(device);
-    outer_box.cleanup_initialize_buffers();
-    inner_box.cleanup_initialize_buffers();
+        .to_queue(vkw::QueueFamilyType::Graphics, 0, material_fence);
+
+    vkw::UploadEngine upload_engine(device, allocator);
+    outer_box.initialize_buffers(upload_engine);
+    inner_box.initialize_buffers(upload_engine);
+    VkSemaphore uploads_done = upload_engine.submit([&outer_box, &inner_box]() {
+        outer_box.cleanup_initialize_buffers();
+        inner_box.cleanup_initialize_buffers();
+    });
+
+    material_fence.wait();
     outer_box_material.cleanup_initialize_buffers();
     inner_box_material.cleanup_initialize_buffers();
 
     while (glfwWindowShouldClose(window) == false) {
         glfwPollEvents();
+        upload_engine.poll();
 
-        fence.wait();
-        fence.reset();
+        device.wait_frame_slot();
+        device.gpu_profiler().begin_frame();
         device.acquire_next_image(image_available);
         command_pool.reset(false);
 
@@ -371,28 +358,48 @@ int main(int argc, char** argv)
         static auto start_time = std::chrono::high_resolution_clock::now();
         auto now_time = std::chrono::high_resolution_clock::now();
         float time = std::chrono::duration<float, std::chrono::seconds::period>(now_time - start_time).count();
-        t_node.set_translation(t_anim.get(fmod(time, 5)));
-        r_node.set_rotation(r_anim.get(fmod(time, 5)));
+        box_anim.evaluate(fmod(time, 5));
+
+        draw_list.build(box_scene, scene::Frustum(mvp[0] * mvp[1]));
+        if (!draw_list.transforms().empty())
+            instance_buffer.write_mapped(draw_list.transforms().data(), draw_list.transforms().size() * sizeof(glm::mat4));
+        descriptor_set_perobject.bind_buffer(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, instance_buffer, 0, 64 * sizeof(glm::mat4));
+        descriptor_set_perobject.update();
 
         auto& cbuffer = command_pool.get(VK_COMMAND_BUFFER_LEVEL_PRIMARY, 0);
         cbuffer.begin();
+        uint32_t scene_zone = cbuffer.begin_zone(device.gpu_profiler(), "scene");
         cbuffer.begin_render_pass(render_pass, framebuffer, VK_SUBPASS_CONTENTS_INLINE);
         cbuffer.set_viewport(0, 0, device.swapchain().width(), device.swapchain().height(), 0, 1);
         cbuffer.set_scissor(0, 0, device.swapchain().width(), device.swapchain().height());
         cbuffer.bind_pipeline(pipeline);
         cbuffer.bind_descriptor_set(1, descriptor_set_perpass);
-        visitor.set_command_info(cbuffer);
-        visitor.visit(box_scene);
+        cbuffer.bind_descriptor_set(2, descriptor_set_perobject);
+        draw_list.record(cbuffer, 3);
         vkCmdEndRenderPass(cbuffer);
+        cbuffer.end_zone(device.gpu_profiler(), scene_zone);
         cbuffer.end();
 
-        device.submit_commands()
-            .add(cbuffer)
+        vkw::QueueSubmission submission = device.submit_commands();
+        submission.add(cbuffer)
             .wait_on(image_available, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT)
             .signal(render_finished)
-            .to_queue(vkw::QueueFamilyType::Graphics, 0, fence);
+            .signal_frame();
+        if (uploads_done != VK_NULL_HANDLE) {
+            submission.wait_on(uploads_done, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+            uploads_done = VK_NULL_HANDLE;
+        }
+        submission.to_queue(vkw::QueueFamilyType::Graphics, 0);
         device.present_image({ render_finished });
     }
 
     vkDeviceWaitIdle(device);
+    const auto& pacing = device.pacing_stats();
+    spdlog::info("frame pacing: {} frames, acquire block avg {:.2f}ms max {:.2f}ms, last interval {:.2f}ms", pacing.m_interval_samples, pacing.m_avg_acquire_block_ms, pacing.m_max_acquire_block_ms, pacing.m_last_interval_ms);
+    for (const auto& zone : device.gpu_profiler().results())
+        spdlog::info("gpu zone {}: min {:.1f}us avg {:.1f}us max {:.1f}us over {} samples", zone.m_name, zone.m_min_us, zone.m_avg_us, zone.m_max_us, zone.m_samples);
+    for (const auto& zone : prof::report())
+        spdlog::info("cpu zone {}: avg {:.1f}us p50 {:.1f}us p95 {:.1f}us p99 {:.1f}us max {:.1f}us over {} samples", zone.m_name, zone.m_avg_us, zone.m_p50_us, zone.m_p95_us, zone.m_p99_us, zone.m_samples);
+    if (prof::dropped_events() > 0)
+        spdlog::info("cpu zones: {} events dropped", prof::dropped_events());
 }
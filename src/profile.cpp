@@ -0,0 +1,256 @@
+#include "profile.h"
+#include "fs.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace prof {
+
+namespace {
+
+    struct Event {
+        const char* m_name;
+        uint64_t m_begin_ns, m_end_ns;
+    };
+
+    // Single-producer, single-consumer: the owning thread writes through
+    // m_head, the aggregator chases it with a private tail. A writer that
+    // laps the aggregator overwrites the oldest events instead of waiting —
+    // markers never block, which is the always-on contract; the loss is
+    // counted and surfaced through dropped_events().
+    struct Ring {
+        static constexpr size_t CAPACITY = 8192; // power of two
+        std::array<Event, CAPACITY> m_events;
+        std::atomic<uint64_t> m_head { 0 };
+        uint64_t m_tail = 0; // aggregator-private
+        uint32_t m_thread_id = 0;
+        bool m_retired = false; // owner thread exited; reusable after a drain
+    };
+
+    struct ZoneStats {
+        uint64_t m_samples = 0;
+        uint64_t m_total_ns = 0, m_max_ns = 0;
+        std::array<uint64_t, 48> m_histogram {}; // log2(ns) buckets
+    };
+
+    std::mutex s_mutex; // guards the ring list, stats, and trace retention
+    std::condition_variable s_cv;
+    std::vector<std::unique_ptr<Ring>> s_rings;
+    std::unordered_map<const char*, ZoneStats> s_stats;
+    uint64_t s_dropped = 0;
+    std::deque<std::pair<uint32_t, Event>> s_trace;
+    size_t s_trace_capacity = 0;
+    std::thread s_aggregator;
+    bool s_aggregator_exit = false;
+
+    uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint32_t log2_bucket(uint64_t ns)
+    {
+        uint32_t bucket = 0;
+        while (ns >>= 1)
+            bucket++;
+        return std::min<uint32_t>(bucket, 47);
+    }
+
+    // Caller holds s_mutex.
+    void drain_ring(Ring& ring)
+    {
+        uint64_t head = ring.m_head.load(std::memory_order_acquire);
+        if (head - ring.m_tail > Ring::CAPACITY) {
+            s_dropped += head - Ring::CAPACITY - ring.m_tail;
+            ring.m_tail = head - Ring::CAPACITY;
+        }
+        while (ring.m_tail < head) {
+            Event event = ring.m_events[ring.m_tail & (Ring::CAPACITY - 1)];
+            // If the writer lapped us mid-copy it may have reused this slot;
+            // the reloaded head tells us, and the stale copy is discarded.
+            if (ring.m_head.load(std::memory_order_acquire) - ring.m_tail > Ring::CAPACITY) {
+                s_dropped++;
+                ring.m_tail++;
+                continue;
+            }
+            ring.m_tail++;
+
+            uint64_t ns = event.m_end_ns - event.m_begin_ns;
+            ZoneStats& stats = s_stats[event.m_name];
+            stats.m_samples++;
+            stats.m_total_ns += ns;
+            stats.m_max_ns = std::max(stats.m_max_ns, ns);
+            stats.m_histogram[log2_bucket(ns | 1)]++;
+            if (s_trace_capacity != 0) {
+                s_trace.emplace_back(ring.m_thread_id, event);
+                if (s_trace.size() > s_trace_capacity)
+                    s_trace.pop_front();
+            }
+        }
+    }
+
+    void aggregator_worker()
+    {
+        std::unique_lock lck(s_mutex);
+        while (s_aggregator_exit == false) {
+            s_cv.wait_for(lck, std::chrono::milliseconds(100));
+            for (auto& ring : s_rings)
+                drain_ring(*ring);
+        }
+    }
+
+    void stop_aggregator()
+    {
+        {
+            std::lock_guard lck(s_mutex);
+            s_aggregator_exit = true;
+        }
+        s_cv.notify_one();
+        s_aggregator.join();
+    }
+
+    // Returns an exited thread's ring to circulation so worker pools that
+    // spawn short-lived threads do not accumulate one ring per thread ever
+    // created.
+    struct RingHolder {
+        Ring* m_ring = nullptr;
+        ~RingHolder()
+        {
+            if (m_ring != nullptr) {
+                std::lock_guard lck(s_mutex);
+                m_ring->m_retired = true;
+            }
+        }
+    };
+
+    Ring& thread_ring()
+    {
+        static thread_local RingHolder s_holder;
+        if (s_holder.m_ring == nullptr) {
+            std::lock_guard lck(s_mutex);
+            for (auto& ring : s_rings) {
+                if (ring->m_retired) {
+                    drain_ring(*ring); // whatever the dead owner left behind
+                    ring->m_retired = false;
+                    s_holder.m_ring = ring.get();
+                    break;
+                }
+            }
+            if (s_holder.m_ring == nullptr) {
+                s_rings.push_back(std::make_unique<Ring>());
+                s_holder.m_ring = s_rings.back().get();
+                s_holder.m_ring->m_thread_id = static_cast<uint32_t>(s_rings.size() - 1);
+            }
+            if (s_aggregator.joinable() == false) {
+                s_aggregator = std::thread(aggregator_worker);
+                atexit(stop_aggregator);
+            }
+        }
+        return *s_holder.m_ring;
+    }
+
+    // Midpoint of the histogram bucket the requested rank lands in; capped
+    // by the true maximum so a sparse top bucket cannot overshoot it.
+    double percentile_us(const ZoneStats& stats, double q)
+    {
+        uint64_t rank = static_cast<uint64_t>(q * (stats.m_samples - 1)), seen = 0;
+        for (size_t i = 0; i < stats.m_histogram.size(); i++) {
+            seen += stats.m_histogram[i];
+            if (seen > rank) {
+                double mid_ns = 1.5 * static_cast<double>(uint64_t(1) << i);
+                return std::min(mid_ns, static_cast<double>(stats.m_max_ns)) / 1000.0;
+            }
+        }
+        return stats.m_max_ns / 1000.0;
+    }
+
+}
+
+Zone::Zone(const char* name)
+    : m_name(name)
+    , m_begin_ns(now_ns())
+{
+}
+
+Zone::~Zone()
+{
+    uint64_t end_ns = now_ns();
+    Ring& ring = thread_ring();
+    uint64_t head = ring.m_head.load(std::memory_order_relaxed);
+    Event& event = ring.m_events[head & (Ring::CAPACITY - 1)];
+    event.m_name = m_name;
+    event.m_begin_ns = m_begin_ns;
+    event.m_end_ns = end_ns;
+    ring.m_head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<ZoneReport> report()
+{
+    std::lock_guard lck(s_mutex);
+    for (auto& ring : s_rings)
+        drain_ring(*ring);
+
+    std::vector<ZoneReport> out;
+    out.reserve(s_stats.size());
+    for (const auto& [name, stats] : s_stats) {
+        ZoneReport r {};
+        r.m_name = name;
+        r.m_samples = stats.m_samples;
+        r.m_avg_us = stats.m_total_ns / 1000.0 / stats.m_samples;
+        r.m_max_us = stats.m_max_ns / 1000.0;
+        r.m_p50_us = percentile_us(stats, 0.50);
+        r.m_p95_us = percentile_us(stats, 0.95);
+        r.m_p99_us = percentile_us(stats, 0.99);
+        out.push_back(r);
+    }
+    std::sort(out.begin(), out.end(), [](const ZoneReport& a, const ZoneReport& b) {
+        return a.m_avg_us * a.m_samples > b.m_avg_us * b.m_samples;
+    });
+    return out;
+}
+
+uint64_t dropped_events()
+{
+    std::lock_guard lck(s_mutex);
+    return s_dropped;
+}
+
+void set_trace_capacity(size_t max_events)
+{
+    std::lock_guard lck(s_mutex);
+    s_trace_capacity = max_events;
+    while (s_trace.size() > s_trace_capacity)
+        s_trace.pop_front();
+}
+
+bool write_chrome_trace(const std::string& path)
+{
+    std::lock_guard lck(s_mutex);
+    for (auto& ring : s_rings)
+        drain_ring(*ring);
+    if (s_trace.empty())
+        return false;
+
+    fs::ostream out(path);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& [thread_id, event] : s_trace) {
+        if (first == false)
+            out << ",";
+        first = false;
+        out << "{\"name\":\"" << event.m_name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread_id
+            << ",\"ts\":" << event.m_begin_ns / 1000.0 << ",\"dur\":" << (event.m_end_ns - event.m_begin_ns) / 1000.0 << "}";
+    }
+    out << "]}";
+    return true;
+}
+
+}
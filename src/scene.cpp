@@ -1,4 +1,9 @@
 #include "scene.h"
+#include "profile.h"
+#include <algorithm>
+#include <cmath>
+#include <spdlog/spdlog.h>
+#include <thread>
 
 namespace scene {
 
@@ -14,11 +19,255 @@ glm::mat4 Rotation::transform() const
     return glm::toMat4(m_rotation);
 }
 
+void Node::notify_transform()
+{
+    if (m_scene)
+        m_scene->mark_transform_dirty(m_flat_index);
+}
+
+void Node::notify_structure()
+{
+    if (m_scene)
+        m_scene->invalidate();
+}
+
+uint32_t Scene::flatten(Node* node, int32_t parent)
+{
+    uint32_t index = m_nodes.size();
+    m_nodes.push_back(node);
+    m_parents.push_back(parent);
+    m_subtree_sizes.push_back(1);
+    m_local_transforms.push_back(node->transform());
+    node->m_scene = this;
+    node->m_flat_index = index;
+    if (node->type() == Nodetype::Geometry)
+        m_geometry.push_back({ reinterpret_cast<Geometry*>(node), index });
+
+    for (Node* child : node->children())
+        m_subtree_sizes[index] += flatten(child, index);
+    return m_subtree_sizes[index];
+}
+
+void Scene::compile()
+{
+    m_nodes.clear();
+    m_parents.clear();
+    m_subtree_sizes.clear();
+    m_local_transforms.clear();
+    m_geometry.clear();
+
+    flatten(&m_root, -1);
+    m_world_transforms.resize(m_nodes.size());
+    m_dirty_begin = 0;
+    m_dirty_end = m_nodes.size();
+    m_compiled = true;
+}
+
+void Scene::update_transforms()
+{
+    // parents precede children, so one forward sweep settles the window
+    for (uint32_t i = m_dirty_begin; i < m_dirty_end; i++) {
+        int32_t parent = m_parents[i];
+        m_world_transforms[i] = parent < 0 ? m_local_transforms[i] : m_world_transforms[parent] * m_local_transforms[i];
+    }
+    m_dirty_begin = m_dirty_end = 0;
+}
+
+void Scene::mark_transform_dirty(uint32_t index)
+{
+    // the one virtual transform() call happens here, at the mutation site;
+    // the per-frame sweep is pure matrix arithmetic
+    m_local_transforms[index] = m_nodes[index]->transform();
+    if (m_dirty_begin == m_dirty_end) {
+        m_dirty_begin = index;
+        m_dirty_end = index + m_subtree_sizes[index];
+    } else {
+        m_dirty_begin = std::min(m_dirty_begin, index);
+        m_dirty_end = std::max(m_dirty_end, index + m_subtree_sizes[index]);
+    }
+}
+
+Frustum::Frustum(const glm::mat4& view_proj)
+{
+    glm::mat4 m = glm::transpose(view_proj); // m[i] is row i of view_proj
+    m_planes[0] = m[3] + m[0]; // left
+    m_planes[1] = m[3] - m[0]; // right
+    m_planes[2] = m[3] + m[1]; // bottom
+    m_planes[3] = m[3] - m[1]; // top
+    m_planes[4] = m[2]; // near; clip space is 0..1 (GLM_FORCE_DEPTH_ZERO_TO_ONE)
+    m_planes[5] = m[3] - m[2]; // far
+    for (glm::vec4& plane : m_planes)
+        plane /= glm::length(glm::vec3(plane));
+}
+
+bool Frustum::intersects(const glm::vec4& sphere) const
+{
+    if (sphere.w <= 0.f)
+        return true;
+    glm::vec4 center(sphere.x, sphere.y, sphere.z, 1.f);
+    for (const glm::vec4& plane : m_planes) {
+        if (glm::dot(plane, center) < -sphere.w)
+            return false;
+    }
+    return true;
+}
+
+// world-space bounding sphere, with the radius scaled conservatively by the
+// longest basis vector of the transform
+static glm::vec4 transform_bounds(const glm::mat4& world, const glm::vec4& bounds)
+{
+    if (bounds.w <= 0.f)
+        return bounds;
+    float scale2 = std::max({ glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+        glm::dot(glm::vec3(world[1]), glm::vec3(world[1])),
+        glm::dot(glm::vec3(world[2]), glm::vec3(world[2])) });
+    glm::vec3 center = glm::vec3(world * glm::vec4(bounds.x, bounds.y, bounds.z, 1.f));
+    return glm::vec4(center, bounds.w * std::sqrt(scale2));
+}
+
+void DrawList::build(Scene& scene, const Frustum& frustum)
+{
+    if (!scene.compiled())
+        scene.compile();
+    scene.update_transforms();
+
+    m_visible.clear();
+    for (const auto& geometry : scene.geometries()) {
+        glm::vec4 bounds = transform_bounds(scene.world_transform(geometry.second), geometry.first->mesh().bounding_sphere());
+        if (frustum.intersects(bounds))
+            m_visible.push_back(geometry);
+    }
+
+    // pipeline first, then material, then mesh, so identical mesh+material
+    // pairs land adjacent and every state change covers a whole run
+    std::sort(m_visible.begin(), m_visible.end(), [](const auto& a, const auto& b) {
+        const Material *ma = &a.first->material(), *mb = &b.first->material();
+        if (ma->pipeline() != mb->pipeline())
+            return ma->pipeline() < mb->pipeline();
+        if (ma != mb)
+            return ma < mb;
+        return &a.first->mesh() < &b.first->mesh();
+    });
+
+    m_batches.clear();
+    m_transforms.clear();
+    m_transforms.reserve(m_visible.size());
+    for (const auto& geometry : m_visible) {
+        const Mesh* mesh = &geometry.first->mesh();
+        const Material* material = &geometry.first->material();
+        if (m_batches.empty() || m_batches.back().m_mesh != mesh || m_batches.back().m_material != material)
+            m_batches.push_back({ mesh, material, static_cast<uint32_t>(m_transforms.size()), 0 });
+        m_batches.back().m_instance_count++;
+        m_transforms.push_back(scene.world_transform(geometry.second));
+    }
+}
+
+void DrawList::record(vkw::CommandBuffer& cmd, uint32_t material_set) const
+{
+    const vkw::Pipeline* bound_pipeline = nullptr;
+    const Material* bound_material = nullptr;
+    for (const Batch& batch : m_batches) {
+        const vkw::Pipeline* pipeline = batch.m_material->pipeline();
+        if (pipeline && pipeline != bound_pipeline) {
+            cmd.bind_pipeline(*pipeline);
+            bound_pipeline = pipeline;
+        }
+        if (batch.m_material != bound_material) {
+            cmd.bind_descriptor_set(material_set, batch.m_material->descriptor_set());
+            bound_material = batch.m_material;
+        }
+        batch.m_mesh->draw(cmd, batch.m_instance_count, batch.m_first_instance);
+    }
+}
+
+GpuCuller::GpuCuller(vkw::Allocator& allocator, uint32_t capacity)
+    : m_objects(allocator, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, capacity * sizeof(Object))
+    , m_commands(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, capacity * sizeof(VkDrawIndexedIndirectCommand))
+    , m_count(allocator, vkw::MemoryUsage::DeviceLocal, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, sizeof(uint32_t))
+    , m_capacity(capacity)
+{
+}
+
+void GpuCuller::upload(Scene& scene)
+{
+    if (!scene.compiled())
+        scene.compile();
+    scene.update_transforms();
+
+    m_staging.clear();
+    m_transforms.clear();
+    for (const auto& geometry : scene.geometries()) {
+        VkDrawIndexedIndirectCommand params;
+        if (!geometry.first->mesh().indirect_draw_params(params))
+            continue;
+        if (m_staging.size() == m_capacity) {
+            spdlog::error("GpuCuller: scene exceeds capacity of {} objects; the rest are dropped", m_capacity);
+            break;
+        }
+
+        const glm::mat4& world = scene.world_transform(geometry.second);
+        Object& obj = m_staging.emplace_back();
+        obj.m_bounds = transform_bounds(world, geometry.first->mesh().bounding_sphere());
+        obj.m_index_count = params.indexCount;
+        obj.m_first_index = params.firstIndex;
+        obj.m_vertex_offset = params.vertexOffset;
+        obj.m_first_instance = m_transforms.size();
+        m_transforms.push_back(world);
+    }
+
+    m_object_count = m_staging.size();
+    if (m_object_count != 0)
+        m_objects.write_mapped(m_staging.data(), m_object_count * sizeof(Object));
+}
+
+void GpuCuller::dispatch(vkw::CommandBuffer& cmd, const vkw::Pipeline& pipeline, VkDescriptorSet descriptor_set, const Frustum& frustum)
+{
+    vkCmdFillBuffer(cmd, m_count, 0, VK_WHOLE_SIZE, 0);
+    cmd.defer_buffer_barrier(m_count, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, 0, VK_WHOLE_SIZE, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    cmd.flush_barriers();
+
+    if (m_object_count != 0) {
+        cmd.bind_pipeline(pipeline);
+        cmd.bind_descriptor_set(0, descriptor_set);
+        struct {
+            glm::vec4 m_planes[6];
+            uint32_t m_object_count;
+        } push;
+        std::copy(frustum.planes(), frustum.planes() + 6, push.m_planes);
+        push.m_object_count = m_object_count;
+        cmd.push_constants(VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), &push);
+        vkCmdDispatch(cmd, (m_object_count + 63) / 64, 1, 1);
+    }
+
+    cmd.defer_buffer_barrier(m_commands, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, 0, VK_WHOLE_SIZE, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+    cmd.defer_buffer_barrier(m_count, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, 0, VK_WHOLE_SIZE, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+    cmd.flush_barriers();
+}
+
+void GpuCuller::draw(vkw::CommandBuffer& cmd) const
+{
+    cmd.draw_indexed_indirect_count(m_commands, 0, m_count, 0, m_object_count, sizeof(VkDrawIndexedIndirectCommand));
+}
+
 SceneVisitor::SceneVisitor()
 {
     m_matrix_stack.push(glm::mat4(1.f));
 }
 
+void SceneVisitor::visit(Scene& scene)
+{
+    PROF_ZONE("SceneVisitor::visit");
+    if (!scene.compiled())
+        scene.compile();
+    scene.update_transforms();
+
+    for (const auto& geometry : scene.geometries()) {
+        m_current = &scene.world_transform(geometry.second);
+        visitGeometry(*geometry.first);
+    }
+    m_current = nullptr;
+}
+
 void SceneVisitor::visit(Node* node)
 {
     // TODO convert to iteration
@@ -46,4 +295,36 @@ void SceneVisitor::visit(Node* node)
         m_matrix_stack.pop();
 }
 
+void ParallelSceneRecorder::record(Scene& scene, vkw::ParallelCommandPool& pools, const vkw::RenderPass& render_pass, size_t subpass, const vkw::Framebuffer& framebuffer,
+    vkw::CommandBuffer& primary, const std::function<void(const DrawItem&, vkw::CommandBuffer&)>& record_item)
+{
+    m_items.clear();
+    GatherVisitor gather;
+    gather.m_items = &m_items;
+    gather.visit(scene);
+    if (m_items.empty())
+        return;
+
+    size_t workers = std::min(pools.worker_count(), m_items.size());
+    size_t slice = (m_items.size() + workers - 1) / workers;
+    std::vector<VkCommandBuffer> recorded(workers);
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (size_t w = 0; w < workers; w++) {
+        threads.emplace_back([&, w]() {
+            vkw::CommandBuffer& cmd = pools.worker(w).get(VK_COMMAND_BUFFER_LEVEL_SECONDARY, 0);
+            cmd.begin(render_pass, subpass, framebuffer, true);
+            size_t end = std::min(m_items.size(), (w + 1) * slice);
+            for (size_t i = w * slice; i < end; i++)
+                record_item(m_items[i], cmd);
+            cmd.end();
+            recorded[w] = cmd;
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+
+    primary.execute_commands(recorded);
+}
+
 }
@@ -1,15 +1,29 @@
 #include "vkw/vkw.h"
+#include "profile.h"
+#include <algorithm>
 #include <set>
 #include <spdlog/spdlog.h>
 
 namespace vkw {
 
 static constexpr auto NO_SUCH_MEMTYPE = std::numeric_limits<size_t>::max();
+
+std::mutex Allocator::s_arena_mtx;
+uint64_t Allocator::s_arena_epoch_counter = 0;
+std::map<const Allocator*, uint64_t> Allocator::s_live_allocators;
 static VkDeviceAddress align_down(VkDeviceAddress offset, VkDeviceSize alignment)
 {
     return offset & ~(alignment - 1);
 }
 
+static uint32_t fls64(uint64_t v)
+{
+    uint32_t r = 0;
+    while (v >>= 1)
+        r++;
+    return r;
+}
+
 static VkDeviceAddress align_up(VkDeviceAddress offset, VkDeviceSize alignment)
 {
     return align_down(offset + alignment - 1, alignment);
@@ -43,9 +57,11 @@ void SingleAllocation::reset()
     m_memory = VK_NULL_HANDLE;
 }
 
-Allocator::Allocator(const Device& device, bool best_fit)
+Allocator::Allocator(const Device& device, bool best_fit, bool thread_arenas)
     : m_device(device)
     , m_best_fit(best_fit)
+    , m_use_thread_arenas(thread_arenas)
+    , m_free_queue(nullptr)
 {
     VkPhysicalDeviceProperties device_props;
     VkPhysicalDeviceMemoryProperties mem_props;
@@ -58,12 +74,23 @@ Allocator::Allocator(const Device& device, bool best_fit)
     m_types.assign(mem_props.memoryTypes, mem_props.memoryTypes + mem_props.memoryTypeCount);
     m_pools.resize(mem_props.memoryTypeCount);
     m_pool_mtx.resize(mem_props.memoryTypeCount);
+    m_counters.resize(mem_props.memoryTypeCount);
     m_buffer_image_granularity = device_props.limits.bufferImageGranularity;
     m_integrated_gpu = device_props.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU;
+
+    std::lock_guard lck(s_arena_mtx);
+    m_arena_epoch = ++s_arena_epoch_counter;
+    s_live_allocators[this] = m_arena_epoch;
 }
 
 Allocator::~Allocator()
 {
+    // Deregister first: once we are out of the set, departing threads skip
+    // their arena entries for us instead of touching blocks clear() frees.
+    {
+        std::lock_guard lck(s_arena_mtx);
+        s_live_allocators.erase(this);
+    }
     clear();
 }
 
@@ -92,6 +119,12 @@ bool Allocator::allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlag
     if (m_heaps[heap_index].size < requirements.size)
         return false;
 
+    if (m_use_thread_arenas && linear && dedicated == false && requirements.size <= ARENA_MAX_ALLOCATION) {
+        if (allocate_from_arena(requirements, type_index, out))
+            return true;
+        // The shared pool below remains the fallback.
+    }
+
     std::lock_guard lck(m_pool_mtx[type_index]);
     std::unique_ptr<DMemBlock> new_block = nullptr;
     if (dedicated == false) {
@@ -104,8 +137,10 @@ bool Allocator::allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlag
             out.m_block_index = i;
             out.m_type_index = type_index;
             out.m_memory = pool[i]->m_handle;
-            if (pool[i]->allocate(requirements.size, requirements.alignment, linear, m_buffer_image_granularity, out))
+            if (pool[i]->allocate(requirements.size, requirements.alignment, linear, m_buffer_image_granularity, out)) {
+                m_counters[type_index].m_used += out.m_size;
                 return true;
+            }
         }
 
         // 2. If failed, try to create a new block of memory with the preferred size.
@@ -129,7 +164,118 @@ bool Allocator::allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlag
     out.m_block_index = insert_block(m_pools[type_index], new_block);
     out.m_type_index = type_index;
     out.m_memory = m_pools[type_index][out.m_block_index]->m_handle;
-    return m_pools[type_index][out.m_block_index]->allocate(requirements.size, requirements.alignment, linear, m_buffer_image_granularity, out);
+    m_counters[type_index].m_reserved += m_pools[type_index][out.m_block_index]->m_size;
+    m_counters[type_index].m_blocks++;
+    if (m_pools[type_index][out.m_block_index]->allocate(requirements.size, requirements.alignment, linear, m_buffer_image_granularity, out)) {
+        m_counters[type_index].m_used += out.m_size;
+        return true;
+    }
+    return false;
+}
+
+Allocator::ThreadArena& Allocator::thread_arena()
+{
+    static thread_local ThreadArenaHolder s_holder;
+    ThreadArena& arena = s_holder.m_arenas[this];
+    if (arena.m_epoch != m_arena_epoch) {
+        // First use — or the entry of a destroyed allocator that this one's
+        // address was recycled from, whose block pointers are dangling.
+        // Either way, start clean.
+        arena.m_epoch = m_arena_epoch;
+        arena.m_active.assign(m_types.size(), nullptr);
+        arena.m_active_index.assign(m_types.size(), 0);
+    }
+    return arena;
+}
+
+Allocator::ThreadArenaHolder::~ThreadArenaHolder()
+{
+    std::lock_guard lck(s_arena_mtx);
+    for (auto& [allocator, arena] : m_arenas) {
+        auto live = s_live_allocators.find(allocator);
+        if (live != s_live_allocators.end() && live->second == arena.m_epoch)
+            allocator->abandon_arena(arena);
+    }
+}
+
+// Unpins a departing thread's active blocks so they become reclaimable, and
+// frees right away any that are already empty — otherwise an exhausted
+// loader-thread arena would strand device memory until some later free
+// happened to land in the same block. The caller holds s_arena_mtx, which
+// also keeps this allocator alive until the hand-off completes.
+void Allocator::abandon_arena(ThreadArena& arena)
+{
+    for (size_t type_index = 0; type_index < arena.m_active.size(); type_index++) {
+        DMemBlock* block = arena.m_active[type_index];
+        if (block == nullptr)
+            continue;
+
+        std::lock_guard lck(m_pool_mtx[type_index]);
+        arena.m_active[type_index] = nullptr;
+        block->m_arena.store(false);
+
+        // Pending frees for this block still count toward allocated(), so an
+        // empty block here has nothing left in the MPSC queue either.
+        auto& pool = m_pools[type_index];
+        auto& slot = pool[arena.m_active_index[type_index]];
+        if (slot.get() == block && block->allocated() == 0
+            && std::count_if(pool.begin(), pool.end(), [](std::unique_ptr<DMemBlock>& b) { return bool(b); }) > 1) {
+            std::unique_ptr<DMemBlock> owned_block = nullptr;
+            owned_block.swap(slot);
+
+            m_counters[type_index].m_reserved -= owned_block->m_size;
+            m_counters[type_index].m_blocks--;
+            if (owned_block->m_address)
+                vkUnmapMemory(m_device, owned_block->m_handle);
+            vkFreeMemory(m_device, owned_block->m_handle, nullptr);
+        }
+    }
+}
+
+bool Allocator::allocate_from_arena(VkMemoryRequirements requirements, size_t type_index, SingleAllocation& out)
+{
+    ThreadArena& arena = thread_arena();
+    DMemBlock* block = arena.m_active[type_index];
+    if (block != nullptr) {
+        // The active block is pinned (m_arena), so no other thread can free
+        // it out from under us; its own mutex is uncontended here.
+        out.m_block_index = arena.m_active_index[type_index];
+        out.m_type_index = type_index;
+        out.m_memory = block->m_handle;
+        if (block->allocate(requirements.size, requirements.alignment, true, m_buffer_image_granularity, out)) {
+            m_counters[type_index].m_used += out.m_size;
+            return true;
+        }
+    }
+
+    // The active block is exhausted: apply deferred frees, unpin it, and pin
+    // a fresh block under the pool lock.
+    drain_free_queue();
+    std::lock_guard lck(m_pool_mtx[type_index]);
+    if (block != nullptr)
+        block->m_arena.store(false);
+
+    std::unique_ptr<DMemBlock> new_block = create_memory_block(ARENA_BLOCK_SIZE, type_index);
+    if (new_block == nullptr) {
+        arena.m_active[type_index] = nullptr;
+        return false;
+    }
+    new_block->m_arena.store(true);
+    size_t block_index = insert_block(m_pools[type_index], new_block);
+    block = m_pools[type_index][block_index].get();
+    arena.m_active[type_index] = block;
+    arena.m_active_index[type_index] = block_index;
+    m_counters[type_index].m_reserved += block->m_size;
+    m_counters[type_index].m_blocks++;
+
+    out.m_block_index = block_index;
+    out.m_type_index = type_index;
+    out.m_memory = block->m_handle;
+    if (block->allocate(requirements.size, requirements.alignment, true, m_buffer_image_granularity, out)) {
+        m_counters[type_index].m_used += out.m_size;
+        return true;
+    }
+    return false;
 }
 
 size_t Allocator::find_type_index(VkMemoryRequirements requirements, VkMemoryPropertyFlags flags) const
@@ -178,6 +324,7 @@ size_t Allocator::insert_block(Pool& pool, std::unique_ptr<DMemBlock>& block)
 
 void Allocator::clear()
 {
+    drain_free_queue();
     for (size_t i = 0; i < m_pools.size(); i++) {
         std::lock_guard lck(m_pool_mtx[i]);
         for (auto& itt : m_pools[i]) {
@@ -186,6 +333,11 @@ void Allocator::clear()
         }
     }
     m_pools.clear();
+    for (auto& counters : m_counters) {
+        counters.m_used.store(0);
+        counters.m_reserved.store(0);
+        counters.m_blocks.store(0);
+    }
 }
 
 VkMemoryPropertyFlags Allocator::required_flags(MemoryUsage usage) const
@@ -220,6 +372,7 @@ VkMemoryPropertyFlags Allocator::preferred_flags(MemoryUsage usage) const
 
 bool Allocator::allocate(VkBuffer buffer, MemoryUsage usage, SingleAllocation& out)
 {
+    PROF_ZONE("Allocator::allocate");
     if (out)
         spdlog::error("Allocator::allocate(): passed allocation pointing to {}: {}", (uintptr_t)out.m_memory, out.m_offset);
 
@@ -249,6 +402,7 @@ bool Allocator::allocate(VkBuffer buffer, MemoryUsage usage, SingleAllocation& o
 
 bool Allocator::allocate(VkImage image, MemoryUsage usage, SingleAllocation& out)
 {
+    PROF_ZONE("Allocator::allocate");
     if (out)
         spdlog::error("Allocator::allocate(): passed allocation pointing to {}: {}", (uintptr_t)out.m_memory, out.m_offset);
 
@@ -279,25 +433,54 @@ bool Allocator::allocate(VkImage image, MemoryUsage usage, SingleAllocation& out
 void Allocator::free(SingleAllocation& a)
 {
     if (a) {
-        std::lock_guard lck(m_pool_mtx[a.m_type_index]);
-        auto& pool = m_pools[a.m_type_index];
-        auto& block = pool[a.m_block_index];
-        assert(block);
-        block->free(a.m_chunk_id);
-
-        if (block->allocated() == 0) {
-            if (std::count_if(pool.begin(), pool.end(), [](std::unique_ptr<DMemBlock>& b) { return bool(b); }) > 1) {
-                std::unique_ptr<DMemBlock> owned_block = nullptr;
-                owned_block.swap(block);
-
-                if (owned_block->m_address)
-                    vkUnmapMemory(m_device, owned_block->m_handle);
-                vkFreeMemory(m_device, owned_block->m_handle, nullptr);
-            }
+        if (m_use_thread_arenas) {
+            // Route through the MPSC queue so frees from other threads never
+            // contend with an arena owner's allocation path.
+            PendingFree* node = new PendingFree { nullptr, a.m_type_index, a.m_block_index, a.m_chunk_id };
+            node->m_next = m_free_queue.load(std::memory_order_relaxed);
+            while (m_free_queue.compare_exchange_weak(node->m_next, node, std::memory_order_release, std::memory_order_relaxed) == false)
+                ;
+            a.reset();
+            return;
+        }
+
+        release(a.m_type_index, a.m_block_index, a.m_chunk_id);
+    }
+}
+
+void Allocator::release(size_t type_index, size_t block_index, uint64_t chunk_id)
+{
+    std::lock_guard lck(m_pool_mtx[type_index]);
+    auto& pool = m_pools[type_index];
+    auto& block = pool[block_index];
+    assert(block);
+    m_counters[type_index].m_used -= block->free(chunk_id);
+
+    if (block->allocated() == 0 && block->m_arena.load() == false) {
+        if (std::count_if(pool.begin(), pool.end(), [](std::unique_ptr<DMemBlock>& b) { return bool(b); }) > 1) {
+            std::unique_ptr<DMemBlock> owned_block = nullptr;
+            owned_block.swap(block);
+
+            m_counters[type_index].m_reserved -= owned_block->m_size;
+            m_counters[type_index].m_blocks--;
+            if (owned_block->m_address)
+                vkUnmapMemory(m_device, owned_block->m_handle);
+            vkFreeMemory(m_device, owned_block->m_handle, nullptr);
         }
     }
 }
 
+void Allocator::drain_free_queue()
+{
+    PendingFree* head = m_free_queue.exchange(nullptr, std::memory_order_acquire);
+    while (head != nullptr) {
+        PendingFree* next = head->m_next;
+        release(head->m_type_index, head->m_block_index, head->m_chunk_id);
+        delete head;
+        head = next;
+    }
+}
+
 void* Allocator::map_memory(const SingleAllocation& a)
 {
     std::lock_guard lck(m_pool_mtx[a.m_type_index]);
@@ -362,19 +545,164 @@ void Allocator::invalidate(const SingleAllocation& a) const
     }
 }
 
+Allocator::TypeStats Allocator::type_stats(size_t type_index)
+{
+    TypeStats out {};
+    out.m_used = m_counters[type_index].m_used.load(std::memory_order_relaxed);
+    out.m_reserved = m_counters[type_index].m_reserved.load(std::memory_order_relaxed);
+    out.m_block_count = m_counters[type_index].m_blocks.load(std::memory_order_relaxed);
+
+    // The counters above never touch a mutex; only the largest-free-chunk
+    // scan takes the pool lock, and it reads two bitmaps per block.
+    VkDeviceSize largest_free = 0;
+    {
+        std::lock_guard lck(m_pool_mtx[type_index]);
+        for (auto& block : m_pools[type_index]) {
+            if (block)
+                largest_free = std::max(largest_free, block->largest_free_hint());
+        }
+    }
+    VkDeviceSize total_free = out.m_reserved - out.m_used;
+    if (total_free > 0 && largest_free < total_free)
+        out.m_fragmentation = 1.f - static_cast<float>(double(largest_free) / double(total_free));
+    return out;
+}
+
+std::vector<Allocator::HeapStats> Allocator::heap_stats() const
+{
+    std::vector<HeapStats> out(m_heaps.size());
+    for (size_t i = 0; i < m_heaps.size(); i++)
+        out[i].m_size = m_heaps[i].size;
+    for (size_t i = 0; i < m_types.size(); i++) {
+        HeapStats& heap = out[m_types[i].heapIndex];
+        heap.m_used += m_counters[i].m_used.load(std::memory_order_relaxed);
+        heap.m_reserved += m_counters[i].m_reserved.load(std::memory_order_relaxed);
+    }
+
+    if (m_device.has_memory_budget()) {
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budget {};
+        budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+        VkPhysicalDeviceMemoryProperties2 mem_props {};
+        mem_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+        mem_props.pNext = &budget;
+        vkGetPhysicalDeviceMemoryProperties2(m_device.hwd(), &mem_props);
+        for (size_t i = 0; i < m_heaps.size(); i++) {
+            out[i].m_budget = budget.heapBudget[i];
+            out[i].m_usage = budget.heapUsage[i];
+        }
+    }
+    return out;
+}
+
 Allocator::DMemBlock::DMemBlock(VkDeviceMemory handle, VkDeviceSize size, bool best_fit)
     : m_handle(handle)
     , m_size(size)
     , m_best_fit(best_fit)
+    , m_arena(false)
+    , m_used(0)
     , m_map_count(0)
     , m_counter(2)
     , m_address(nullptr)
+    , m_fl_bitmap(0)
 {
+    m_sl_bitmap.fill(0);
+    for (auto& fl_bins : m_free_bins)
+        fl_bins.fill(0);
+
     m_chunks[1].m_size = size;
     m_chunks[1].m_offset = 0;
     m_chunks[1].m_ty = Allocator::Subchunk::Type::Free;
     m_chunks[1].m_prev = 0;
     m_chunks[1].m_next = 0;
+    m_chunks[1].m_in_index = false;
+    index_insert(1);
+}
+
+void Allocator::DMemBlock::size_class(VkDeviceSize size, uint32_t& fl, uint32_t& sl)
+{
+    uint32_t msb = fls64(size | 1);
+    if (msb < SL_INDEX_SHIFT) {
+        fl = 0;
+        sl = static_cast<uint32_t>(size);
+    } else {
+        fl = msb - SL_INDEX_SHIFT + 1;
+        sl = static_cast<uint32_t>(size >> (msb - SL_INDEX_SHIFT)) & (SL_INDEX_COUNT - 1);
+        if (fl >= FL_INDEX_COUNT) {
+            fl = FL_INDEX_COUNT - 1;
+            sl = SL_INDEX_COUNT - 1;
+        }
+    }
+}
+
+void Allocator::DMemBlock::index_insert(uint64_t id)
+{
+    Subchunk& chunk = m_chunks[id];
+    assert(chunk.m_ty == Subchunk::Type::Free && chunk.m_in_index == false);
+
+    uint32_t fl, sl;
+    size_class(chunk.m_size, fl, sl);
+    chunk.m_free_prev = 0;
+    chunk.m_free_next = m_free_bins[fl][sl];
+    chunk.m_in_index = true;
+    if (chunk.m_free_next != 0)
+        m_chunks[chunk.m_free_next].m_free_prev = id;
+    m_free_bins[fl][sl] = id;
+    m_fl_bitmap |= uint64_t(1) << fl;
+    m_sl_bitmap[fl] |= uint16_t(1) << sl;
+}
+
+void Allocator::DMemBlock::index_remove(uint64_t id)
+{
+    Subchunk& chunk = m_chunks[id];
+    assert(chunk.m_in_index);
+
+    uint32_t fl, sl;
+    size_class(chunk.m_size, fl, sl);
+    if (chunk.m_free_prev != 0)
+        m_chunks[chunk.m_free_prev].m_free_next = chunk.m_free_next;
+    else
+        m_free_bins[fl][sl] = chunk.m_free_next;
+    if (chunk.m_free_next != 0)
+        m_chunks[chunk.m_free_next].m_free_prev = chunk.m_free_prev;
+    chunk.m_free_prev = chunk.m_free_next = 0;
+    chunk.m_in_index = false;
+
+    if (m_free_bins[fl][sl] == 0) {
+        m_sl_bitmap[fl] &= ~(uint16_t(1) << sl);
+        if (m_sl_bitmap[fl] == 0)
+            m_fl_bitmap &= ~(uint64_t(1) << fl);
+    }
+}
+
+uint64_t Allocator::DMemBlock::first_free_chunk(uint32_t& fl, uint32_t& sl) const
+{
+    // Find the first non-empty bin at or above (fl, sl).
+    uint16_t sl_bits = m_sl_bitmap[fl] & static_cast<uint16_t>(~uint32_t(0) << sl);
+    if (sl_bits == 0) {
+        uint64_t fl_bits = m_fl_bitmap & (~uint64_t(0) << (fl + 1));
+        if (fl_bits == 0)
+            return 0;
+        fl = fls64(fl_bits & (~fl_bits + 1));
+        sl_bits = m_sl_bitmap[fl];
+    }
+    sl = fls64(sl_bits & static_cast<uint16_t>(~sl_bits + 1));
+    return m_free_bins[fl][sl];
+}
+
+uint64_t Allocator::DMemBlock::next_free_chunk(uint64_t id, uint32_t& fl, uint32_t& sl) const
+{
+    uint64_t next = m_chunks.at(id).m_free_next;
+    if (next != 0)
+        return next;
+    if (sl + 1 < SL_INDEX_COUNT) {
+        sl++;
+        return first_free_chunk(fl, sl);
+    } else if (fl + 1 < FL_INDEX_COUNT) {
+        fl++;
+        sl = 0;
+        return first_free_chunk(fl, sl);
+    }
+    return 0;
 }
 
 uint64_t Allocator::DMemBlock::next_chunk_id()
@@ -390,11 +718,19 @@ void Allocator::DMemBlock::merge_free_chunks(uint64_t li, uint64_t ri)
     Subchunk& right = m_chunks[ri];
     Subchunk& left = m_chunks[li];
 
+    // The merged chunk lands in a different size class, so unlink both
+    // halves and re-index the survivor.
+    if (right.m_in_index)
+        index_remove(ri);
+    if (left.m_in_index)
+        index_remove(li);
+
     left.m_next = right.m_next;
     left.m_size += right.m_size;
     if (right.m_next != 0)
         m_chunks[right.m_next].m_prev = li;
     m_chunks.erase(ri);
+    index_insert(li);
 }
 
 bool Allocator::DMemBlock::allocate(VkDeviceSize size, VkDeviceSize alignment, bool linear, VkDeviceSize granularity, SingleAllocation& out)
@@ -403,12 +739,28 @@ bool Allocator::DMemBlock::allocate(VkDeviceSize size, VkDeviceSize alignment, b
         return false;
 
     uint64_t best_fit_id = 0, best_offset, best_chunk_size, best_aligned_size;
+    uint32_t hit_fl = 0, hit_sl = 0;
     best_chunk_size = best_aligned_size = std::numeric_limits<uint64_t>::max();
 
     std::lock_guard lck(m_mtx);
-    for (auto& it : m_chunks) {
-        Subchunk& chunk = it.second;
-        if (chunk.m_ty == Subchunk::Type::Free && chunk.m_size >= size) {
+
+    // Round the request up one second-level class so every chunk in the bin
+    // we land in is guaranteed large enough, then scan free chunks in
+    // ascending size-class order.
+    VkDeviceSize search_size = size;
+    uint32_t msb = fls64(size | 1);
+    if (msb >= SL_INDEX_SHIFT)
+        search_size += (VkDeviceSize(1) << (msb - SL_INDEX_SHIFT)) - 1;
+
+    uint32_t fl, sl;
+    size_class(search_size, fl, sl);
+    for (uint64_t id = first_free_chunk(fl, sl); id != 0; id = next_free_chunk(id, fl, sl)) {
+        // Once a bin has produced a fit, later bins can only hold larger chunks.
+        if (best_fit_id != 0 && (fl != hit_fl || sl != hit_sl))
+            break;
+
+        Subchunk& chunk = m_chunks[id];
+        if (chunk.m_size >= size) {
             uint64_t offset = align_up(chunk.m_offset, alignment);
             if (chunk.m_prev != 0) {
                 Subchunk& prev_chunk = m_chunks[chunk.m_prev];
@@ -427,10 +779,12 @@ bool Allocator::DMemBlock::allocate(VkDeviceSize size, VkDeviceSize alignment, b
             }
 
             if (best_fit_id == 0 || chunk.m_size < best_chunk_size) {
-                best_fit_id = it.first;
+                best_fit_id = id;
                 best_aligned_size = aligned_size;
                 best_offset = offset;
                 best_chunk_size = chunk.m_size;
+                hit_fl = fl;
+                hit_sl = sl;
             }
             if (m_best_fit == false)
                 break;
@@ -439,27 +793,33 @@ bool Allocator::DMemBlock::allocate(VkDeviceSize size, VkDeviceSize alignment, b
 
     if (best_fit_id == 0)
         return false;
+    index_remove(best_fit_id);
 
     if (best_chunk_size > best_aligned_size) {
         // Subdivide the best chunk.
         uint64_t parent_id = best_fit_id, child_id = next_chunk_id();
-        if (child_id == 0)
+        if (child_id == 0) {
+            index_insert(best_fit_id);
             return false;
+        }
 
         m_chunks[child_id].m_size = best_aligned_size;
         m_chunks[child_id].m_offset = m_chunks[parent_id].m_offset;
         m_chunks[child_id].m_ty = linear ? Subchunk::Type::Linear : Subchunk::Type::Image;
         m_chunks[child_id].m_prev = m_chunks[parent_id].m_prev;
         m_chunks[child_id].m_next = best_fit_id;
+        m_chunks[child_id].m_in_index = false;
         m_chunks[parent_id].m_prev = child_id;
         m_chunks[parent_id].m_offset += best_aligned_size;
         m_chunks[parent_id].m_size -= best_aligned_size;
         if (m_chunks[child_id].m_prev != 0)
             m_chunks[m_chunks[child_id].m_prev].m_next = child_id;
+        index_insert(parent_id);
 
         out.m_chunk_id = child_id;
         out.m_size = best_aligned_size;
         out.m_offset = best_offset;
+        m_used += best_aligned_size;
         return true;
     } else {
         // The best chunk is optimal; use it directly.
@@ -467,30 +827,138 @@ bool Allocator::DMemBlock::allocate(VkDeviceSize size, VkDeviceSize alignment, b
         out.m_chunk_id = best_fit_id;
         out.m_size = best_aligned_size;
         out.m_offset = best_offset;
+        m_used += best_aligned_size;
         return true;
     }
 }
-void Allocator::DMemBlock::free(uint64_t id)
+VkDeviceSize Allocator::DMemBlock::free(uint64_t id)
 {
     auto it = m_chunks.find(id);
-    if (it != m_chunks.end()) {
-        std::lock_guard lck(m_mtx);
-        it->second.m_ty = Subchunk::Type::Free;
-        uint64_t prev_id = it->second.m_prev, next_id = it->second.m_next;
-        if (next_id && m_chunks[next_id].m_ty == Subchunk::Type::Free)
-            merge_free_chunks(id, next_id);
-        if (prev_id && m_chunks[prev_id].m_ty == Subchunk::Type::Free)
-            merge_free_chunks(prev_id, id);
+    if (it == m_chunks.end())
+        return 0;
+
+    std::lock_guard lck(m_mtx);
+    VkDeviceSize freed = it->second.m_size;
+    it->second.m_ty = Subchunk::Type::Free;
+    it->second.m_in_index = false;
+    uint64_t prev_id = it->second.m_prev, next_id = it->second.m_next;
+    if (next_id && m_chunks[next_id].m_ty == Subchunk::Type::Free)
+        merge_free_chunks(id, next_id);
+    if (prev_id && m_chunks[prev_id].m_ty == Subchunk::Type::Free) {
+        merge_free_chunks(prev_id, id);
+        id = prev_id;
     }
+    if (m_chunks[id].m_in_index == false)
+        index_insert(id);
+    m_used -= freed;
+    return freed;
 }
 VkDeviceSize Allocator::DMemBlock::allocated() const
 {
-    VkDeviceSize total = 0;
-    for (auto& ch : m_chunks) {
-        if (ch.second.m_ty != Allocator::Subchunk::Type::Free)
-            total += ch.second.m_size;
+    return m_used.load(std::memory_order_relaxed);
+}
+VkDeviceSize Allocator::DMemBlock::largest_free_hint() const
+{
+    // Read the TLSF bitmaps without the block mutex; a torn read only makes
+    // the hint momentarily stale, which is acceptable for statistics.
+    if (m_fl_bitmap == 0)
+        return 0;
+    uint32_t fl = fls64(m_fl_bitmap);
+    uint16_t sl_map = m_sl_bitmap[fl];
+    uint32_t sl = sl_map ? fls64(sl_map) : 0;
+    if (fl == 0)
+        return sl;
+    // Lower bound of the topmost populated bin.
+    return (VkDeviceSize(1) << (fl + SL_INDEX_SHIFT - 1)) + (VkDeviceSize(sl) << (fl - 1));
+}
+
+Defragmenter::Defragmenter(Allocator& allocator, VkDeviceSize byte_budget_per_frame)
+    : m_allocator(allocator)
+    , m_byte_budget(byte_budget_per_frame)
+{
+}
+
+void Defragmenter::watch(Buffer<1>& buffer, VkBufferUsageFlags usage, MemoryUsage mem_usage)
+{
+    m_watched.push_back({ &buffer, usage, mem_usage });
+}
+
+void Defragmenter::unwatch(Buffer<1>& buffer)
+{
+    m_watched.erase(std::remove_if(m_watched.begin(), m_watched.end(), [&buffer](const WatchedBuffer& w) { return w.m_buffer == &buffer; }), m_watched.end());
+}
+
+bool Defragmenter::should_move(const SingleAllocation& a)
+{
+    std::lock_guard lck(m_allocator.m_pool_mtx[a.m_type_index]);
+    Allocator::Pool& pool = m_allocator.m_pools[a.m_type_index];
+    // Draining the only block of a type would just shuffle bytes in place.
+    if (std::count_if(pool.begin(), pool.end(), [](const std::unique_ptr<Allocator::DMemBlock>& b) { return b != nullptr; }) <= 1)
+        return false;
+
+    auto& block = pool[a.m_block_index];
+    if (block == nullptr || block->m_arena.load())
+        return false;
+    // Only drain blocks that are mostly empty; moving out of a well-utilized
+    // block costs more bandwidth than the fragmentation it returns.
+    return block->allocated() * 2 < block->m_size;
+}
+
+bool Defragmenter::run(CommandBuffer& cmd, GarbageCollector& gc)
+{
+    VkResult res;
+    VkDeviceSize budget = m_byte_budget;
+    bool moved = false;
+
+    for (WatchedBuffer& w : m_watched) {
+        SingleAllocation& a = w.m_buffer->m_allocation[0];
+        if (!a || a.m_size > budget)
+            continue;
+        if (should_move(a) == false)
+            continue;
+
+        VkBufferCreateInfo createinfo {};
+        createinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        createinfo.size = w.m_buffer->size();
+        createinfo.usage = w.m_usage;
+        createinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        VkBuffer replacement;
+        if ((res = vkCreateBuffer(m_allocator.m_device, &createinfo, nullptr, &replacement)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateBuffer: {}", res);
+            abort();
+        }
+        SingleAllocation replacement_allocation;
+        if (m_allocator.allocate(replacement, w.m_mem_usage, replacement_allocation) == false) {
+            // There is no better home for this chunk right now. Try again on a
+            // later run, once other moves have opened up space.
+            vkDestroyBuffer(m_allocator.m_device, replacement, nullptr);
+            continue;
+        }
+        if (replacement_allocation.m_type_index == a.m_type_index && replacement_allocation.m_block_index == a.m_block_index) {
+            // The replacement landed in the block being drained, so the move
+            // would accomplish nothing.
+            m_allocator.free(replacement_allocation);
+            vkDestroyBuffer(m_allocator.m_device, replacement, nullptr);
+            continue;
+        }
+
+        VkBufferCopy copy;
+        copy.srcOffset = 0;
+        copy.dstOffset = 0;
+        copy.size = w.m_buffer->size();
+        vkCmdCopyBuffer(cmd, w.m_buffer->m_handle[0], replacement, 1, &copy);
+
+        gc.add(w.m_buffer->m_handle[0]);
+        gc.add(m_allocator, a);
+        w.m_buffer->m_handle[0] = replacement;
+        w.m_buffer->m_allocation[0] = replacement_allocation;
+        budget -= copy.size;
+        moved = true;
+        if (budget == 0)
+            break;
     }
-    return total;
+    return moved;
 }
 
 }
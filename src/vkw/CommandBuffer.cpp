@@ -5,6 +5,8 @@ namespace vkw {
 
 CommandPool::CommandPool(const Device& device, QueueFamilyType ty, size_t primary, size_t secondary, bool transient)
     : m_device(device)
+    , m_handle(device.frames_in_flight())
+    , m_buffers(2 * device.frames_in_flight())
 {
     auto queue_family_index = device.queue_family_index(ty);
     if (queue_family_index == -1) {
@@ -21,7 +23,7 @@ CommandPool::CommandPool(const Device& device, QueueFamilyType ty, size_t primar
         createinfo.flags |= VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
     std::vector<VkCommandBuffer> pHandles(primary), sHandles(secondary);
-    for (int i = 0; i < 2; i++) {
+    for (size_t i = 0; i < m_handle.size(); i++) {
         if ((res = vkCreateCommandPool(m_device, &createinfo, nullptr, &m_handle[i])) != VK_SUCCESS) {
             spdlog::critical("vkCreateCommandPool: {}", res);
             abort();
@@ -35,13 +37,15 @@ CommandPool::CommandPool(const Device& device, QueueFamilyType ty, size_t primar
         allocinfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
         allocinfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
         allocinfo.commandPool = m_handle[i];
-        allocinfo.commandBufferCount = primary;
-        if ((res = vkAllocateCommandBuffers(m_device, &allocinfo, pHandles.data())) != VK_SUCCESS) {
-            spdlog::critical("vkAllocateCommandBuffers(PRIMARY, {}): {}", primary, res);
-            abort();
+        if (primary > 0) {
+            allocinfo.commandBufferCount = primary;
+            if ((res = vkAllocateCommandBuffers(m_device, &allocinfo, pHandles.data())) != VK_SUCCESS) {
+                spdlog::critical("vkAllocateCommandBuffers(PRIMARY, {}): {}", primary, res);
+                abort();
+            }
+            for (size_t j = 0; j < primary; j++)
+                m_buffers[2 * i].push_back(CommandBuffer(pHandles[j], allocinfo.level));
         }
-        for (size_t j = 0; j < primary; j++)
-            m_buffers[2 * i].push_back(CommandBuffer(pHandles[j], allocinfo.level));
 
         if (secondary > 0) {
             allocinfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
@@ -58,24 +62,21 @@ CommandPool::CommandPool(const Device& device, QueueFamilyType ty, size_t primar
 
 CommandPool::~CommandPool()
 {
-    std::vector<VkCommandBuffer> command_buffers[2];
-    command_buffers[0].reserve(m_buffers[0].size() + m_buffers[1].size());
-    command_buffers[1].reserve(m_buffers[0].size() + m_buffers[1].size());
-    for (int i = 0; i < 4; i++) {
-        for (auto it = m_buffers[i].begin(); it != m_buffers[i].end(); ++it) {
-            command_buffers[i / 2].push_back(it->m_handle);
+    for (size_t i = 0; i < m_handle.size(); i++) {
+        std::vector<VkCommandBuffer> command_buffers;
+        command_buffers.reserve(m_buffers[2 * i].size() + m_buffers[2 * i + 1].size());
+        for (int j = 0; j < 2; j++) {
+            for (auto it = m_buffers[2 * i + j].begin(); it != m_buffers[2 * i + j].end(); ++it)
+                command_buffers.push_back(it->m_handle);
         }
-    }
-
-    for (int i = 0; i < 2; i++)
-        vkFreeCommandBuffers(m_device, m_handle[i], command_buffers[i].size(), command_buffers[i].data());
-    for (int i = 0; i < 2; i++)
+        vkFreeCommandBuffers(m_device, m_handle[i], command_buffers.size(), command_buffers.data());
         vkDestroyCommandPool(m_device, m_handle[i], nullptr);
+    }
 }
 
 void CommandPool::trim()
 {
-    vkTrimCommandPool(m_device, m_handle[m_device.current_frame() % 2], 0);
+    vkTrimCommandPool(m_device, m_handle[m_device.frame_index()], 0);
 }
 
 void CommandPool::reset(bool release_resources)
@@ -85,20 +86,35 @@ void CommandPool::reset(bool release_resources)
     if (release_resources)
         flags |= VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT;
 
-    if ((res = vkResetCommandPool(m_device, m_handle[m_device.current_frame() % 2], flags)) != VK_SUCCESS) {
+    if ((res = vkResetCommandPool(m_device, m_handle[m_device.frame_index()], flags)) != VK_SUCCESS) {
         spdlog::critical("vkResetCommandPool: {}", res);
         abort();
     }
 }
 
+ParallelCommandPool::ParallelCommandPool(const Device& device, QueueFamilyType ty, size_t workers, size_t secondary_per_worker, bool transient)
+    : m_device(device)
+{
+    if (workers == 0)
+        workers = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    for (size_t i = 0; i < workers; i++)
+        m_pools.emplace_back(device, ty, 0, secondary_per_worker, transient);
+}
+
+void ParallelCommandPool::reset(bool release_resources)
+{
+    for (CommandPool& pool : m_pools)
+        pool.reset(release_resources);
+}
+
 CommandBuffer& CommandPool::get(VkCommandBufferLevel level, size_t index)
 {
-    auto& buffers = m_buffers[((m_device.current_frame() % 2) * 2) + (level == VK_COMMAND_BUFFER_LEVEL_PRIMARY ? 0 : 1)];
+    auto& buffers = m_buffers[(m_device.frame_index() * 2) + (level == VK_COMMAND_BUFFER_LEVEL_PRIMARY ? 0 : 1)];
     if (index < buffers.size())
         return buffers[index];
 
     spdlog::critical("CommandPool::acquire(level={}, frame={}, index={}): only {} command buffers available",
-        level == VK_COMMAND_BUFFER_LEVEL_PRIMARY ? "PRIMARY" : "SECONDARY", index, m_device.current_frame() % 2, buffers.size());
+        level == VK_COMMAND_BUFFER_LEVEL_PRIMARY ? "PRIMARY" : "SECONDARY", index, m_device.frame_index(), buffers.size());
     abort();
 }
 
@@ -186,7 +202,13 @@ void CommandBuffer::push_constants(VkShaderStageFlags stage, uint32_t offset, ui
 
 void CommandBuffer::set_image_layout(VkImage image, VkImageLayout from, VkImageLayout to, VkImageSubresourceRange& subresource, VkPipelineStageFlags src_stage_mask, VkPipelineStageFlags dst_stage_mask)
 {
-    VkImageMemoryBarrier barrier {};
+    defer_image_layout(image, from, to, subresource, src_stage_mask, dst_stage_mask);
+    flush_barriers();
+}
+
+void CommandBuffer::defer_image_layout(VkImage image, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkPipelineStageFlags src_stage_mask, VkPipelineStageFlags dst_stage_mask)
+{
+    VkImageMemoryBarrier& barrier = m_pending_image_barriers.emplace_back();
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.srcAccessMask = image_layout_access_mask(from);
     barrier.dstAccessMask = image_layout_access_mask(to);
@@ -195,8 +217,112 @@ void CommandBuffer::set_image_layout(VkImage image, VkImageLayout from, VkImageL
     barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image;
     barrier.subresourceRange = subresource;
+    m_pending_src_stages |= src_stage_mask;
+    m_pending_dst_stages |= dst_stage_mask;
+}
+
+void CommandBuffer::defer_buffer_barrier(VkBuffer buffer, VkAccessFlags src_access, VkAccessFlags dst_access, VkDeviceSize offset, VkDeviceSize size, VkPipelineStageFlags src_stage_mask, VkPipelineStageFlags dst_stage_mask)
+{
+    VkBufferMemoryBarrier& barrier = m_pending_buffer_barriers.emplace_back();
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+    m_pending_src_stages |= src_stage_mask;
+    m_pending_dst_stages |= dst_stage_mask;
+}
 
-    vkCmdPipelineBarrier(*this, src_stage_mask, dst_stage_mask, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+void CommandBuffer::release_buffer_ownership(VkBuffer buffer, uint32_t src_family, uint32_t dst_family, VkAccessFlags src_access, VkDeviceSize offset, VkDeviceSize size, VkPipelineStageFlags src_stage_mask)
+{
+    if (src_family == dst_family)
+        return;
+
+    VkBufferMemoryBarrier& barrier = m_pending_buffer_barriers.emplace_back();
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = 0; // the acquire half carries the destination access
+    barrier.srcQueueFamilyIndex = src_family;
+    barrier.dstQueueFamilyIndex = dst_family;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+    m_pending_src_stages |= src_stage_mask;
+    m_pending_dst_stages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+}
+
+void CommandBuffer::acquire_buffer_ownership(VkBuffer buffer, uint32_t src_family, uint32_t dst_family, VkAccessFlags dst_access, VkDeviceSize offset, VkDeviceSize size, VkPipelineStageFlags dst_stage_mask)
+{
+    if (src_family == dst_family)
+        return;
+
+    VkBufferMemoryBarrier& barrier = m_pending_buffer_barriers.emplace_back();
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0; // the release half already made the writes available
+    barrier.dstAccessMask = dst_access;
+    barrier.srcQueueFamilyIndex = src_family;
+    barrier.dstQueueFamilyIndex = dst_family;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+    m_pending_src_stages |= VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    m_pending_dst_stages |= dst_stage_mask;
+}
+
+void CommandBuffer::release_image_ownership(VkImage image, uint32_t src_family, uint32_t dst_family, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkAccessFlags src_access, VkPipelineStageFlags src_stage_mask)
+{
+    if (src_family == dst_family) {
+        if (from != to)
+            defer_image_layout(image, from, to, subresource, src_stage_mask, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        return;
+    }
+
+    VkImageMemoryBarrier& barrier = m_pending_image_barriers.emplace_back();
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = from;
+    barrier.newLayout = to;
+    barrier.srcQueueFamilyIndex = src_family;
+    barrier.dstQueueFamilyIndex = dst_family;
+    barrier.image = image;
+    barrier.subresourceRange = subresource;
+    m_pending_src_stages |= src_stage_mask;
+    m_pending_dst_stages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+}
+
+void CommandBuffer::acquire_image_ownership(VkImage image, uint32_t src_family, uint32_t dst_family, VkImageLayout from, VkImageLayout to, const VkImageSubresourceRange& subresource, VkAccessFlags dst_access, VkPipelineStageFlags dst_stage_mask)
+{
+    if (src_family == dst_family)
+        return;
+
+    VkImageMemoryBarrier& barrier = m_pending_image_barriers.emplace_back();
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = dst_access;
+    barrier.oldLayout = from; // must repeat the release half's transition exactly
+    barrier.newLayout = to;
+    barrier.srcQueueFamilyIndex = src_family;
+    barrier.dstQueueFamilyIndex = dst_family;
+    barrier.image = image;
+    barrier.subresourceRange = subresource;
+    m_pending_src_stages |= VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    m_pending_dst_stages |= dst_stage_mask;
+}
+
+void CommandBuffer::flush_barriers()
+{
+    if (m_pending_image_barriers.empty() && m_pending_buffer_barriers.empty())
+        return;
+
+    vkCmdPipelineBarrier(*this, m_pending_src_stages, m_pending_dst_stages, 0, 0, nullptr,
+        m_pending_buffer_barriers.size(), m_pending_buffer_barriers.data(),
+        m_pending_image_barriers.size(), m_pending_image_barriers.data());
+    m_pending_image_barriers.clear();
+    m_pending_buffer_barriers.clear();
+    m_pending_src_stages = m_pending_dst_stages = 0;
 }
 
 void CommandBuffer::set_viewport(float x, float y, float w, float h, float min_depth, float max_depth)
@@ -219,6 +345,17 @@ void CommandBuffer::set_scissor(int32_t x, int32_t y, uint32_t w, uint32_t h)
     vkCmdSetScissor(*this, 0, 1, &scissor);
 }
 
+void CommandBuffer::draw_indexed_indirect_count(VkBuffer buffer, VkDeviceSize offset, VkBuffer count_buffer, VkDeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+    vkCmdDrawIndexedIndirectCount(*this, buffer, offset, count_buffer, count_offset, max_draw_count, stride);
+}
+
+void CommandBuffer::execute_commands(const std::vector<VkCommandBuffer>& buffers)
+{
+    if (!buffers.empty())
+        vkCmdExecuteCommands(*this, buffers.size(), buffers.data());
+}
+
 void CommandBuffer::end()
 {
     VkResult res = vkEndCommandBuffer(*this);
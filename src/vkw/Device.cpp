@@ -1,5 +1,6 @@
 #define VK_ENABLE_BETA_EXTENSIONS
 #include "vkw/vkw.h"
+#include <algorithm>
 #include <set>
 #include <spdlog/spdlog.h>
 
@@ -36,8 +37,9 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vk_debug_callback(
     return VK_FALSE;
 }
 
-Device::Device(GLFWwindow* window)
+Device::Device(GLFWwindow* window, uint32_t frames_in_flight)
     : m_window(window)
+    , m_frames_in_flight(std::min(std::max(frames_in_flight, 1u), MAX_FRAMES_IN_FLIGHT))
 {
     VkResult res;
 
@@ -123,7 +125,26 @@ Device::Device(GLFWwindow* window)
         abort();
     }
     create_logical_device();
-    m_swapchain = std::make_unique<Swapchain>(m_device, m_surface, m_window, m_hwd);
+
+    // One monotonically increasing timeline paces the whole frame loop: the
+    // frame-N submission signals it with N + 1, and wait_frame_slot() blocks
+    // on the value that frees up frame N's resource slot.
+    {
+        VkSemaphoreTypeCreateInfo type_createinfo {};
+        type_createinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        type_createinfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        type_createinfo.initialValue = 0;
+        VkSemaphoreCreateInfo createinfo {};
+        createinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        createinfo.pNext = &type_createinfo;
+        if ((res = vkCreateSemaphore(m_device, &createinfo, nullptr, &m_frame_timeline)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateSemaphore: {}", res);
+            abort();
+        }
+    }
+
+    m_gpu_profiler.initialize(*this);
+    m_swapchain = std::make_unique<Swapchain>(m_device, m_surface, m_window, m_hwd, m_present_mode_preference);
 }
 
 Device::~Device()
@@ -131,6 +152,8 @@ Device::~Device()
     vkDeviceWaitIdle(m_device);
 
     m_swapchain.reset();
+    m_gpu_profiler.destroy();
+    vkDestroySemaphore(m_device, m_frame_timeline, nullptr);
     vkDestroyDevice(m_device, nullptr);
     if (m_debug_messenger != VK_NULL_HANDLE)
         s_vkDestroyDebugUtilsMessenger(m_instance, m_debug_messenger, nullptr);
@@ -315,7 +338,7 @@ std::vector<VkDeviceQueueCreateInfo> Device::describe_device_queues()
     m_queue_family_indexes.compute = async_compute_queue;
     m_queue_family_indexes.compute_count = async_compute_queue == -1 ? 0 : qfprop[async_compute_queue].queueCount;
     m_queue_family_indexes.transfer = best_transfer_queue.first;
-    m_queue_family_indexes.combined_count = best_transfer_queue.first == -1 ? 0 : qfprop[best_transfer_queue.first].queueCount;
+    m_queue_family_indexes.transfer_count = best_transfer_queue.first == -1 ? 0 : qfprop[best_transfer_queue.first].queueCount;
     return createinfos;
 }
 
@@ -332,12 +355,19 @@ void Device::create_logical_device()
             extensions.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
         if (strcmp(VK_KHR_SWAPCHAIN_EXTENSION_NAME, ext.extensionName) == 0)
             extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        if (strcmp(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, ext.extensionName) == 0) {
+            extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            m_memory_budget = true;
+        }
     }
 
-    VkPhysicalDeviceProperties properties {};
-    vkGetPhysicalDeviceProperties(m_hwd, &properties);
-    spdlog::info("selecting device {}", properties.deviceName);
-    memcpy(&m_device_limits, &properties.limits, sizeof(VkPhysicalDeviceLimits));
+    m_device_limits12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+    VkPhysicalDeviceProperties2 properties {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &m_device_limits12;
+    vkGetPhysicalDeviceProperties2(m_hwd, &properties);
+    spdlog::info("selecting device {}", properties.properties.deviceName);
+    memcpy(&m_device_limits, &properties.properties.limits, sizeof(VkPhysicalDeviceLimits));
 
     VkPhysicalDeviceVulkan12Features available_features12 {};
     available_features12.sType = m_device_features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
@@ -358,6 +388,23 @@ void Device::create_logical_device()
         m_max_anisotropy = properties.limits.maxSamplerAnisotropy;
     }
     // Enable features in features{,11,12} if they're on in available_features{,11,12}.
+    if (available_features12.runtimeDescriptorArray && available_features12.descriptorBindingPartiallyBound
+        && available_features12.descriptorBindingSampledImageUpdateAfterBind && available_features12.descriptorBindingVariableDescriptorCount) {
+        // everything DescriptorPool's bindless texture array needs
+        m_device_features12.runtimeDescriptorArray = true;
+        m_device_features12.descriptorBindingPartiallyBound = true;
+        m_device_features12.descriptorBindingSampledImageUpdateAfterBind = true;
+        m_device_features12.descriptorBindingVariableDescriptorCount = true;
+    }
+    // mandatory on any Vulkan 1.2 device, but it still has to be enabled
+    if (available_features12.timelineSemaphore)
+        m_device_features12.timelineSemaphore = true;
+    // lets GpuProfiler reset its query pools without a command buffer
+    if (available_features12.hostQueryReset)
+        m_device_features12.hostQueryReset = true;
+    // lets GPU-culled draw lists execute with a device-side draw count
+    if (available_features12.drawIndirectCount)
+        m_device_features12.drawIndirectCount = true;
 
     std::vector<VkDeviceQueueCreateInfo> queue_createinfos = describe_device_queues();
     VkDeviceCreateInfo createinfo {};
@@ -428,18 +475,36 @@ VkQueue Device::queue(QueueFamilyType t, size_t index) const
     return q;
 }
 
+void Device::recreate_swapchain()
+{
+    wait_for_window_foreground();
+
+    GarbageCollector retirer;
+    std::unique_ptr<Swapchain> tmp_swapchain = std::make_unique<Swapchain>(m_device, m_surface, m_window, m_hwd, m_present_mode_preference, *m_swapchain);
+    tmp_swapchain.swap(m_swapchain); // m_swapchain is new, tmp_swapchain is the retired handle.
+    retirer.add(std::move(tmp_swapchain));
+    m_recreate_swapchain_cb(*this, retirer);
+    m_retiring.push_back(std::make_pair(std::move(retirer), m_frames_in_flight + 1));
+}
+
+void Device::set_present_mode_preference(std::vector<VkPresentModeKHR>&& preference, bool recreate)
+{
+    m_present_mode_preference = std::move(preference);
+    if (recreate && m_present_mode_preference.empty() == false && m_swapchain->present_mode() != m_present_mode_preference.front())
+        recreate_swapchain();
+}
+
 void Device::acquire_next_image(VkSemaphore ready_signal)
 {
+    auto acquire_start = std::chrono::steady_clock::now();
     VkResult res = vkAcquireNextImageKHR(m_device, *m_swapchain, std::numeric_limits<uint64_t>::max(), ready_signal, VK_NULL_HANDLE, &m_swapchain_image_index);
+    double blocked_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - acquire_start).count();
+    m_pacing.m_last_acquire_block_ms = blocked_ms;
+    m_pacing.m_max_acquire_block_ms = std::max(m_pacing.m_max_acquire_block_ms, blocked_ms);
+    m_pacing.m_avg_acquire_block_ms += (blocked_ms - m_pacing.m_avg_acquire_block_ms) / ++m_pacing.m_acquire_samples;
+
     if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-        wait_for_window_foreground();
-
-        GarbageCollector retirer;
-        std::unique_ptr<Swapchain> tmp_swapchain = std::make_unique<Swapchain>(m_device, m_surface, m_window, m_hwd, *m_swapchain);
-        tmp_swapchain.swap(m_swapchain); // m_swapchain is new, tmp_swapchain is the retired handle.
-        retirer.add(std::move(tmp_swapchain));
-        m_recreate_swapchain_cb(*this, retirer);
-        m_retiring.push_back(std::make_pair(std::move(retirer), 3));
+        recreate_swapchain();
     } else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
         spdlog::critical("vkAcquireNextImageKHR: {}", res);
         abort();
@@ -467,20 +532,23 @@ void Device::present_image(const std::initializer_list<VkSemaphore>& _wait_sem)
     vkGetDeviceQueue(m_device, m_queue_family_indexes.combined, 0, &present_queue);
     VkResult res = vkQueuePresentKHR(present_queue, &present_info);
     if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR) {
-        wait_for_window_foreground();
-
-        GarbageCollector retirer;
-        std::unique_ptr<Swapchain> tmp_swapchain(new Swapchain(m_device, m_surface, m_window, m_hwd, *m_swapchain));
-        tmp_swapchain.swap(m_swapchain);
-        retirer.add(std::move(tmp_swapchain));
-        m_recreate_swapchain_cb(*this, retirer);
-        m_retiring.push_back(std::make_pair(std::move(retirer), 3));
+        recreate_swapchain();
     } else if (res != VK_SUCCESS) {
         spdlog::critical("vkQueuePresentKHR: {}", res);
         abort();
     }
 
     if (res == VK_SUCCESS || res == VK_SUBOPTIMAL_KHR) {
+        auto now = std::chrono::steady_clock::now();
+        if (m_last_present_time.time_since_epoch().count() != 0) {
+            double interval_ms = std::chrono::duration<double, std::milli>(now - m_last_present_time).count();
+            size_t bucket = std::min<size_t>(interval_ms / FramePacingStats::INTERVAL_BUCKET_MS, FramePacingStats::INTERVAL_BUCKET_COUNT - 1);
+            m_pacing.m_last_interval_ms = interval_ms;
+            m_pacing.m_interval_histogram[bucket]++;
+            m_pacing.m_interval_samples++;
+        }
+        m_last_present_time = now;
+
         auto it = m_retiring.begin();
         while (it != m_retiring.end()) {
             if (it->second > 0)
@@ -508,6 +576,30 @@ bool Device::wait_for_fences(const std::initializer_list<VkFence>& fences, bool
     }
 }
 
+bool Device::wait_frame_slot(uint64_t timeout) const
+{
+    // frame N reuses the slot last used by frame N - frames_in_flight, whose
+    // submission signalled the timeline with N - frames_in_flight + 1
+    if (m_frame_number < m_frames_in_flight)
+        return true;
+    uint64_t value = m_frame_number - m_frames_in_flight + 1;
+
+    VkSemaphoreWaitInfo wait_info {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &m_frame_timeline;
+    wait_info.pValues = &value;
+    VkResult res = vkWaitSemaphores(m_device, &wait_info, timeout);
+    if (res == VK_SUCCESS)
+        return true;
+    else if (res == VK_TIMEOUT)
+        return false;
+    else {
+        spdlog::critical("vkWaitSemaphores: {}", res);
+        abort();
+    }
+}
+
 void Device::wait_for_window_foreground()
 {
     int width = 0, height = 0;
@@ -518,7 +610,7 @@ void Device::wait_for_window_foreground()
     }
 }
 
-Swapchain::Swapchain(VkDevice device, VkSurfaceKHR surface, GLFWwindow* window, VkPhysicalDevice hwd, VkSwapchainKHR old_swapchain)
+Swapchain::Swapchain(VkDevice device, VkSurfaceKHR surface, GLFWwindow* window, VkPhysicalDevice hwd, const std::vector<VkPresentModeKHR>& present_mode_preference, VkSwapchainKHR old_swapchain)
     : m_device(device)
 {
     VkSurfaceCapabilitiesKHR capabilities;
@@ -569,10 +661,14 @@ Swapchain::Swapchain(VkDevice device, VkSurfaceKHR surface, GLFWwindow* window,
     createinfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     createinfo.clipped = VK_TRUE;
     createinfo.oldSwapchain = old_swapchain;
-    if (std::find(present_modes.begin(), present_modes.end(), VK_PRESENT_MODE_MAILBOX_KHR) != present_modes.end())
-        createinfo.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
-    else
-        createinfo.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    m_present_mode = VK_PRESENT_MODE_FIFO_KHR; // the only mode the spec guarantees
+    for (VkPresentModeKHR preferred : present_mode_preference) {
+        if (std::find(present_modes.begin(), present_modes.end(), preferred) != present_modes.end()) {
+            m_present_mode = preferred;
+            break;
+        }
+    }
+    createinfo.presentMode = m_present_mode;
 
     VkResult res = vkCreateSwapchainKHR(device, &createinfo, nullptr, &m_handle);
     if (res != VK_SUCCESS) {
@@ -622,6 +718,8 @@ void GarbageCollector::add(Framebuffer& framebuffer)
 
 void GarbageCollector::retire(Device& device)
 {
+    for (auto& x : m_buffers)
+        vkDestroyBuffer(device, x, nullptr);
     for (auto& x : m_allocations)
         x.first->free(x.second);
     for (auto& x : m_framebuffers)
@@ -632,6 +730,129 @@ void GarbageCollector::retire(Device& device)
         vkDestroyImageView(device, x, nullptr);
 }
 
+void GpuProfiler::initialize(const Device& device)
+{
+    if (!device.limits().timestampComputeAndGraphics || !device.features12().hostQueryReset) {
+        spdlog::info("GpuProfiler: timestamps or host query reset unavailable; GPU zones are disabled");
+        return;
+    }
+
+    m_owner = &device;
+    m_device = device;
+    m_timestamp_period = device.limits().timestampPeriod;
+    m_frames.resize(device.frames_in_flight());
+
+    VkResult res;
+    VkQueryPoolCreateInfo createinfo {};
+    createinfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    createinfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    createinfo.queryCount = MAX_ZONES * 2;
+    for (frame_queries& frame : m_frames) {
+        if ((res = vkCreateQueryPool(m_device, &createinfo, nullptr, &frame.m_pool)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateQueryPool: {}", res);
+            abort();
+        }
+        vkResetQueryPool(m_device, frame.m_pool, 0, MAX_ZONES * 2);
+    }
+}
+
+void GpuProfiler::destroy()
+{
+    for (frame_queries& frame : m_frames)
+        vkDestroyQueryPool(m_device, frame.m_pool, nullptr);
+    m_frames.clear();
+    m_device = VK_NULL_HANDLE;
+}
+
+GpuProfiler::zone_accum& GpuProfiler::accumulator(const std::string& name)
+{
+    for (zone_accum& z : m_zones) {
+        if (z.m_name == name)
+            return z;
+    }
+    auto& z = m_zones.emplace_back();
+    z.m_name = name;
+    return z;
+}
+
+void GpuProfiler::begin_frame()
+{
+    if (!enabled())
+        return;
+
+    frame_queries& frame = m_frames[m_owner->frame_index()];
+    if (!frame.m_zones.empty()) {
+        // the slot's submission retired before wait_frame_slot returned, so
+        // these results are available and the wait flag never blocks
+        std::vector<uint64_t> ticks(frame.m_zones.size() * 2);
+        VkResult res = vkGetQueryPoolResults(m_device, frame.m_pool, 0, ticks.size(), ticks.size() * sizeof(uint64_t), ticks.data(),
+            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        if (res != VK_SUCCESS) {
+            spdlog::critical("vkGetQueryPoolResults: {}", res);
+            abort();
+        }
+
+        for (size_t i = 0; i < frame.m_zones.size(); i++) {
+            double us = (ticks[2 * i + 1] - ticks[2 * i]) * m_timestamp_period / 1000.0;
+            zone_accum& z = accumulator(frame.m_zones[i]);
+            if (z.m_samples == 0)
+                z.m_min_us = z.m_max_us = us;
+            else {
+                z.m_min_us = std::min(z.m_min_us, us);
+                z.m_max_us = std::max(z.m_max_us, us);
+            }
+            z.m_total_us += us;
+            z.m_samples++;
+        }
+        vkResetQueryPool(m_device, frame.m_pool, 0, frame.m_zones.size() * 2);
+        frame.m_zones.clear();
+    }
+}
+
+uint32_t GpuProfiler::begin_zone(VkCommandBuffer cmd, const char* name)
+{
+    if (!enabled())
+        return UINT32_MAX;
+
+    frame_queries& frame = m_frames[m_owner->frame_index()];
+    if (frame.m_zones.size() >= MAX_ZONES) {
+        spdlog::error("GpuProfiler::begin_zone({}): out of zones this frame", name);
+        return UINT32_MAX;
+    }
+
+    uint32_t zone = frame.m_zones.size();
+    frame.m_zones.emplace_back(name);
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.m_pool, zone * 2);
+    return zone;
+}
+
+void GpuProfiler::end_zone(VkCommandBuffer cmd, uint32_t zone)
+{
+    if (!enabled() || zone == UINT32_MAX)
+        return;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_frames[m_owner->frame_index()].m_pool, zone * 2 + 1);
+}
+
+std::vector<GpuProfiler::ZoneStats> GpuProfiler::results() const
+{
+    std::vector<ZoneStats> out;
+    out.reserve(m_zones.size());
+    for (const zone_accum& z : m_zones) {
+        auto& stats = out.emplace_back();
+        stats.m_name = z.m_name;
+        stats.m_samples = z.m_samples;
+        stats.m_min_us = z.m_min_us;
+        stats.m_avg_us = z.m_samples ? z.m_total_us / z.m_samples : 0;
+        stats.m_max_us = z.m_max_us;
+    }
+    return out;
+}
+
+void GpuProfiler::reset_statistics()
+{
+    m_zones.clear();
+}
+
 QueueSubmission& QueueSubmission::wait_on(VkSemaphore sem, VkPipelineStageFlags stage)
 {
     m_submits.back().m_wait_sem.push_back(sem);
@@ -645,6 +866,12 @@ QueueSubmission& QueueSubmission::signal(VkSemaphore sem)
     return *this;
 }
 
+QueueSubmission& QueueSubmission::signal_frame()
+{
+    m_signal_frame = true;
+    return *this;
+}
+
 QueueSubmission& QueueSubmission::add(const CommandBuffer& cb)
 {
     m_submits.back().m_command_buffers.push_back(VkCommandBuffer(cb));
@@ -665,6 +892,9 @@ void QueueSubmission::to_queue(QueueFamilyType ty, size_t index, VkFence signal)
         return;
     }
 
+    if (m_signal_frame)
+        m_submits.back().m_signal_sem.push_back(m_device.frame_timeline());
+
     std::vector<VkSubmitInfo> submit_info(m_submits.size());
     for (size_t i = 0; i < m_submits.size(); i++) {
         VkSubmitInfo& si = submit_info[i];
@@ -679,6 +909,20 @@ void QueueSubmission::to_queue(QueueFamilyType ty, size_t index, VkFence signal)
         si.pSignalSemaphores = store.m_signal_sem.data();
     }
 
+    // signal values line up with the signal semaphores of the last batch;
+    // the values paired with binary semaphores are ignored
+    VkTimelineSemaphoreSubmitInfo timeline_info {};
+    std::vector<uint64_t> signal_values;
+    if (m_signal_frame) {
+        VkSubmitInfo& si = submit_info.back();
+        signal_values.resize(si.signalSemaphoreCount, 0);
+        signal_values.back() = uint64_t(m_device.current_frame()) + 1;
+        timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timeline_info.signalSemaphoreValueCount = signal_values.size();
+        timeline_info.pSignalSemaphoreValues = signal_values.data();
+        si.pNext = &timeline_info;
+    }
+
     VkResult res = vkQueueSubmit(queue, submit_info.size(), submit_info.data(), signal);
     if (res != VK_SUCCESS) {
         spdlog::critical("vkQueueSubmit: {}", res);
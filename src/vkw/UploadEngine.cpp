@@ -0,0 +1,313 @@
+#include "vkw/vkw.h"
+#include "profile.h"
+#include <spdlog/spdlog.h>
+
+namespace vkw {
+
+UploadEngine::UploadEngine(const Device& device, Allocator& allocator, VkDeviceSize staging_size)
+    : m_device(device)
+    , m_allocator(allocator)
+    , m_staging(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, staging_size)
+    , m_head(0)
+    , m_tail(0)
+    , m_current(0)
+    , m_retire(0)
+    , m_in_flight(0)
+    , m_recording(false)
+{
+    VkResult res;
+    m_staging_map = allocator.map_memory(m_staging.allocation()[0]);
+
+    VkCommandPoolCreateInfo pool_createinfo {};
+    pool_createinfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_createinfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_createinfo.queueFamilyIndex = device.queue_family_index(QueueFamilyType::Transfer);
+    if ((res = vkCreateCommandPool(device, &pool_createinfo, nullptr, &m_transfer_pool)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateCommandPool: {}", res);
+        abort();
+    }
+    pool_createinfo.queueFamilyIndex = device.queue_family_index(QueueFamilyType::Graphics);
+    if ((res = vkCreateCommandPool(device, &pool_createinfo, nullptr, &m_acquire_pool)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateCommandPool: {}", res);
+        abort();
+    }
+
+    std::array<VkCommandBuffer, BATCH_COUNT> transfer_cmds, acquire_cmds;
+    VkCommandBufferAllocateInfo cmd_allocinfo {};
+    cmd_allocinfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_allocinfo.commandPool = m_transfer_pool;
+    cmd_allocinfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_allocinfo.commandBufferCount = BATCH_COUNT;
+    if ((res = vkAllocateCommandBuffers(device, &cmd_allocinfo, transfer_cmds.data())) != VK_SUCCESS) {
+        spdlog::critical("vkAllocateCommandBuffers: {}", res);
+        abort();
+    }
+    cmd_allocinfo.commandPool = m_acquire_pool;
+    if ((res = vkAllocateCommandBuffers(device, &cmd_allocinfo, acquire_cmds.data())) != VK_SUCCESS) {
+        spdlog::critical("vkAllocateCommandBuffers: {}", res);
+        abort();
+    }
+
+    VkSemaphoreCreateInfo sem_createinfo {};
+    sem_createinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VkFenceCreateInfo fence_createinfo {};
+    fence_createinfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    for (size_t i = 0; i < BATCH_COUNT; i++) {
+        Batch& batch = m_batches[i];
+        batch.m_transfer_cmd = transfer_cmds[i];
+        batch.m_acquire_cmd = acquire_cmds[i];
+        if ((res = vkCreateSemaphore(device, &sem_createinfo, nullptr, &batch.m_handoff)) != VK_SUCCESS || (res = vkCreateSemaphore(device, &sem_createinfo, nullptr, &batch.m_done)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateSemaphore: {}", res);
+            abort();
+        }
+        if ((res = vkCreateFence(device, &fence_createinfo, nullptr, &batch.m_fence)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateFence: {}", res);
+            abort();
+        }
+        batch.m_reclaim = 0;
+        batch.m_submitted = false;
+    }
+}
+
+UploadEngine::~UploadEngine()
+{
+    finish();
+    m_allocator.unmap_memory(m_staging.allocation()[0]);
+    for (Batch& batch : m_batches) {
+        vkDestroySemaphore(m_device, batch.m_handoff, nullptr);
+        vkDestroySemaphore(m_device, batch.m_done, nullptr);
+        vkDestroyFence(m_device, batch.m_fence, nullptr);
+    }
+    vkDestroyCommandPool(m_device, m_transfer_pool, nullptr);
+    vkDestroyCommandPool(m_device, m_acquire_pool, nullptr);
+}
+
+void UploadEngine::begin_batch()
+{
+    if (m_recording)
+        return;
+    while (m_in_flight == BATCH_COUNT)
+        retire_oldest(true);
+    if (m_in_flight == 0)
+        m_head = m_tail = 0;
+
+    VkResult res;
+    VkCommandBufferBeginInfo begininfo {};
+    begininfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begininfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if ((res = vkBeginCommandBuffer(m_batches[m_current].m_transfer_cmd, &begininfo)) != VK_SUCCESS) {
+        spdlog::critical("vkBeginCommandBuffer: {}", res);
+        abort();
+    }
+    m_recording = true;
+}
+
+VkDeviceSize UploadEngine::reserve(VkDeviceSize length)
+{
+    length = (length + 3) & ~VkDeviceSize(3);
+    if (length > m_staging.size()) {
+        spdlog::critical("UploadEngine: upload of {} bytes exceeds the staging ring of {}", length, m_staging.size());
+        abort();
+    }
+    for (;;) {
+        // The occupied region runs from m_tail to m_head; the strict
+        // comparisons below keep m_head from catching m_tail, so the two
+        // being equal always means the ring is empty.
+        if (m_head >= m_tail) {
+            if (m_head + length <= m_staging.size()) {
+                VkDeviceSize offset = m_head;
+                m_head += length;
+                return offset;
+            }
+            if (length < m_tail) {
+                m_head = length;
+                return 0;
+            }
+        } else if (m_head + length < m_tail) {
+            VkDeviceSize offset = m_head;
+            m_head += length;
+            return offset;
+        }
+        if (m_in_flight == 0) {
+            // Everything staged belongs to the batch being recorded.
+            spdlog::critical("UploadEngine: staging ring of {} cannot hold a single batch", m_staging.size());
+            abort();
+        }
+        retire_oldest(true);
+    }
+}
+
+void UploadEngine::add_ownership_transfer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    uint32_t transfer_family = m_device.queue_family_index(QueueFamilyType::Transfer);
+    uint32_t graphics_family = m_device.queue_family_index(QueueFamilyType::Graphics);
+    if (transfer_family == graphics_family)
+        return;
+
+    VkBufferMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.srcQueueFamilyIndex = transfer_family;
+    barrier.dstQueueFamilyIndex = graphics_family;
+    barrier.buffer = buffer;
+    barrier.offset = offset;
+    barrier.size = size;
+    m_release_barriers.push_back(barrier);
+
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    m_acquire_barriers.push_back(barrier);
+}
+
+void UploadEngine::upload(Buffer<1>& dst, const void* data, size_t length, VkDeviceSize dst_offset)
+{
+    PROF_ZONE("UploadEngine::upload");
+    begin_batch();
+    VkDeviceSize src_offset = reserve(length);
+    memcpy(reinterpret_cast<char*>(m_staging_map) + src_offset, data, length);
+
+    VkBufferCopy copy;
+    copy.srcOffset = src_offset;
+    copy.dstOffset = dst_offset;
+    copy.size = length;
+    vkCmdCopyBuffer(m_batches[m_current].m_transfer_cmd, m_staging[0], dst[0], 1, &copy);
+    add_ownership_transfer(dst[0], dst_offset, length);
+}
+
+void UploadEngine::upload(Buffer<1>& dst, fs::istream&& input, size_t length, VkDeviceSize dst_offset)
+{
+    PROF_ZONE("UploadEngine::upload");
+    begin_batch();
+    VkDeviceSize src_offset = reserve(length);
+    input.read(reinterpret_cast<char*>(m_staging_map) + src_offset, length);
+
+    VkBufferCopy copy;
+    copy.srcOffset = src_offset;
+    copy.dstOffset = dst_offset;
+    copy.size = length;
+    vkCmdCopyBuffer(m_batches[m_current].m_transfer_cmd, m_staging[0], dst[0], 1, &copy);
+    add_ownership_transfer(dst[0], dst_offset, length);
+}
+
+void UploadEngine::copy(Buffer<1>& dst, Buffer<1>& src_buffer, VkDeviceSize src_offset)
+{
+    begin_batch();
+    VkBufferCopy copy;
+    copy.srcOffset = src_offset;
+    copy.dstOffset = 0;
+    copy.size = std::min(src_buffer.size() - src_offset, dst.size());
+    vkCmdCopyBuffer(m_batches[m_current].m_transfer_cmd, src_buffer[0], dst[0], 1, &copy);
+    add_ownership_transfer(dst[0], 0, copy.size);
+}
+
+VkSemaphore UploadEngine::submit(std::function<void()>&& on_complete)
+{
+    PROF_ZONE("UploadEngine::submit");
+    if (m_recording == false) {
+        if (on_complete)
+            on_complete();
+        return VK_NULL_HANDLE;
+    }
+
+    VkResult res;
+    Batch& batch = m_batches[m_current];
+    if (m_release_barriers.empty() == false)
+        vkCmdPipelineBarrier(batch.m_transfer_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, m_release_barriers.size(), m_release_barriers.data(), 0, nullptr);
+    if ((res = vkEndCommandBuffer(batch.m_transfer_cmd)) != VK_SUCCESS) {
+        spdlog::critical("vkEndCommandBuffer: {}", res);
+        abort();
+    }
+
+    VkCommandBufferBeginInfo begininfo {};
+    begininfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begininfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if ((res = vkBeginCommandBuffer(batch.m_acquire_cmd, &begininfo)) != VK_SUCCESS) {
+        spdlog::critical("vkBeginCommandBuffer: {}", res);
+        abort();
+    }
+    if (m_acquire_barriers.empty() == false)
+        vkCmdPipelineBarrier(batch.m_acquire_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, m_acquire_barriers.size(), m_acquire_barriers.data(), 0, nullptr);
+    if ((res = vkEndCommandBuffer(batch.m_acquire_cmd)) != VK_SUCCESS) {
+        spdlog::critical("vkEndCommandBuffer: {}", res);
+        abort();
+    }
+
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkSubmitInfo submitinfo {};
+    submitinfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitinfo.commandBufferCount = 1;
+    submitinfo.pCommandBuffers = &batch.m_transfer_cmd;
+    submitinfo.signalSemaphoreCount = 1;
+    submitinfo.pSignalSemaphores = &batch.m_handoff;
+    if ((res = vkQueueSubmit(m_device.queue(QueueFamilyType::Transfer, 0), 1, &submitinfo, VK_NULL_HANDLE)) != VK_SUCCESS) {
+        spdlog::critical("vkQueueSubmit: {}", res);
+        abort();
+    }
+
+    submitinfo.waitSemaphoreCount = 1;
+    submitinfo.pWaitSemaphores = &batch.m_handoff;
+    submitinfo.pWaitDstStageMask = &wait_stage;
+    submitinfo.pCommandBuffers = &batch.m_acquire_cmd;
+    submitinfo.pSignalSemaphores = &batch.m_done;
+    if ((res = vkQueueSubmit(m_device.queue(QueueFamilyType::Graphics, 0), 1, &submitinfo, batch.m_fence)) != VK_SUCCESS) {
+        spdlog::critical("vkQueueSubmit: {}", res);
+        abort();
+    }
+
+    batch.m_on_complete = std::move(on_complete);
+    batch.m_reclaim = m_head;
+    batch.m_submitted = true;
+    m_release_barriers.clear();
+    m_acquire_barriers.clear();
+    m_in_flight++;
+    m_current = (m_current + 1) % BATCH_COUNT;
+    m_recording = false;
+    return batch.m_done;
+}
+
+void UploadEngine::retire_oldest(bool wait)
+{
+    Batch& batch = m_batches[m_retire];
+    if (batch.m_submitted == false)
+        return;
+
+    VkResult res;
+    if (wait)
+        res = vkWaitForFences(m_device, 1, &batch.m_fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+    else
+        res = vkGetFenceStatus(m_device, batch.m_fence);
+    if (res == VK_NOT_READY)
+        return;
+    if (res != VK_SUCCESS) {
+        spdlog::critical("UploadEngine: waiting on batch fence: {}", res);
+        abort();
+    }
+
+    vkResetFences(m_device, 1, &batch.m_fence);
+    m_tail = batch.m_reclaim;
+    batch.m_submitted = false;
+    m_retire = (m_retire + 1) % BATCH_COUNT;
+    m_in_flight--;
+    if (batch.m_on_complete) {
+        batch.m_on_complete();
+        batch.m_on_complete = nullptr;
+    }
+}
+
+void UploadEngine::poll()
+{
+    size_t in_flight;
+    do {
+        in_flight = m_in_flight;
+        retire_oldest(false);
+    } while (m_in_flight != in_flight);
+}
+
+void UploadEngine::finish()
+{
+    while (m_in_flight > 0)
+        retire_oldest(true);
+}
+
+}
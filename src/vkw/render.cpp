@@ -1,12 +1,26 @@
 #include "spng.h"
 #include "vkw/vkw.h"
+#include "profile.h"
+#include <algorithm>
 #include <queue>
 #include <spdlog/spdlog.h>
 
 namespace vkw {
 
+static constexpr uint64_t SPEC_HASH_INIT = 0xcbf29ce484222325ULL;
+static uint64_t spec_hash_mix(uint64_t hash, const void* data, size_t length)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    while (length-- > 0) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 Fence::Fence(const Device& device, bool signaled)
     : m_device(device)
+    , m_handle(device.frames_in_flight())
 {
     VkResult res;
     VkFenceCreateInfo createinfo {};
@@ -15,7 +29,7 @@ Fence::Fence(const Device& device, bool signaled)
     if (signaled)
         createinfo.flags |= VK_FENCE_CREATE_SIGNALED_BIT;
 
-    for (int i = 0; i < 2; i++) {
+    for (size_t i = 0; i < m_handle.size(); i++) {
         if ((res = vkCreateFence(m_device, &createinfo, nullptr, &m_handle[i])) != VK_SUCCESS) {
             spdlog::critical("vkCreateFence: {}", res);
             abort();
@@ -25,13 +39,13 @@ Fence::Fence(const Device& device, bool signaled)
 
 Fence::~Fence()
 {
-    vkDestroyFence(m_device, m_handle[0], nullptr);
-    vkDestroyFence(m_device, m_handle[1], nullptr);
+    for (VkFence& f : m_handle)
+        vkDestroyFence(m_device, f, nullptr);
 }
 
 bool Fence::wait(uint64_t timeout) const
 {
-    const VkFence& current = m_handle[m_device.current_frame() % 2];
+    const VkFence& current = m_handle[m_device.frame_index()];
     VkResult res = vkWaitForFences(m_device, 1, &current, VK_TRUE, timeout);
     if (res == VK_SUCCESS)
         return true;
@@ -46,7 +60,7 @@ bool Fence::wait(uint64_t timeout) const
 void Fence::reset() const
 {
     VkResult res;
-    const VkFence& current = m_handle[m_device.current_frame() % 2];
+    const VkFence& current = m_handle[m_device.frame_index()];
     if ((res = vkResetFences(m_device, 1, &current)) != VK_SUCCESS) {
         spdlog::critical("vkResetFences: {}", res);
         abort();
@@ -55,12 +69,13 @@ void Fence::reset() const
 
 Semaphore::Semaphore(const Device& device)
     : m_device(device)
+    , m_handle(device.frames_in_flight())
 {
     VkResult res;
     VkSemaphoreCreateInfo createinfo {};
     createinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    for (int i = 0; i < 2; i++) {
+    for (size_t i = 0; i < m_handle.size(); i++) {
         if ((res = vkCreateSemaphore(m_device, &createinfo, nullptr, &m_handle[i])) != VK_SUCCESS) {
             spdlog::critical("vkCreateSemaphore: {}", res);
             abort();
@@ -70,8 +85,34 @@ Semaphore::Semaphore(const Device& device)
 
 Semaphore::~Semaphore()
 {
-    vkDestroySemaphore(m_device, m_handle[0], nullptr);
-    vkDestroySemaphore(m_device, m_handle[1], nullptr);
+    for (VkSemaphore& s : m_handle)
+        vkDestroySemaphore(m_device, s, nullptr);
+}
+
+QueueSubmission& SubmissionChain::add(QueueFamilyType ty, size_t queue_index, VkPipelineStageFlags wait_stage)
+{
+    link& l = m_links.emplace_back(link { ty, queue_index, wait_stage, m_device.submit_commands() });
+    return l.m_submission;
+}
+
+void SubmissionChain::submit()
+{
+    while (m_semaphores.size() + 1 < m_links.size())
+        m_semaphores.emplace_back(m_device);
+
+    for (size_t i = 0; i < m_links.size(); i++) {
+        // the wait goes on the first batch and the signal on the last, so a
+        // multi-batch link stays internally ordered by its own semaphores
+        QueueSubmission& submission = m_links[i].m_submission;
+        if (i > 0) {
+            submission.m_submits.front().m_wait_sem.push_back(m_semaphores[i - 1]);
+            submission.m_submits.front().m_wait_stages.push_back(m_links[i].m_wait_stage);
+        }
+        if (i + 1 < m_links.size())
+            submission.m_submits.back().m_signal_sem.push_back(m_semaphores[i]);
+        submission.to_queue(m_links[i].m_family, m_links[i].m_queue_index);
+    }
+    m_links.clear();
 }
 
 const std::vector<VkDescriptorPoolSize> DescriptorPool::s_pool_size = {
@@ -92,26 +133,185 @@ const std::vector<VkDescriptorPoolSize> DescriptorPool::s_pool_size = {
 
 DescriptorPool::DescriptorPool(const Device& device)
     : m_device(device)
+    , m_observed(s_pool_size)
 {
+    for (VkDescriptorPoolSize& observed : m_observed)
+        observed.descriptorCount = 0;
     append_next_pool();
 }
 
 DescriptorPool::~DescriptorPool()
 {
+    for (cached_template& t : m_templates)
+        vkDestroyDescriptorUpdateTemplate(m_device, t.m_handle, nullptr);
+    if (m_bindless_layout != VK_NULL_HANDLE)
+        vkDestroyDescriptorSetLayout(m_device, m_bindless_layout, nullptr);
+    if (m_bindless_pool != VK_NULL_HANDLE)
+        vkDestroyDescriptorPool(m_device, m_bindless_pool, nullptr);
     for (VkDescriptorPool& pool : m_pools)
         vkDestroyDescriptorPool(m_device, pool, nullptr);
 }
 
+bool DescriptorPool::init_bindless(uint32_t capacity)
+{
+    VkResult res;
+    const VkPhysicalDeviceVulkan12Features& features12 = m_device.features12();
+    if (!features12.runtimeDescriptorArray || !features12.descriptorBindingPartiallyBound
+        || !features12.descriptorBindingSampledImageUpdateAfterBind || !features12.descriptorBindingVariableDescriptorCount) {
+        spdlog::info("DescriptorPool::init_bindless: descriptor indexing is unavailable; falling back to per-material sets");
+        return false;
+    }
+    capacity = std::min(capacity, m_device.limits12().maxDescriptorSetUpdateAfterBindSampledImages);
+
+    VkDescriptorPoolSize pool_size { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, capacity };
+    VkDescriptorPoolCreateInfo pool_createinfo {};
+    pool_createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_createinfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    pool_createinfo.maxSets = 1;
+    pool_createinfo.poolSizeCount = 1;
+    pool_createinfo.pPoolSizes = &pool_size;
+    if ((res = vkCreateDescriptorPool(m_device, &pool_createinfo, nullptr, &m_bindless_pool)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateDescriptorPool: {}", res);
+        abort();
+    }
+
+    VkDescriptorSetLayoutBinding binding {};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    binding.descriptorCount = capacity;
+    binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    VkDescriptorBindingFlags binding_flags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flags_createinfo {};
+    flags_createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    flags_createinfo.bindingCount = 1;
+    flags_createinfo.pBindingFlags = &binding_flags;
+    VkDescriptorSetLayoutCreateInfo layout_createinfo {};
+    layout_createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_createinfo.pNext = &flags_createinfo;
+    layout_createinfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layout_createinfo.bindingCount = 1;
+    layout_createinfo.pBindings = &binding;
+    if ((res = vkCreateDescriptorSetLayout(m_device, &layout_createinfo, nullptr, &m_bindless_layout)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateDescriptorSetLayout: {}", res);
+        abort();
+    }
+
+    VkDescriptorSetVariableDescriptorCountAllocateInfo count_allocinfo {};
+    count_allocinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO;
+    count_allocinfo.descriptorSetCount = 1;
+    count_allocinfo.pDescriptorCounts = &capacity;
+    VkDescriptorSetAllocateInfo allocinfo {};
+    allocinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocinfo.pNext = &count_allocinfo;
+    allocinfo.descriptorPool = m_bindless_pool;
+    allocinfo.descriptorSetCount = 1;
+    allocinfo.pSetLayouts = &m_bindless_layout;
+    if ((res = vkAllocateDescriptorSets(m_device, &allocinfo, &m_bindless_set)) != VK_SUCCESS) {
+        spdlog::critical("vkAllocateDescriptorSets: {}", res);
+        abort();
+    }
+    m_bindless_capacity = capacity;
+    return true;
+}
+
+uint32_t DescriptorPool::bindless_bind(const ImageView<1>& image, VkSampler sampler, VkImageLayout layout)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t slot;
+    if (!m_bindless_free.empty()) {
+        slot = m_bindless_free.back();
+        m_bindless_free.pop_back();
+    } else if (m_bindless_watermark < m_bindless_capacity) {
+        slot = m_bindless_watermark++;
+    } else {
+        spdlog::critical("DescriptorPool::bindless_bind: descriptor array is full ({} slots)", m_bindless_capacity);
+        abort();
+    }
+
+    VkDescriptorImageInfo img {};
+    img.imageView = image;
+    img.imageLayout = layout;
+    img.sampler = sampler;
+    VkWriteDescriptorSet write {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = m_bindless_set;
+    write.dstBinding = 0;
+    write.dstArrayElement = slot;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &img;
+    vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+    return slot;
+}
+
+void DescriptorPool::bindless_release(uint32_t slot)
+{
+    // the slot stays partially bound with its stale contents until reused;
+    // the caller must not index it from a shader after this point
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bindless_free.push_back(slot);
+}
+
+void DescriptorPool::recycle(VkDescriptorSetLayout layout, std::vector<VkDescriptorSet>&& handles)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free_sets[layout].push_back(std::move(handles));
+}
+
+void DescriptorPool::note_descriptor(VkDescriptorType type, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (VkDescriptorPoolSize& observed : m_observed) {
+        if (observed.type == type) {
+            observed.descriptorCount += count;
+            return;
+        }
+    }
+}
+
+VkDescriptorUpdateTemplate DescriptorPool::update_template(VkDescriptorSetLayout layout, const std::vector<VkDescriptorUpdateTemplateEntry>& entries)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t hash = spec_hash_mix(SPEC_HASH_INIT, entries.data(), entries.size() * sizeof(VkDescriptorUpdateTemplateEntry));
+    for (const cached_template& t : m_templates) {
+        if (t.m_layout == layout && t.m_hash == hash)
+            return t.m_handle;
+    }
+
+    VkResult res;
+    VkDescriptorUpdateTemplateCreateInfo createinfo {};
+    createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+    createinfo.descriptorUpdateEntryCount = entries.size();
+    createinfo.pDescriptorUpdateEntries = entries.data();
+    createinfo.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+    createinfo.descriptorSetLayout = layout;
+
+    auto& cached = m_templates.emplace_back();
+    cached.m_layout = layout;
+    cached.m_hash = hash;
+    if ((res = vkCreateDescriptorUpdateTemplate(m_device, &createinfo, nullptr, &cached.m_handle)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateDescriptorUpdateTemplate: {}", res);
+        abort();
+    }
+    return cached.m_handle;
+}
+
 void DescriptorPool::append_next_pool()
 {
     VkResult res;
     m_current = m_pools.emplace(m_pools.end());
 
+    // size from the observed mix: room for twice every descriptor counted so
+    // far, with the static table as the floor
+    std::vector<VkDescriptorPoolSize> sizes = s_pool_size;
+    for (size_t i = 0; i < sizes.size(); i++)
+        sizes[i].descriptorCount = std::max(sizes[i].descriptorCount, 2 * m_observed[i].descriptorCount);
+
     VkDescriptorPoolCreateInfo createinfo {};
     createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    createinfo.maxSets = POOL_SIZE;
-    createinfo.poolSizeCount = s_pool_size.size();
-    createinfo.pPoolSizes = s_pool_size.data();
+    createinfo.maxSets = std::max(POOL_SIZE, 2 * m_sets_allocated);
+    createinfo.poolSizeCount = sizes.size();
+    createinfo.pPoolSizes = sizes.data();
     if ((res = vkCreateDescriptorPool(m_device, &createinfo, nullptr, &*m_current)) != VK_SUCCESS) {
         spdlog::critical("vkCreateDescriptorPool: {}", res);
         abort();
@@ -121,67 +321,137 @@ void DescriptorPool::append_next_pool()
 DescriptorSet DescriptorPool::allocate(VkDescriptorSetLayout layout)
 {
     VkResult res;
-    std::array<VkDescriptorSetLayout, 2> layouts = { layout, layout };
-    std::array<VkDescriptorSet, 2> out;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto free_it = m_free_sets.find(layout);
+    if (free_it != m_free_sets.end() && free_it->second.empty() == false) {
+        std::vector<VkDescriptorSet> out = std::move(free_it->second.back());
+        free_it->second.pop_back();
+        return DescriptorSet(m_device, *this, layout, std::move(out));
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(m_device.frames_in_flight(), layout);
+    std::vector<VkDescriptorSet> out(layouts.size());
     VkDescriptorSetAllocateInfo allocinfo {};
     allocinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocinfo.pSetLayouts = layouts.data();
     allocinfo.descriptorPool = *m_current;
-    allocinfo.descriptorSetCount = 2;
-    if ((res = vkAllocateDescriptorSets(m_device, &allocinfo, out.data())) != VK_SUCCESS) {
+    allocinfo.descriptorSetCount = layouts.size();
+    res = vkAllocateDescriptorSets(m_device, &allocinfo, out.data());
+    if (res == VK_ERROR_OUT_OF_POOL_MEMORY || res == VK_ERROR_FRAGMENTED_POOL) {
+        append_next_pool();
+        allocinfo.descriptorPool = *m_current;
+        res = vkAllocateDescriptorSets(m_device, &allocinfo, out.data());
+    }
+    if (res != VK_SUCCESS) {
         spdlog::critical("vkAllocateDescriptorSets: {}", res);
         abort();
     }
-    return DescriptorSet(m_device, out[0], out[1]);
+    m_sets_allocated += out.size();
+    return DescriptorSet(m_device, *this, layout, std::move(out));
 }
 
 void DescriptorPool::reset()
 {
+    std::lock_guard<std::mutex> lock(m_mutex);
     for (VkDescriptorPool& pool : m_pools) {
         vkResetDescriptorPool(m_device, pool, 0);
     }
     m_current = m_pools.begin();
+    m_free_sets.clear();
+}
+
+DescriptorSet::~DescriptorSet()
+{
+    if (m_handle.empty() == false)
+        m_pool.recycle(m_layout, std::move(m_handle));
+}
+
+DescriptorSet::binding_state& DescriptorSet::binding(uint32_t binding, VkDescriptorType type, bool is_image)
+{
+    auto it = std::lower_bound(m_bindings.begin(), m_bindings.end(), binding, [](const binding_state& b, uint32_t v) { return b.m_binding < v; });
+    if (it == m_bindings.end() || it->m_binding != binding) {
+        it = m_bindings.emplace(it);
+        it->m_binding = binding;
+        m_pool.note_descriptor(type, m_handle.size()); // feeds adaptive pool sizing
+    } else if (it->m_type != type || it->m_is_image != is_image) {
+        // repurposed binding: force a rewrite of every slot, and forget the
+        // old type's contents — each slot must be bound again before writing
+        it->m_dirty.fill(true);
+        it->m_written.fill(false);
+    }
+    it->m_type = type;
+    it->m_is_image = is_image;
+    return *it;
 }
 
 void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<1>& buffer, VkDeviceSize offset, VkDeviceSize range)
 {
-    auto& buf = m_buffers.emplace_back();
+    VkDescriptorBufferInfo buf {};
     buf.buffer = buffer;
     buf.offset = offset;
     buf.range = range;
 
-    for (auto& handle : m_handle) {
-        auto& write = m_writes.emplace_back();
-        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        write.dstSet = handle;
-        write.dstBinding = binding;
-        write.dstArrayElement = 0;
-        write.descriptorCount = 1;
-        write.descriptorType = type;
-        write.pBufferInfo = &buf;
+    binding_state& state = this->binding(binding, type, false);
+    for (size_t slot = 0; slot < m_handle.size(); slot++) {
+        if (memcmp(&state.m_buffers[slot], &buf, sizeof(buf)) != 0) {
+            state.m_buffers[slot] = buf;
+            state.m_dirty[slot] = true;
+        }
+        state.m_written[slot] = true;
     }
 }
 
 void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<2>& buffer, VkDeviceSize offset, VkDeviceSize range)
 {
-    auto& buf = m_buffers.emplace_back();
+    size_t slot = m_device.frame_index();
+    VkDescriptorBufferInfo buf {};
     buf.buffer = buffer[m_device.current_frame() % 2];
     buf.offset = offset;
     buf.range = range;
 
-    auto& write = m_writes.emplace_back();
-    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    write.dstSet = m_handle[m_device.current_frame() % 2];
-    write.dstBinding = binding;
-    write.dstArrayElement = 0;
-    write.descriptorCount = 1;
-    write.descriptorType = type;
-    write.pBufferInfo = &buf;
+    binding_state& state = this->binding(binding, type, false);
+    if (memcmp(&state.m_buffers[slot], &buf, sizeof(buf)) != 0) {
+        state.m_buffers[slot] = buf;
+        state.m_dirty[slot] = true;
+    }
+    state.m_written[slot] = true;
+}
+
+void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const Buffer<3>& buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+    size_t slot = m_device.frame_index();
+    VkDescriptorBufferInfo buf {};
+    buf.buffer = buffer[m_device.current_frame() % 3];
+    buf.offset = offset;
+    buf.range = range;
+
+    binding_state& state = this->binding(binding, type, false);
+    if (memcmp(&state.m_buffers[slot], &buf, sizeof(buf)) != 0) {
+        state.m_buffers[slot] = buf;
+        state.m_dirty[slot] = true;
+    }
+    state.m_written[slot] = true;
+}
+
+void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<1>& arena, const BufferArena<1>::SubRange& range)
+{
+    bind_buffer(binding, type, arena.buffer(), range.m_offset, range.m_size);
+}
+
+void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<2>& arena, const BufferArena<2>::SubRange& range)
+{
+    bind_buffer(binding, type, arena.buffer(), range.m_offset, range.m_size);
+}
+
+void DescriptorSet::bind_buffer(uint32_t binding, VkDescriptorType type, const BufferArena<3>& arena, const BufferArena<3>::SubRange& range)
+{
+    bind_buffer(binding, type, arena.buffer(), range.m_offset, range.m_size);
 }
 
 void DescriptorSet::bind_image(uint32_t binding, VkDescriptorType type, const ImageView<1>& image, VkImageLayout layout, VkSampler sampler)
 {
-    auto& img = m_images.emplace_back();
+    VkDescriptorImageInfo img {};
     img.imageView = image;
     img.imageLayout = layout;
     img.sampler = sampler ? sampler : m_active_sampler;
@@ -192,30 +462,345 @@ void DescriptorSet::bind_image(uint32_t binding, VkDescriptorType type, const Im
     }
 #endif
 
-    for (auto& handle : m_handle) {
-        auto& write = m_writes.emplace_back();
+    binding_state& state = this->binding(binding, type, true);
+    for (size_t slot = 0; slot < m_handle.size(); slot++) {
+        if (memcmp(&state.m_images[slot], &img, sizeof(img)) != 0) {
+            state.m_images[slot] = img;
+            state.m_dirty[slot] = true;
+        }
+        state.m_written[slot] = true;
+    }
+}
+
+void DescriptorSet::update()
+{
+    std::vector<VkWriteDescriptorSet> writes;
+    for (size_t slot = 0; slot < m_handle.size(); slot++) {
+        if (std::none_of(m_bindings.begin(), m_bindings.end(), [&](const binding_state& b) { return b.m_dirty[slot] && b.m_written[slot]; }))
+            continue;
+
+        // The template rewrites every binding this set has seen, which is only
+        // valid once every binding holds real contents for this slot. Until
+        // then (per-frame bindings whose slot has not come around yet), flush
+        // just the populated bindings through individual writes.
+        if (std::all_of(m_bindings.begin(), m_bindings.end(), [&](const binding_state& b) { return b.m_written[slot]; }) == false) {
+            append_writes(slot, writes);
+            continue;
+        }
+
+        // one template entry per binding, packed tightly into one data blob;
+        // the dirty flags only gate whether the slot is touched at all
+        std::vector<VkDescriptorUpdateTemplateEntry> entries(m_bindings.size());
+        size_t blob_size = 0;
+        for (size_t i = 0; i < m_bindings.size(); i++) {
+            entries[i].dstBinding = m_bindings[i].m_binding;
+            entries[i].dstArrayElement = 0;
+            entries[i].descriptorCount = 1;
+            entries[i].descriptorType = m_bindings[i].m_type;
+            entries[i].offset = blob_size;
+            entries[i].stride = 0;
+            blob_size += m_bindings[i].m_is_image ? sizeof(VkDescriptorImageInfo) : sizeof(VkDescriptorBufferInfo);
+        }
+        VkDescriptorUpdateTemplate tmpl = m_pool.update_template(m_layout, entries);
+
+        std::vector<uint8_t> blob(blob_size);
+        for (size_t i = 0; i < m_bindings.size(); i++) {
+            if (m_bindings[i].m_is_image)
+                memcpy(blob.data() + entries[i].offset, &m_bindings[i].m_images[slot], sizeof(VkDescriptorImageInfo));
+            else
+                memcpy(blob.data() + entries[i].offset, &m_bindings[i].m_buffers[slot], sizeof(VkDescriptorBufferInfo));
+            m_bindings[i].m_dirty[slot] = false;
+        }
+        vkUpdateDescriptorSetWithTemplate(m_device, m_handle[slot], tmpl, blob.data());
+    }
+    if (writes.empty() == false)
+        vkUpdateDescriptorSets(m_device, writes.size(), writes.data(), 0, nullptr);
+}
+
+void DescriptorSet::append_writes(size_t slot, std::vector<VkWriteDescriptorSet>& writes)
+{
+    for (binding_state& b : m_bindings) {
+        // a binding can be dirty without contents (a repurposed binding marks
+        // every slot dirty); hold such writes back until the slot is bound
+        if (!b.m_dirty[slot] || !b.m_written[slot])
+            continue;
+        auto& write = writes.emplace_back();
         write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        write.dstSet = handle;
-        write.dstBinding = binding;
+        write.dstSet = m_handle[slot];
+        write.dstBinding = b.m_binding;
         write.dstArrayElement = 0;
         write.descriptorCount = 1;
-        write.descriptorType = type;
-        write.pImageInfo = &img;
+        write.descriptorType = b.m_type;
+        if (b.m_is_image)
+            write.pImageInfo = &b.m_images[slot];
+        else
+            write.pBufferInfo = &b.m_buffers[slot];
+        b.m_dirty[slot] = false;
     }
 }
 
-void DescriptorSet::update()
+void DescriptorSet::update(const std::initializer_list<DescriptorSet*>& sets)
+{
+    if (sets.size() == 0)
+        return;
+
+    std::vector<VkWriteDescriptorSet> writes;
+    for (DescriptorSet* set : sets) {
+        for (size_t slot = 0; slot < set->m_handle.size(); slot++)
+            set->append_writes(slot, writes);
+    }
+    if (!writes.empty())
+        vkUpdateDescriptorSets((*sets.begin())->m_device, writes.size(), writes.data(), 0, nullptr);
+}
+
+// Just enough SPIR-V parsing to recover a module's external interface:
+// descriptor bindings, push constant size, and vertex inputs. Opcode and
+// operand values come from the SPIR-V 1.0 specification.
+namespace spv {
+    enum : uint32_t {
+        OpTypeInt = 21,
+        OpTypeFloat = 22,
+        OpTypeVector = 23,
+        OpTypeMatrix = 24,
+        OpTypeImage = 25,
+        OpTypeSampler = 26,
+        OpTypeSampledImage = 27,
+        OpTypeArray = 28,
+        OpTypeRuntimeArray = 29,
+        OpTypeStruct = 30,
+        OpTypePointer = 32,
+        OpConstant = 43,
+        OpVariable = 59,
+        OpDecorate = 71,
+        OpMemberDecorate = 72,
+
+        DecorationBufferBlock = 3,
+        DecorationArrayStride = 6,
+        DecorationBuiltIn = 11,
+        DecorationLocation = 30,
+        DecorationBinding = 33,
+        DecorationDescriptorSet = 34,
+        DecorationOffset = 35,
+
+        StorageClassUniformConstant = 0,
+        StorageClassInput = 1,
+        StorageClassUniform = 2,
+        StorageClassPushConstant = 9,
+        StorageClassStorageBuffer = 12,
+
+        DimBuffer = 5,
+        DimSubpassData = 6,
+    };
+
+    // per-id record: the defining instruction plus any decorations that
+    // arrived before it (decorations always precede definitions)
+    struct id_info {
+        uint32_t m_opcode = 0;
+        const uint32_t* m_words = nullptr;
+        uint32_t m_set = UINT32_MAX, m_binding = UINT32_MAX, m_location = UINT32_MAX;
+        uint32_t m_array_stride = 0;
+        bool m_builtin = false, m_buffer_block = false;
+        std::vector<uint32_t> m_member_offsets;
+    };
+}
+
+static uint32_t spirv_type_size(const std::vector<spv::id_info>& ids, uint32_t type)
+{
+    const spv::id_info& t = ids[type];
+    switch (t.m_opcode) {
+    case spv::OpTypeInt:
+    case spv::OpTypeFloat:
+        return t.m_words[2] / 8;
+    case spv::OpTypeVector:
+    case spv::OpTypeMatrix:
+        return t.m_words[3] * spirv_type_size(ids, t.m_words[2]);
+    case spv::OpTypeArray: {
+        const spv::id_info& length = ids[t.m_words[3]];
+        uint32_t n = length.m_opcode == spv::OpConstant ? length.m_words[3] : 1;
+        return n * (t.m_array_stride ? t.m_array_stride : spirv_type_size(ids, t.m_words[2]));
+    }
+    case spv::OpTypeStruct: {
+        uint32_t member_count = (t.m_words[0] >> 16) - 2, size = 0;
+        for (uint32_t i = 0; i < member_count; i++) {
+            uint32_t offset = i < t.m_member_offsets.size() ? t.m_member_offsets[i] : size;
+            size = std::max(size, offset + spirv_type_size(ids, t.m_words[2 + i]));
+        }
+        return size;
+    }
+    default:
+        return 0;
+    }
+}
+
+static VkDescriptorType spirv_descriptor_type(const std::vector<spv::id_info>& ids, uint32_t type, uint32_t storage_class)
+{
+    const spv::id_info& t = ids[type];
+    switch (t.m_opcode) {
+    case spv::OpTypeSampledImage:
+        return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    case spv::OpTypeSampler:
+        return VK_DESCRIPTOR_TYPE_SAMPLER;
+    case spv::OpTypeImage: {
+        uint32_t dim = t.m_words[3], sampled = t.m_words[7];
+        if (dim == spv::DimSubpassData)
+            return VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        else if (dim == spv::DimBuffer)
+            return sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+        else
+            return sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    }
+    case spv::OpTypeStruct:
+        if (storage_class == spv::StorageClassStorageBuffer || t.m_buffer_block)
+            return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        else
+            return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    default:
+        spdlog::critical("spirv_descriptor_type: cannot classify resource type (opcode {})", t.m_opcode);
+        abort();
+    }
+}
+
+static VkFormat spirv_vertex_format(const std::vector<spv::id_info>& ids, uint32_t type, uint32_t& size)
 {
-    vkUpdateDescriptorSets(m_device, m_writes.size(), m_writes.data(), 0, nullptr);
-    m_writes.clear();
-    m_buffers.clear();
-    m_images.clear();
+    static const VkFormat sfloat_formats[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+    static const VkFormat sint_formats[] = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT };
+    static const VkFormat uint_formats[] = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT };
+
+    uint32_t components = 1;
+    const spv::id_info* t = &ids[type];
+    if (t->m_opcode == spv::OpTypeVector) {
+        components = t->m_words[3];
+        t = &ids[t->m_words[2]];
+    }
+    size = components * 4;
+    if (t->m_opcode == spv::OpTypeFloat && t->m_words[2] == 32 && components <= 4)
+        return sfloat_formats[components - 1];
+    else if (t->m_opcode == spv::OpTypeInt && t->m_words[2] == 32 && components <= 4)
+        return t->m_words[3] != 0 ? sint_formats[components - 1] : uint_formats[components - 1];
+    else {
+        spdlog::critical("spirv_vertex_format: unsupported vertex input type (opcode {})", t->m_opcode);
+        abort();
+    }
+}
+
+static void reflect_spirv(const uint32_t* words, size_t word_count, VkShaderStageFlagBits stage, ShaderFactory::Reflection& out)
+{
+    if (word_count < 5 || words[0] != 0x07230203) {
+        spdlog::critical("reflect_spirv: not a SPIR-V module");
+        abort();
+    }
+
+    std::vector<spv::id_info> ids(words[3]);
+    for (size_t o = 5; o < word_count;) {
+        uint32_t opcode = words[o] & 0xffff, length = words[o] >> 16;
+        if (length == 0 || o + length > word_count) {
+            spdlog::critical("reflect_spirv: malformed instruction stream");
+            abort();
+        }
+        switch (opcode) {
+        case spv::OpDecorate: {
+            spv::id_info& target = ids[words[o + 1]];
+            switch (words[o + 2]) {
+            case spv::DecorationBufferBlock:
+                target.m_buffer_block = true;
+                break;
+            case spv::DecorationArrayStride:
+                target.m_array_stride = words[o + 3];
+                break;
+            case spv::DecorationBuiltIn:
+                target.m_builtin = true;
+                break;
+            case spv::DecorationLocation:
+                target.m_location = words[o + 3];
+                break;
+            case spv::DecorationBinding:
+                target.m_binding = words[o + 3];
+                break;
+            case spv::DecorationDescriptorSet:
+                target.m_set = words[o + 3];
+                break;
+            }
+            break;
+        }
+        case spv::OpMemberDecorate:
+            if (words[o + 3] == spv::DecorationOffset) {
+                spv::id_info& target = ids[words[o + 1]];
+                uint32_t member = words[o + 2];
+                if (target.m_member_offsets.size() <= member)
+                    target.m_member_offsets.resize(member + 1, 0);
+                target.m_member_offsets[member] = words[o + 4];
+            }
+            break;
+        case spv::OpTypeInt:
+        case spv::OpTypeFloat:
+        case spv::OpTypeVector:
+        case spv::OpTypeMatrix:
+        case spv::OpTypeImage:
+        case spv::OpTypeSampler:
+        case spv::OpTypeSampledImage:
+        case spv::OpTypeArray:
+        case spv::OpTypeRuntimeArray:
+        case spv::OpTypeStruct:
+        case spv::OpTypePointer:
+            ids[words[o + 1]].m_opcode = opcode;
+            ids[words[o + 1]].m_words = words + o;
+            break;
+        case spv::OpConstant:
+        case spv::OpVariable:
+            ids[words[o + 2]].m_opcode = opcode;
+            ids[words[o + 2]].m_words = words + o;
+            break;
+        }
+        o += length;
+    }
+
+    for (const spv::id_info& id : ids) {
+        if (id.m_opcode != spv::OpVariable)
+            continue;
+        uint32_t storage_class = id.m_words[3];
+        uint32_t pointee = ids[id.m_words[1]].m_words[3]; // OpTypePointer's type operand
+
+        if (storage_class == spv::StorageClassInput) {
+            if (stage != VK_SHADER_STAGE_VERTEX_BIT || id.m_builtin || id.m_location == UINT32_MAX)
+                continue;
+            ShaderFactory::ReflectedVertexInput& input = out.m_vertex_inputs.emplace_back();
+            input.m_location = id.m_location;
+            input.m_format = spirv_vertex_format(ids, pointee, input.m_size);
+        } else if (storage_class == spv::StorageClassPushConstant) {
+            out.m_push_constant_size = std::max(out.m_push_constant_size, spirv_type_size(ids, pointee));
+        } else if (storage_class == spv::StorageClassUniformConstant || storage_class == spv::StorageClassUniform || storage_class == spv::StorageClassStorageBuffer) {
+            if (id.m_set == UINT32_MAX || id.m_binding == UINT32_MAX)
+                continue;
+
+            // arrays of resources become one binding with a descriptor count
+            uint32_t count = 1, type = pointee;
+            while (ids[type].m_opcode == spv::OpTypeArray || ids[type].m_opcode == spv::OpTypeRuntimeArray) {
+                if (ids[type].m_opcode == spv::OpTypeArray) {
+                    const spv::id_info& length = ids[ids[type].m_words[3]];
+                    if (length.m_opcode == spv::OpConstant)
+                        count *= length.m_words[3];
+                }
+                type = ids[type].m_words[2];
+            }
+
+            ShaderFactory::ReflectedBinding& binding = out.m_bindings.emplace_back();
+            binding.m_set = id.m_set;
+            binding.m_binding = id.m_binding;
+            binding.m_count = count;
+            binding.m_type = spirv_descriptor_type(ids, type, storage_class);
+        }
+    }
+    std::sort(out.m_vertex_inputs.begin(), out.m_vertex_inputs.end(), [](const ShaderFactory::ReflectedVertexInput& a, const ShaderFactory::ReflectedVertexInput& b) {
+        return a.m_location < b.m_location;
+    });
 }
 
 ShaderFactory::~ShaderFactory()
 {
     for (module& sh : m_shaders)
         vkDestroyShaderModule(m_device, sh.m_createinfo.module, nullptr);
+    for (cached_set_layout& layout : m_set_layouts)
+        vkDestroyDescriptorSetLayout(m_device, layout.m_handle, nullptr);
 }
 
 Shader ShaderFactory::open(const fs::file& path, VkShaderStageFlagBits stage)
@@ -228,6 +813,7 @@ Shader ShaderFactory::open(const fs::file& path, VkShaderStageFlagBits stage)
 
         Shader ret = m_shaders.size();
         m_shaders.emplace_back(m_device, slurped.data(), slurped.size(), stage, nullptr);
+        reflect_spirv(reinterpret_cast<const uint32_t*>(slurped.data()), slurped.size() / 4, stage, m_reflections.emplace_back());
         m_cache[path.path()] = ret;
         return ret;
     } else {
@@ -246,11 +832,13 @@ Shader ShaderFactory::open(const fs::file& path, VkShaderStageFlagBits stage, co
 
         Shader ret = m_shaders.size();
         m_shaders.emplace_back(m_device, slurped.data(), slurped.size(), stage, &spec_data.info);
+        reflect_spirv(reinterpret_cast<const uint32_t*>(slurped.data()), slurped.size() / 4, stage, m_reflections.emplace_back());
         m_cache[path.path()] = ret;
         return ret;
     } else {
         auto& specialized_shader = m_shaders.emplace_back(m_shaders[it->second]);
         specialized_shader.m_createinfo.pSpecializationInfo = &spec_data.info;
+        m_reflections.push_back(m_reflections[it->second]);
         return m_shaders.size() - 1;
     }
 }
@@ -541,13 +1129,26 @@ PipelineLayout::PipelineLayout(const Device& device, VkPipelineLayout layout, st
     , m_layout(layout)
     , m_descriptor_set_layouts(std::move(descriptor_set_layouts))
 {
+    m_owns_set_layouts.fill(true);
+}
+
+PipelineLayout::PipelineLayout(PipelineLayout&& other)
+    : m_device(other.m_device)
+    , m_layout(other.m_layout)
+    , m_descriptor_set_layouts(other.m_descriptor_set_layouts)
+    , m_owns_set_layouts(other.m_owns_set_layouts)
+{
+    other.m_layout = VK_NULL_HANDLE;
+    other.m_descriptor_set_layouts.fill(VK_NULL_HANDLE);
 }
 
 PipelineLayout::~PipelineLayout()
 {
     vkDestroyPipelineLayout(m_device, m_layout, nullptr);
-    for (size_t i = 0; i < DESCRIPTOR_SET_COUNT; i++)
-        vkDestroyDescriptorSetLayout(m_device, m_descriptor_set_layouts[i], nullptr);
+    for (size_t i = 0; i < DESCRIPTOR_SET_COUNT; i++) {
+        if (m_owns_set_layouts[i])
+            vkDestroyDescriptorSetLayout(m_device, m_descriptor_set_layouts[i], nullptr);
+    }
 }
 
 PipelineLayout::Builder& PipelineLayout::Builder::with_descriptor_binding(uint32_t set, uint32_t binding, VkDescriptorType type, uint32_t count, VkShaderStageFlags stage, std::initializer_list<VkSampler> immutable_samplers)
@@ -566,6 +1167,18 @@ PipelineLayout::Builder& PipelineLayout::Builder::with_descriptor_binding(uint32
     return *this;
 }
 
+PipelineLayout::Builder& PipelineLayout::Builder::with_external_set_layout(uint32_t set, VkDescriptorSetLayout layout)
+{
+#ifndef NDEBUG
+    if (!m_bindings[set].empty()) {
+        spdlog::critical("PipelineLayout::Builder::with_external_set_layout: set {} already has explicit bindings", set);
+        abort();
+    }
+#endif
+    m_external_layouts[set] = layout;
+    return *this;
+}
+
 PipelineLayout::Builder& PipelineLayout::Builder::with_push_constant_range(uint32_t offset, uint32_t size, VkShaderStageFlags stage)
 {
     VkPushConstantRange& r = m_push_constants.emplace_back();
@@ -582,6 +1195,10 @@ PipelineLayout PipelineLayout::Builder::build(const Device& device)
     VkResult res;
 
     for (size_t i = 0; i < DESCRIPTOR_SET_COUNT; i++) {
+        if (m_external_layouts[i] != VK_NULL_HANDLE) {
+            dsl[i] = m_external_layouts[i];
+            continue;
+        }
         VkDescriptorSetLayoutCreateInfo ds_layout_createinfo {};
         ds_layout_createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         ds_layout_createinfo.pNext = nullptr;
@@ -605,7 +1222,106 @@ PipelineLayout PipelineLayout::Builder::build(const Device& device)
         abort();
     }
 
-    return PipelineLayout(device, out, std::move(dsl));
+    PipelineLayout built(device, out, std::move(dsl));
+    for (size_t i = 0; i < DESCRIPTOR_SET_COUNT; i++)
+        built.m_owns_set_layouts[i] = m_external_layouts[i] == VK_NULL_HANDLE;
+    return built;
+}
+
+const PipelineLayout& ShaderFactory::reflect_pipeline_layout(const Device& device, const std::vector<Shader>& stages)
+{
+    VkResult res;
+    std::array<std::vector<VkDescriptorSetLayoutBinding>, DESCRIPTOR_SET_COUNT> merged;
+    std::vector<VkPushConstantRange> push_constants;
+
+    for (Shader s : stages) {
+        const Reflection& reflection = m_reflections.at(s);
+        VkShaderStageFlags stage = m_shaders.at(s).m_createinfo.stage;
+        for (const ReflectedBinding& b : reflection.m_bindings) {
+            if (b.m_set >= DESCRIPTOR_SET_COUNT) {
+                spdlog::critical("ShaderFactory::reflect_pipeline_layout: descriptor set {} is out of range", b.m_set);
+                abort();
+            }
+            std::vector<VkDescriptorSetLayoutBinding>& set = merged[b.m_set];
+            auto it = std::find_if(set.begin(), set.end(), [&](const VkDescriptorSetLayoutBinding& existing) { return existing.binding == b.m_binding; });
+            if (it != set.end()) {
+                if (it->descriptorType != b.m_type) {
+                    spdlog::critical("ShaderFactory::reflect_pipeline_layout: set {} binding {} has conflicting types across stages", b.m_set, b.m_binding);
+                    abort();
+                }
+                it->stageFlags |= stage;
+                it->descriptorCount = std::max(it->descriptorCount, b.m_count);
+            } else {
+                VkDescriptorSetLayoutBinding& info = set.emplace_back();
+                info.binding = b.m_binding;
+                info.descriptorType = b.m_type;
+                info.descriptorCount = b.m_count;
+                info.stageFlags = stage;
+                info.pImmutableSamplers = nullptr;
+            }
+        }
+        if (reflection.m_push_constant_size > 0) {
+            VkPushConstantRange& r = push_constants.emplace_back();
+            r.offset = 0;
+            r.size = reflection.m_push_constant_size;
+            r.stageFlags = stage;
+        }
+    }
+
+    std::array<VkDescriptorSetLayout, DESCRIPTOR_SET_COUNT> dsl;
+    for (size_t i = 0; i < DESCRIPTOR_SET_COUNT; i++) {
+        std::vector<VkDescriptorSetLayoutBinding>& bindings = merged[i];
+        std::sort(bindings.begin(), bindings.end(), [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) { return a.binding < b.binding; });
+        uint64_t set_hash = spec_hash_mix(SPEC_HASH_INIT, bindings.data(), bindings.size() * sizeof(VkDescriptorSetLayoutBinding));
+
+        dsl[i] = VK_NULL_HANDLE;
+        for (const cached_set_layout& cached : m_set_layouts) {
+            if (cached.m_hash == set_hash && cached.m_bindings.size() == bindings.size()
+                && memcmp(cached.m_bindings.data(), bindings.data(), bindings.size() * sizeof(VkDescriptorSetLayoutBinding)) == 0) {
+                dsl[i] = cached.m_handle;
+                break;
+            }
+        }
+        if (dsl[i] == VK_NULL_HANDLE) {
+            VkDescriptorSetLayoutCreateInfo ds_layout_createinfo {};
+            ds_layout_createinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+            ds_layout_createinfo.bindingCount = bindings.size();
+            ds_layout_createinfo.pBindings = bindings.data();
+            if ((res = vkCreateDescriptorSetLayout(m_device, &ds_layout_createinfo, nullptr, &dsl[i])) != VK_SUCCESS) {
+                spdlog::critical("vkCreateDescriptorSetLayout: {}", res);
+                abort();
+            }
+            auto& cached = m_set_layouts.emplace_back();
+            cached.m_hash = set_hash;
+            cached.m_bindings = bindings;
+            cached.m_handle = dsl[i];
+        }
+    }
+
+    uint64_t layout_hash = spec_hash_mix(SPEC_HASH_INIT, dsl.data(), sizeof(dsl));
+    layout_hash = spec_hash_mix(layout_hash, push_constants.data(), push_constants.size() * sizeof(VkPushConstantRange));
+    for (const cached_pipeline_layout& cached : m_pipeline_layouts) {
+        if (cached.m_hash == layout_hash && std::equal(dsl.begin(), dsl.end(), cached.m_layout->m_descriptor_set_layouts.begin()))
+            return *cached.m_layout;
+    }
+
+    VkPipelineLayoutCreateInfo layout_createinfo {};
+    layout_createinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_createinfo.setLayoutCount = DESCRIPTOR_SET_COUNT;
+    layout_createinfo.pSetLayouts = dsl.data();
+    layout_createinfo.pushConstantRangeCount = push_constants.size();
+    layout_createinfo.pPushConstantRanges = push_constants.data();
+    VkPipelineLayout out;
+    if ((res = vkCreatePipelineLayout(m_device, &layout_createinfo, nullptr, &out)) != VK_SUCCESS) {
+        spdlog::critical("vkCreatePipelineLayout: {}", res);
+        abort();
+    }
+
+    auto& cached = m_pipeline_layouts.emplace_back();
+    cached.m_hash = layout_hash;
+    cached.m_layout.reset(new PipelineLayout(device, out, std::move(dsl)));
+    cached.m_layout->m_owns_set_layouts.fill(false);
+    return *cached.m_layout;
 }
 
 Pipeline::~Pipeline()
@@ -635,8 +1351,13 @@ PipelineFactory::PipelineFactory(const Device& device, const ShaderFactory& shad
     : m_device(device)
     , m_shaders(shaders)
     , m_persistent_cache(VK_NULL_HANDLE)
-    , m_bucket_count(bucket_count)
 {
+    size_t capacity = 16;
+    while (capacity < bucket_count)
+        capacity <<= 1;
+    m_compute_index.resize(capacity);
+    m_graphics_index.resize(capacity);
+
     fs::file cache_file(s_cache_path);
     std::vector<char> cache_data;
     if (cache_file.exists()) {
@@ -658,6 +1379,18 @@ PipelineFactory::PipelineFactory(const Device& device, const ShaderFactory& shad
 
 PipelineFactory::~PipelineFactory()
 {
+    for (AsyncBatch& batch : m_async_batches) {
+        for (std::thread& t : batch.m_threads)
+            t.join();
+        for (VkPipelineCache cache : batch.m_caches)
+            vkDestroyPipelineCache(m_device, cache, nullptr);
+        if (batch.m_integrated == false) {
+            for (VkPipeline pipeline : batch.m_results) {
+                if (pipeline != VK_NULL_HANDLE)
+                    vkDestroyPipeline(m_device, pipeline, nullptr);
+            }
+        }
+    }
     m_compute.clear();
     m_graphics.clear();
     vkDestroyPipelineCache(m_device, m_persistent_cache, nullptr);
@@ -682,22 +1415,50 @@ void PipelineFactory::write_cache() const
     cw.write(cache_data.data(), cache_size);
 }
 
-size_t PipelineFactory::spec_bucket(const std::vector<Shader>& shaders)
+template <typename Specification>
+size_t PipelineFactory::index_find(const std::vector<IndexSlot>& slots, const std::vector<Specification>& specs, const Specification& spec) const
 {
-    size_t h = 0;
-    for (const Shader& s : shaders) {
-        h = (h << 1) ^ s;
+    size_t mask = slots.size() - 1;
+    for (size_t probe = spec.content_hash() & mask;; probe = (probe + 1) & mask) {
+        const IndexSlot& slot = slots[probe];
+        if (slot.m_index == SIZE_MAX)
+            return SIZE_MAX;
+        if (slot.m_hash == spec.content_hash() && specs[slot.m_index] == spec)
+            return slot.m_index;
     }
-    return h % m_bucket_count;
 }
 
-Pipeline& PipelineFactory::get(const ComputePipelineSpecification& in_spec)
+void PipelineFactory::index_insert(std::vector<IndexSlot>& slots, uint64_t hash, size_t index)
 {
-    for (size_t i = 0; i < m_compute.size(); i++) {
-        if (m_compute_specs[i] == in_spec)
-            return m_compute[i];
+    if ((index + 1) * 4 >= slots.size() * 3) {
+        std::vector<IndexSlot> grown(slots.size() * 2);
+        size_t grown_mask = grown.size() - 1;
+        for (const IndexSlot& slot : slots) {
+            if (slot.m_index == SIZE_MAX)
+                continue;
+            size_t probe = slot.m_hash & grown_mask;
+            while (grown[probe].m_index != SIZE_MAX)
+                probe = (probe + 1) & grown_mask;
+            grown[probe] = slot;
+        }
+        slots.swap(grown);
     }
 
+    size_t mask = slots.size() - 1;
+    size_t probe = hash & mask;
+    while (slots[probe].m_index != SIZE_MAX)
+        probe = (probe + 1) & mask;
+    slots[probe].m_hash = hash;
+    slots[probe].m_index = index;
+}
+
+Pipeline& PipelineFactory::get(const ComputePipelineSpecification& in_spec)
+{
+    PROF_ZONE("PipelineFactory::get");
+    size_t found = index_find(m_compute_index, m_compute_specs, in_spec);
+    if (found != SIZE_MAX)
+        return m_compute[found];
+
     VkResult res;
     VkPipeline out = VK_NULL_HANDLE;
     VkComputePipelineCreateInfo createinfo {};
@@ -710,59 +1471,178 @@ Pipeline& PipelineFactory::get(const ComputePipelineSpecification& in_spec)
         abort();
     }
 
+    index_insert(m_compute_index, in_spec.content_hash(), m_compute.size());
     m_compute_specs.push_back(in_spec);
     return m_compute.emplace_back(m_device, VK_PIPELINE_BIND_POINT_COMPUTE, out, in_spec.m_layout);
 }
 
 Pipeline& PipelineFactory::get(const GraphicsPipelineSpecification& in_spec)
 {
-    for (size_t i = 0; i < m_graphics.size(); i++) {
-        if (m_graphics_specs[i] == in_spec)
-            return m_graphics[i];
-    }
+    PROF_ZONE("PipelineFactory::get");
+    size_t found = index_find(m_graphics_index, m_graphics_specs, in_spec);
+    if (found != SIZE_MAX)
+        return m_graphics[found];
 
+    VkResult res;
+    VkPipeline out = VK_NULL_HANDLE;
+    VkGraphicsPipelineCreateInfo createinfo;
+    VkPipelineVertexInputStateCreateInfo vertex_input_state;
+    VkPipelineColorBlendStateCreateInfo color_blend_state;
     std::vector<VkPipelineShaderStageCreateInfo> shader_stages;
-    for (const auto& s : in_spec.m_shaders) {
+    bake_graphics_createinfo(in_spec, createinfo, vertex_input_state, color_blend_state, shader_stages);
+    if ((res = vkCreateGraphicsPipelines(m_device, m_persistent_cache, 1, &createinfo, nullptr, &out)) != VK_SUCCESS) {
+        spdlog::critical("vkCreateGraphicsPipelines: {}", res);
+        abort();
+    }
+
+    index_insert(m_graphics_index, in_spec.content_hash(), m_graphics.size());
+    m_graphics_specs.push_back(in_spec);
+    return m_graphics.emplace_back(m_device, VK_PIPELINE_BIND_POINT_GRAPHICS, out, in_spec.m_layout);
+}
+
+void PipelineFactory::bake_graphics_createinfo(const GraphicsPipelineSpecification& spec, VkGraphicsPipelineCreateInfo& createinfo,
+    VkPipelineVertexInputStateCreateInfo& vertex_input_state, VkPipelineColorBlendStateCreateInfo& color_blend_state,
+    std::vector<VkPipelineShaderStageCreateInfo>& shader_stages) const
+{
+    shader_stages.clear();
+    shader_stages.reserve(spec.m_shaders.size());
+    for (const auto& s : spec.m_shaders) {
         auto& shader = m_shaders.get(s);
         shader_stages.push_back(shader.stage());
     }
 
-    VkPipelineVertexInputStateCreateInfo vertex_input_state {};
+    memset(&vertex_input_state, 0, sizeof(VkPipelineVertexInputStateCreateInfo));
     vertex_input_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_state.vertexBindingDescriptionCount = in_spec.m_vertex_input_bindings.size();
-    vertex_input_state.pVertexBindingDescriptions = in_spec.m_vertex_input_bindings.data();
-    vertex_input_state.vertexAttributeDescriptionCount = in_spec.m_vertex_input_attributes.size();
-    vertex_input_state.pVertexAttributeDescriptions = in_spec.m_vertex_input_attributes.data();
-    VkPipelineColorBlendStateCreateInfo color_blend_state;
-    memcpy(&color_blend_state, &in_spec.m_pod.color_blend_state, sizeof(VkPipelineColorBlendStateCreateInfo));
-    color_blend_state.attachmentCount = in_spec.m_color_blend_attachments.size();
-    color_blend_state.pAttachments = in_spec.m_color_blend_attachments.data();
-
-    VkResult res;
-    VkPipeline out = VK_NULL_HANDLE;
-    VkGraphicsPipelineCreateInfo createinfo {};
+    vertex_input_state.vertexBindingDescriptionCount = spec.m_vertex_input_bindings.size();
+    vertex_input_state.pVertexBindingDescriptions = spec.m_vertex_input_bindings.data();
+    vertex_input_state.vertexAttributeDescriptionCount = spec.m_vertex_input_attributes.size();
+    vertex_input_state.pVertexAttributeDescriptions = spec.m_vertex_input_attributes.data();
+    memcpy(&color_blend_state, &spec.m_pod.color_blend_state, sizeof(VkPipelineColorBlendStateCreateInfo));
+    color_blend_state.attachmentCount = spec.m_color_blend_attachments.size();
+    color_blend_state.pAttachments = spec.m_color_blend_attachments.data();
+
+    memset(&createinfo, 0, sizeof(VkGraphicsPipelineCreateInfo));
     createinfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     createinfo.stageCount = shader_stages.size();
     createinfo.pStages = shader_stages.data();
     createinfo.pVertexInputState = &vertex_input_state;
-    createinfo.pInputAssemblyState = &in_spec.m_pod.input_assembly_state;
-    createinfo.pTessellationState = &in_spec.m_pod.tessellation_state;
+    createinfo.pInputAssemblyState = &spec.m_pod.input_assembly_state;
+    createinfo.pTessellationState = &spec.m_pod.tessellation_state;
     createinfo.pViewportState = &s_viewport_state;
-    createinfo.pRasterizationState = &in_spec.m_pod.rasterization_state;
-    createinfo.pMultisampleState = &in_spec.m_pod.multisample_state;
-    createinfo.pDepthStencilState = &in_spec.m_pod.depth_stencil_state;
+    createinfo.pRasterizationState = &spec.m_pod.rasterization_state;
+    createinfo.pMultisampleState = &spec.m_pod.multisample_state;
+    createinfo.pDepthStencilState = &spec.m_pod.depth_stencil_state;
     createinfo.pColorBlendState = &color_blend_state;
     createinfo.pDynamicState = &s_graphics_dynamic_state;
-    createinfo.layout = in_spec.m_layout;
-    createinfo.renderPass = in_spec.m_pod.render_pass;
-    createinfo.subpass = in_spec.m_pod.subpass_index;
-    if ((res = vkCreateGraphicsPipelines(m_device, m_persistent_cache, 1, &createinfo, nullptr, &out)) != VK_SUCCESS) {
+    createinfo.layout = spec.m_layout;
+    createinfo.renderPass = spec.m_pod.render_pass;
+    createinfo.subpass = spec.m_pod.subpass_index;
+}
+
+void PipelineFactory::compile_batch_slice(AsyncBatch& batch, size_t begin, size_t end, size_t cache_index)
+{
+    VkResult res;
+    VkPipelineCacheCreateInfo cache_createinfo {};
+    cache_createinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if ((res = vkCreatePipelineCache(m_device, &cache_createinfo, nullptr, &batch.m_caches[cache_index])) != VK_SUCCESS) {
+        spdlog::critical("vkCreatePipelineCache: {}", res);
+        abort();
+    }
+
+    size_t count = end - begin;
+    std::vector<VkGraphicsPipelineCreateInfo> createinfos(count);
+    std::vector<VkPipelineVertexInputStateCreateInfo> vertex_input_states(count);
+    std::vector<VkPipelineColorBlendStateCreateInfo> color_blend_states(count);
+    std::vector<std::vector<VkPipelineShaderStageCreateInfo>> shader_stages(count);
+    for (size_t i = 0; i < count; i++)
+        bake_graphics_createinfo(batch.m_specs[begin + i], createinfos[i], vertex_input_states[i], color_blend_states[i], shader_stages[i]);
+
+    if ((res = vkCreateGraphicsPipelines(m_device, batch.m_caches[cache_index], count, createinfos.data(), nullptr, batch.m_results.data() + begin)) != VK_SUCCESS) {
         spdlog::critical("vkCreateGraphicsPipelines: {}", res);
         abort();
     }
+    batch.m_remaining--;
+}
 
-    m_graphics_specs.push_back(in_spec);
-    return m_graphics.emplace_back(m_device, VK_PIPELINE_BIND_POINT_GRAPHICS, out, in_spec.m_layout);
+std::vector<PipelineFactory::FuturePipeline> PipelineFactory::compile_async(std::vector<GraphicsPipelineSpecification>&& specs, size_t worker_count)
+{
+    if (specs.empty())
+        return {};
+    if (worker_count == 0)
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+
+    AsyncBatch& batch = m_async_batches.emplace_back();
+    batch.m_specs = std::move(specs);
+    batch.m_results.resize(batch.m_specs.size(), VK_NULL_HANDLE);
+    worker_count = std::min(worker_count, batch.m_specs.size());
+    batch.m_caches.resize(worker_count, VK_NULL_HANDLE);
+    batch.m_remaining = worker_count;
+    batch.m_threads.reserve(worker_count);
+
+    size_t per_thread = (batch.m_specs.size() + worker_count - 1) / worker_count;
+    for (size_t t = 0; t < worker_count; t++) {
+        size_t begin = t * per_thread, end = std::min(begin + per_thread, batch.m_specs.size());
+        batch.m_threads.emplace_back(&PipelineFactory::compile_batch_slice, this, std::ref(batch), begin, end, t);
+    }
+
+    std::vector<FuturePipeline> handles;
+    handles.reserve(batch.m_specs.size());
+    for (size_t i = 0; i < batch.m_specs.size(); i++)
+        handles.push_back(FuturePipeline(this, &batch, i));
+    return handles;
+}
+
+bool PipelineFactory::poll_async()
+{
+    VkResult res;
+    bool outstanding = false;
+    for (AsyncBatch& batch : m_async_batches) {
+        if (batch.m_integrated)
+            continue;
+        if (batch.m_remaining.load() != 0) {
+            outstanding = true;
+            continue;
+        }
+
+        for (std::thread& t : batch.m_threads)
+            t.join();
+        batch.m_threads.clear();
+
+        if ((res = vkMergePipelineCaches(m_device, m_persistent_cache, batch.m_caches.size(), batch.m_caches.data())) != VK_SUCCESS) {
+            spdlog::critical("vkMergePipelineCaches: {}", res);
+            abort();
+        }
+        for (VkPipelineCache cache : batch.m_caches)
+            vkDestroyPipelineCache(m_device, cache, nullptr);
+        batch.m_caches.clear();
+
+        batch.m_final_indexes.resize(batch.m_specs.size());
+        for (size_t i = 0; i < batch.m_specs.size(); i++) {
+            size_t existing = index_find(m_graphics_index, m_graphics_specs, batch.m_specs[i]);
+            if (existing != SIZE_MAX) {
+                // a synchronous get or an earlier batch won the race; keep the first copy
+                vkDestroyPipeline(m_device, batch.m_results[i], nullptr);
+                batch.m_final_indexes[i] = existing;
+            } else {
+                VkPipelineLayout layout = batch.m_specs[i].m_layout;
+                batch.m_final_indexes[i] = m_graphics.size();
+                index_insert(m_graphics_index, batch.m_specs[i].content_hash(), m_graphics.size());
+                m_graphics_specs.push_back(std::move(batch.m_specs[i]));
+                m_graphics.emplace_back(m_device, VK_PIPELINE_BIND_POINT_GRAPHICS, batch.m_results[i], layout);
+            }
+        }
+        batch.m_specs.clear();
+        batch.m_results.clear();
+        batch.m_integrated = true;
+    }
+    return outstanding;
+}
+
+Pipeline& PipelineFactory::FuturePipeline::get(Pipeline& fallback) const
+{
+    if (ready() == false)
+        return fallback;
+    return m_factory->m_graphics[m_batch->m_final_indexes[m_index]];
 }
 
 bool PipelineFactory::ComputePipelineSpecification::operator==(const ComputePipelineSpecification& other) const
@@ -770,6 +1650,14 @@ bool PipelineFactory::ComputePipelineSpecification::operator==(const ComputePipe
     return m_shaders == other.m_shaders && m_layout == other.m_layout;
 }
 
+void PipelineFactory::ComputePipelineSpecification::rehash()
+{
+    uint64_t h = SPEC_HASH_INIT;
+    h = spec_hash_mix(h, m_shaders.data(), m_shaders.size() * sizeof(Shader));
+    h = spec_hash_mix(h, &m_layout, sizeof(m_layout));
+    m_hash = h;
+}
+
 PipelineFactory::GraphicsPipelineSpecification::GraphicsPipelineSpecification(std::vector<Shader>&& shaders, VkPipelineLayout layout)
     : m_shaders(shaders)
     , m_layout(layout)
@@ -783,6 +1671,23 @@ PipelineFactory::GraphicsPipelineSpecification::GraphicsPipelineSpecification(st
     m_pod.multisample_state.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
     m_pod.depth_stencil_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
     m_pod.color_blend_state.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    rehash();
+}
+PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::rehash()
+{
+    // m_pod is memset at construction, so its padding hashes deterministically
+    // (operator== already memcmp's it under the same assumption)
+    uint64_t h = SPEC_HASH_INIT;
+    h = spec_hash_mix(h, m_shaders.data(), m_shaders.size() * sizeof(Shader));
+    h = spec_hash_mix(h, &m_layout, sizeof(m_layout));
+    h = spec_hash_mix(h, &m_pod, sizeof(m_pod));
+    h = spec_hash_mix(h, m_vertex_input_attributes.data(), m_vertex_input_attributes.size() * sizeof(VkVertexInputAttributeDescription));
+    h = spec_hash_mix(h, m_vertex_input_bindings.data(), m_vertex_input_bindings.size() * sizeof(VkVertexInputBindingDescription));
+    h = spec_hash_mix(h, m_color_blend_attachments.data(), m_color_blend_attachments.size() * sizeof(VkPipelineColorBlendAttachmentState));
+    size_t counts[] = { m_shaders.size(), m_vertex_input_attributes.size(), m_vertex_input_bindings.size(), m_color_blend_attachments.size() };
+    h = spec_hash_mix(h, counts, sizeof(counts));
+    m_hash = h;
+    return *this;
 }
 bool PipelineFactory::GraphicsPipelineSpecification::operator==(const GraphicsPipelineSpecification& other) const
 {
@@ -813,7 +1718,7 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     attr.binding = binding;
     attr.format = format;
     attr.offset = offset;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_vertex_input_binding(uint32_t binding, size_t stride, bool by_instance)
 {
@@ -821,43 +1726,51 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     s.binding = binding;
     s.stride = stride;
     s.inputRate = by_instance ? VK_VERTEX_INPUT_RATE_INSTANCE : VK_VERTEX_INPUT_RATE_VERTEX;
+    return rehash();
+}
+PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_vertex_inputs_from(const ShaderFactory& factory, Shader vertex_shader)
+{
+    for (const ShaderFactory::ReflectedVertexInput& input : factory.reflection(vertex_shader).m_vertex_inputs) {
+        set_vertex_input_binding(input.m_location, input.m_size);
+        set_vertex_input_attribute(input.m_location, input.m_location, input.m_format, 0);
+    }
     return *this;
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_primitive_topology(VkPrimitiveTopology topology, bool enable_restart)
 {
     m_pod.input_assembly_state.topology = topology;
     m_pod.input_assembly_state.primitiveRestartEnable = enable_restart;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_tessellation_patch_control_points(uint32_t n_points)
 {
     m_pod.tessellation_state.patchControlPoints = n_points;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_depth_clamp(bool enable)
 {
     m_pod.rasterization_state.depthClampEnable = enable;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_rasterizer_discard(bool enable)
 {
     m_pod.rasterization_state.rasterizerDiscardEnable = enable;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_polygon_mode(VkPolygonMode polygon_mode)
 {
     m_pod.rasterization_state.polygonMode = polygon_mode;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_cull_mode(VkCullModeFlagBits cull_mode)
 {
     m_pod.rasterization_state.cullMode = cull_mode;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_front_face(VkFrontFace front_face)
 {
     m_pod.rasterization_state.frontFace = front_face;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_depth_bias(bool enable, float constant_factor, float clamp, float slope_factor)
 {
@@ -865,12 +1778,12 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     m_pod.rasterization_state.depthBiasConstantFactor = constant_factor;
     m_pod.rasterization_state.depthBiasClamp = clamp;
     m_pod.rasterization_state.depthBiasSlopeFactor = slope_factor;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_multisample_samples(int samples)
 {
     m_pod.multisample_state.rasterizationSamples = static_cast<VkSampleCountFlagBits>(samples);
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_sample_shading(bool enable, float min_fraction)
 {
@@ -880,18 +1793,18 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     } else {
         m_pod.multisample_state.sampleShadingEnable = false;
     }
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_depth_test(bool enable, VkCompareOp compare_op)
 {
     m_pod.depth_stencil_state.depthTestEnable = enable;
     m_pod.depth_stencil_state.depthCompareOp = compare_op;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_depth_write(bool enable)
 {
     m_pod.depth_stencil_state.depthWriteEnable = enable;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_depth_bounds_test(bool enable, float min, float max)
 {
@@ -899,12 +1812,12 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     m_pod.depth_stencil_state.depthBoundsTestEnable = enable;
     m_pod.depth_stencil_state.minDepthBounds = min;
     m_pod.depth_stencil_state.maxDepthBounds = max;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_stencil_test(bool enable)
 {
     m_pod.depth_stencil_state.stencilTestEnable = enable;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_stencil_test_parameters(bool front_face, VkCompareOp compare_op,
     VkStencilOp pass_op, VkStencilOp fail_op, VkStencilOp depth_fail_op, uint32_t compare_mask, uint32_t write_mask, uint32_t ref_value)
@@ -917,7 +1830,7 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     params.compareMask = compare_mask;
     params.writeMask = write_mask;
     params.reference = ref_value;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_attachment_color_blend_info(size_t index, bool enabled,
     VkBlendOp blend_op, VkBlendFactor src_factor, VkBlendFactor dst_factor, VkColorComponentFlags color_write_mask)
@@ -934,7 +1847,7 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
         att.colorWriteMask = color_write_mask | VK_COLOR_COMPONENT_A_BIT;
     else
         att.colorWriteMask = color_write_mask;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_attachment_alpha_blend_info(size_t index, VkBlendOp blend_op,
     VkBlendFactor src_factor, VkBlendFactor dst_factor, bool write_alpha)
@@ -950,7 +1863,7 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
         att.colorWriteMask |= VK_COLOR_COMPONENT_A_BIT;
     else
         att.colorWriteMask &= (~VK_COLOR_COMPONENT_A_BIT);
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_color_blend_constants(float r, float g, float b, float a)
 {
@@ -958,13 +1871,13 @@ PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelin
     m_pod.color_blend_state.blendConstants[1] = g;
     m_pod.color_blend_state.blendConstants[2] = b;
     m_pod.color_blend_state.blendConstants[3] = a;
-    return *this;
+    return rehash();
 }
 PipelineFactory::GraphicsPipelineSpecification& PipelineFactory::GraphicsPipelineSpecification::set_render_pass(VkRenderPass render_pass, uint32_t subpass_index)
 {
     m_pod.render_pass = render_pass;
     m_pod.subpass_index = subpass_index;
-    return *this;
+    return rehash();
 }
 
 Sampler::Builder::Builder()
@@ -1038,14 +1951,15 @@ Sampler::~Sampler()
     vkDestroySampler(m_device, m_handle, nullptr);
 }
 
-void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<std::vector<VkImageView>, 2>& attachments)
+void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<std::vector<VkImageView>, Device::MAX_FRAMES_IN_FLIGHT>& attachments)
 {
     VkResult res;
+    const uint32_t frames = m_device.frames_in_flight();
     VkFramebufferCreateInfo createinfo = ci_template;
 
     m_extent = { ci_template.width, ci_template.height };
-    m_handles.resize(2);
-    for (int i = 0; i < 2; i++) {
+    m_handles.resize(frames);
+    for (uint32_t i = 0; i < frames; i++) {
         createinfo.pAttachments = attachments[i].data();
         if ((res = vkCreateFramebuffer(m_device, &createinfo, nullptr, &m_handles[i])) != VK_SUCCESS) {
             spdlog::critical("vkCreateFramebuffer: {}", res);
@@ -1054,14 +1968,15 @@ void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<st
     }
 }
 
-void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<std::vector<VkImageView>, 2>& attachments, int32_t swapchain_attachment_index)
+void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<std::vector<VkImageView>, Device::MAX_FRAMES_IN_FLIGHT>& attachments, int32_t swapchain_attachment_index)
 {
     VkResult res;
     const size_t image_count = m_device.swapchain().image_count();
+    const uint32_t frames = m_device.frames_in_flight();
     VkFramebufferCreateInfo createinfo = ci_template;
 
     m_extent = { ci_template.width, ci_template.height };
-    if (swapchain_attachment_index == 0 && attachments[0].size() == 1 && attachments[1].size() == 1) {
+    if (swapchain_attachment_index == 0 && attachments[0].size() == 1) {
         m_handles.resize(m_device.swapchain().image_count());
         for (int i = 0; i < image_count; i++) {
             createinfo.pAttachments = &m_device.swapchain().image_view(i);
@@ -1071,8 +1986,8 @@ void Framebuffer::initialize(VkFramebufferCreateInfo& ci_template, std::array<st
             }
         }
     } else {
-        m_handles.resize(2 * m_device.swapchain().image_count());
-        for (int f = 0; f < 2; f++) {
+        m_handles.resize(frames * m_device.swapchain().image_count());
+        for (uint32_t f = 0; f < frames; f++) {
             createinfo.pAttachments = attachments[f].data();
             for (int i = 0; i < image_count; i++) {
                 attachments[f][swapchain_attachment_index] = m_device.swapchain().image_view(i);
@@ -1096,8 +2011,9 @@ Framebuffer::Builder::Builder(const RenderPass& render_pass)
     : m_attachment_counter(0)
     , m_swapchain_attachment_index(-1)
     , m_createinfo()
-    , m_attachments { { std::vector<VkImageView>(render_pass.attachment_count()), std::vector<VkImageView>(render_pass.attachment_count()) } }
 {
+    for (auto& frame : m_attachments)
+        frame.resize(render_pass.attachment_count());
     m_createinfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     m_createinfo.renderPass = render_pass;
     m_createinfo.attachmentCount = render_pass.attachment_count();
@@ -1125,26 +2041,31 @@ Framebuffer::Builder& Framebuffer::Builder::with_swapchain_attachment()
 Framebuffer::Builder& Framebuffer::Builder::with_swapchain_attachment(uint32_t index)
 {
     m_swapchain_attachment_index = index;
-    m_attachments[0][index] = VK_NULL_HANDLE;
-    m_attachments[1][index] = VK_NULL_HANDLE;
+    for (auto& frame : m_attachments)
+        frame[index] = VK_NULL_HANDLE;
     m_attachment_counter++;
     return *this;
 }
 
-template <>
-Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<1>& image)
+// Frame slot f sees the view for slot f % N, mirroring how Buffer<N> and
+// Image<N> rotate their handles through the frame loop.
+template <unsigned int N>
+Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<N>& image)
 {
-    return with_bound_attachment(m_attachment_counter++, image, image);
-}
-template <>
-Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<2>& image)
-{
-    return with_bound_attachment(m_attachment_counter++, image[0], image[1]);
+    uint32_t index = m_attachment_counter++;
+    for (unsigned int f = 0; f < Device::MAX_FRAMES_IN_FLIGHT; f++)
+        m_attachments[f][index] = image[f % N];
+    return *this;
 }
-Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(uint32_t index, VkImageView a, VkImageView b)
+template Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<1>&);
+template Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<2>&);
+template Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(const vkw::ImageView<3>&);
+
+Framebuffer::Builder& Framebuffer::Builder::with_bound_attachment(uint32_t index, VkImageView a, VkImageView b, VkImageView c)
 {
     m_attachments[0][index] = a;
     m_attachments[1][index] = b;
+    m_attachments[2][index] = c;
     return *this;
 }
 
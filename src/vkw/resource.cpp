@@ -2,6 +2,8 @@
 #include <ktx.h>
 #include <spdlog/spdlog.h>
 #include <spng.h>
+#include <stdio.h>
+#include <string.h>
 #include <utility>
 
 namespace vkw {
@@ -50,6 +52,19 @@ Buffer<N>::Buffer(Buffer<N>& src_buffer, MemoryUsage mem_usage, VkBufferUsageFla
     create_empty(m_allocation.allocator(), mem_usage, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, m_size, queue_families, flags);
 }
 
+template <unsigned int N>
+Buffer<N>::Buffer(Buffer<N>&& other)
+    : m_handle(other.m_handle)
+    , m_allocation(std::move(other.m_allocation))
+    , m_size(other.m_size)
+{
+    // Null out the source so its destructor's destroy() releases nothing;
+    // vkDestroyBuffer ignores VK_NULL_HANDLE and Allocator::free ignores
+    // reset allocations.
+    other.m_handle.fill(VK_NULL_HANDLE);
+    other.m_size = 0;
+}
+
 template <unsigned int N>
 Buffer<N>::~Buffer()
 {
@@ -109,6 +124,7 @@ void Buffer<N>::copy_from(Buffer<N>& src_buffer, CommandBuffer& cmd, VkDeviceSiz
 
 template class Buffer<1>;
 template class Buffer<2>;
+template class Buffer<3>;
 
 template <unsigned int N>
 HostBuffer<N>::HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, size_t length)
@@ -130,6 +146,12 @@ HostBuffer<N>::HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, fs::is
     }
 }
 
+template <unsigned int N>
+HostBuffer<N>::HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, const fs::mapped_view& input)
+    : HostBuffer(allocator, usage, input.data(), input.length())
+{
+}
+
 template <unsigned int N>
 HostBuffer<N>::HostBuffer(Allocator& allocator, VkBufferUsageFlags usage, const void* input, size_t length)
     : HostBuffer(allocator, usage, length)
@@ -153,6 +175,52 @@ void HostBuffer<N>::write_mapped(const void* data, size_t length)
 
 template class HostBuffer<1>;
 template class HostBuffer<2>;
+template class HostBuffer<3>;
+
+template <unsigned int N>
+BufferArena<N>::BufferArena(Allocator& allocator, MemoryUsage mem_usage, VkBufferUsageFlags usage, VkDeviceSize size, const std::initializer_list<QueueFamilyType>& queue_families)
+    : m_allocator(allocator)
+    , m_buffer(allocator, mem_usage, usage, size, queue_families)
+    , m_alignment(4)
+    , m_head(0)
+{
+    const VkPhysicalDeviceLimits& limits = allocator.device().limits();
+    if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+        m_alignment = std::max(m_alignment, limits.minUniformBufferOffsetAlignment);
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+        m_alignment = std::max(m_alignment, limits.minStorageBufferOffsetAlignment);
+    if (usage & (VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT))
+        m_alignment = std::max(m_alignment, limits.minTexelBufferOffsetAlignment);
+}
+
+template <unsigned int N>
+typename BufferArena<N>::SubRange BufferArena<N>::suballocate(VkDeviceSize size)
+{
+    VkDeviceSize offset = (m_head + m_alignment - 1) & ~(m_alignment - 1);
+    if (offset + size > m_buffer.size()) {
+        spdlog::error("BufferArena::suballocate({}): arena of size {} is exhausted", size, m_buffer.size());
+        return {};
+    }
+    m_head = offset + size;
+    return { offset, size };
+}
+
+template <unsigned int N>
+void BufferArena<N>::write(const SubRange& range, const void* data, size_t length)
+{
+    const SingleAllocation& active_buffer = m_buffer.allocation()[m_allocator.device().current_frame() % N];
+    void* mapped_buffer = m_allocator.map_memory(active_buffer);
+    if (mapped_buffer == nullptr) {
+        spdlog::error("BufferArena::write() on a buffer that is not host-visible");
+        return;
+    }
+    memcpy(reinterpret_cast<char*>(mapped_buffer) + range.m_offset, data, std::min<VkDeviceSize>(length, range.m_size));
+    m_allocator.unmap_memory(active_buffer);
+}
+
+template class BufferArena<1>;
+template class BufferArena<2>;
+template class BufferArena<3>;
 
 static int png_stream_read(spng_ctx* ctx, void* user, void* dst, size_t len)
 {
@@ -276,6 +344,122 @@ static KTX_error_code ktx_mip_iterate(int miplevel, int face, int width, int hei
     return KTX_SUCCESS;
 }
 
+static uint64_t fnv1a64(const void* data, size_t length)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (length-- > 0) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// On-disk layout of a cached decode: this header, then copy_count
+// VkBufferImageCopy entries, then the raw staging payload.
+struct decode_cache_header {
+    static constexpr uint32_t MAGIC = 0x43585456; // "VTXC"
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t magic, version;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint32_t image_type; // VkImageType
+    uint32_t view_type; // VkImageViewType
+    uint32_t format; // VkFormat of the payload
+    VkExtent3D extent;
+    uint32_t mip_levels;
+    uint32_t array_layers;
+    uint32_t flags; // VkImageCreateFlags
+    uint32_t usage; // VkImageUsageFlags
+    uint32_t copy_count;
+    uint64_t payload_length;
+};
+
+static VkFormat pick_transcode_format(const Device& device, ktx_transcode_fmt_e& ktx_format)
+{
+    static const std::pair<VkFormat, ktx_transcode_fmt_e> candidates[] = {
+        { VK_FORMAT_BC7_SRGB_BLOCK, KTX_TTF_BC7_RGBA },
+        { VK_FORMAT_ASTC_4x4_SRGB_BLOCK, KTX_TTF_ASTC_4x4_RGBA },
+        { VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK, KTX_TTF_ETC2_RGBA },
+    };
+    for (const auto& [vk_format, candidate] : candidates) {
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(device.hwd(), vk_format, &props);
+        if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) {
+            ktx_format = candidate;
+            return vk_format;
+        }
+    }
+    ktx_format = KTX_TTF_RGBA32;
+    return VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+bool HostImage::read_decode_cache(Allocator& allocator, const char* name, uint64_t source_hash, size_t source_length)
+{
+    std::string vpath = std::string("/pref/texcache/") + name;
+    if (fs::file(vpath).exists() == false)
+        return false;
+
+    fs::mapped_view blob(vpath);
+    if (blob.length() < sizeof(decode_cache_header))
+        return false;
+    const decode_cache_header* header = reinterpret_cast<const decode_cache_header*>(blob.data());
+    if (header->magic != decode_cache_header::MAGIC || header->version != decode_cache_header::VERSION)
+        return false;
+    if (header->source_hash != source_hash || header->source_length != source_length)
+        return false; // stale: the source asset changed since this entry was written
+    size_t expected_length = sizeof(decode_cache_header) + header->copy_count * sizeof(VkBufferImageCopy) + header->payload_length;
+    if (blob.length() != expected_length)
+        return false;
+
+    m_createinfo.imageType = static_cast<VkImageType>(header->image_type);
+    m_createinfo.format = static_cast<VkFormat>(header->format);
+    m_createinfo.extent = header->extent;
+    m_createinfo.mipLevels = header->mip_levels;
+    m_createinfo.arrayLayers = header->array_layers;
+    m_createinfo.flags = header->flags;
+    m_createinfo.usage = header->usage;
+    m_image_view_type = static_cast<VkImageViewType>(header->view_type);
+    m_copies.resize(header->copy_count);
+    memcpy(m_copies.data(), header + 1, header->copy_count * sizeof(VkBufferImageCopy));
+
+    create_empty(allocator, vkw::MemoryUsage::HostLocal, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, header->payload_length);
+    void* mapped_buffer = allocator.map_memory(m_allocation[0]);
+    memcpy(mapped_buffer, reinterpret_cast<const char*>(blob.data()) + expected_length - header->payload_length, header->payload_length);
+    allocator.unmap_memory(m_allocation[0]);
+    return true;
+}
+
+void HostImage::write_decode_cache(const char* name, uint64_t source_hash, size_t source_length, const void* payload, size_t payload_length) const
+{
+    // PhysFS resolves write paths against the write dir, which fs::init mounts
+    // at /pref for reading -- so entries are written without that prefix.
+    if (fs::file("/pref/texcache").exists() == false)
+        fs::file("/texcache").mkdir();
+
+    decode_cache_header header {};
+    header.magic = decode_cache_header::MAGIC;
+    header.version = decode_cache_header::VERSION;
+    header.source_hash = source_hash;
+    header.source_length = source_length;
+    header.image_type = m_createinfo.imageType;
+    header.view_type = m_image_view_type;
+    header.format = m_createinfo.format;
+    header.extent = m_createinfo.extent;
+    header.mip_levels = m_createinfo.mipLevels;
+    header.array_layers = m_createinfo.arrayLayers;
+    header.flags = m_createinfo.flags;
+    header.usage = m_createinfo.usage;
+    header.copy_count = m_copies.size();
+    header.payload_length = payload_length;
+
+    fs::ostream out(std::string("/texcache/") + name);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(m_copies.data()), m_copies.size() * sizeof(VkBufferImageCopy));
+    out.write(reinterpret_cast<const char*>(payload), payload_length);
+}
+
 HostImage::HostImage(Allocator& allocator)
     : Buffer<1>(allocator)
 {
@@ -347,6 +531,23 @@ HostImage::HostImage(Allocator& allocator, InputFormat format, fs::istream* stre
         ktxTexture* ktx;
         ktxTexture2* ktx2 = nullptr;
         KTX_error_code k_result;
+
+        // Supercompression inflate and Basis transcode dominate load time, and
+        // both are deterministic for a given source and target format, so the
+        // decoded staging payload is cached on disk keyed by content hash and
+        // the chosen transcode target. Only the in-memory path can be keyed
+        // cheaply; streamed sources always take the full decode.
+        uint64_t source_hash = 0;
+        char cache_name[64] = "";
+        ktx_transcode_fmt_e ktx_transcode_target;
+        VkFormat transcode_target = pick_transcode_format(allocator.device(), ktx_transcode_target);
+        if (encoded != nullptr) {
+            source_hash = fnv1a64(encoded, encoded_length);
+            snprintf(cache_name, sizeof(cache_name), "%016llx-%u%s.bin", static_cast<unsigned long long>(source_hash), static_cast<unsigned>(transcode_target), mipmap ? "-m" : "");
+            if (read_decode_cache(allocator, cache_name, source_hash, encoded_length))
+                return;
+        }
+
         if (stream) {
             ktx_fs_istream ktx_stream(stream);
             k_result = ktxTexture2_CreateFromStream(&ktx_stream.handle, KTX_TEXTURE_CREATE_NO_FLAGS, &ktx2);
@@ -359,6 +560,13 @@ HostImage::HostImage(Allocator& allocator, InputFormat format, fs::istream* stre
         }
         ktx = reinterpret_cast<ktxTexture*>(ktx2);
 
+        if (ktxTexture2_NeedsTranscoding(ktx2)) {
+            if ((k_result = ktxTexture2_TranscodeBasis(ktx2, ktx_transcode_target, 0)) != KTX_SUCCESS) {
+                spdlog::critical("ktxTexture2_TranscodeBasis: {}", ktxErrorString(k_result));
+                abort();
+            }
+        }
+
         switch (ktx->numDimensions) {
         case 1:
             m_createinfo.imageType = VK_IMAGE_TYPE_1D;
@@ -438,6 +646,9 @@ HostImage::HostImage(Allocator& allocator, InputFormat format, fs::istream* stre
         }
         m_copies = std::move(ktx_mip_iterate_data.regions);
 
+        if (encoded != nullptr)
+            write_decode_cache(cache_name, source_hash, encoded_length, mapped_buffer, base_buffer_length);
+
         allocator.unmap_memory(m_allocation[0]);
         ktxTexture_Destroy(ktx);
     } else {
@@ -463,6 +674,72 @@ HostImage::InputFormat HostImage::input_format(const std::string_view& extension
     }
 }
 
+ImageDecoder::ImageDecoder(Allocator& allocator, size_t worker_count)
+    : m_allocator(allocator)
+    , m_shutdown(false)
+{
+    if (worker_count == 0)
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    m_workers.reserve(worker_count);
+    for (size_t i = 0; i < worker_count; i++)
+        m_workers.emplace_back(&ImageDecoder::worker_main, this);
+}
+
+ImageDecoder::~ImageDecoder()
+{
+    {
+        std::lock_guard lck(m_mtx);
+        m_shutdown = true;
+    }
+    m_cv.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+void ImageDecoder::worker_main()
+{
+    for (;;) {
+        std::unique_lock lck(m_mtx);
+        m_cv.wait(lck, [this] { return m_shutdown || m_jobs.empty() == false; });
+        if (m_jobs.empty())
+            return;
+        Job job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lck.unlock();
+
+        job.m_result.set_value(HostImage(m_allocator, job.m_request.m_format, fs::istream(job.m_request.m_path), job.m_request.m_mipmap));
+    }
+}
+
+std::future<HostImage> ImageDecoder::enqueue(const fs::file& f, HostImage::InputFormat format, bool mipmap)
+{
+    std::future<HostImage> result;
+    {
+        std::lock_guard lck(m_mtx);
+        Job& job = m_jobs.emplace_back();
+        job.m_request = { f.path(), format, mipmap };
+        result = job.m_result.get_future();
+    }
+    m_cv.notify_one();
+    return result;
+}
+
+std::vector<std::future<HostImage>> ImageDecoder::enqueue(const std::vector<Request>& batch)
+{
+    std::vector<std::future<HostImage>> results;
+    results.reserve(batch.size());
+    {
+        std::lock_guard lck(m_mtx);
+        for (const Request& request : batch) {
+            Job& job = m_jobs.emplace_back();
+            job.m_request = request;
+            results.push_back(job.m_result.get_future());
+        }
+    }
+    m_cv.notify_all();
+    return results;
+}
+
 template <unsigned int N>
 Image<N>::Image(Allocator& allocator)
     : m_allocation(allocator)
@@ -552,6 +829,66 @@ Image<N>::Image(Allocator& allocator, HostImage& src_image, MemoryUsage mem_usag
     abort();
 }
 
+template <>
+Image<1>::Image(Allocator& allocator, HostImage& src_image, MemoryUsage mem_usage, VkImageUsageFlags usage, uint32_t base_mip, VkImageTiling tiling, const std::initializer_list<QueueFamilyType>& queue_families, VkImageCreateFlags flags)
+    : m_createinfo(src_image.m_createinfo)
+    , m_mem_usage(mem_usage)
+    , m_allocation(allocator)
+{
+    VkResult res;
+    const Device& device = allocator.device();
+
+    if (src_image.m_copies.size() < src_image.m_createinfo.mipLevels) {
+        // tail mips would need vkCmdBlitImage, which transfer queues cannot record
+        spdlog::critical("Image<1>: streamed images need every mip level present in the source");
+        abort();
+    }
+    if (base_mip >= m_createinfo.mipLevels)
+        base_mip = m_createinfo.mipLevels - 1;
+
+    m_base_mip = base_mip;
+    m_createinfo.extent.width = std::max(1U, m_createinfo.extent.width >> base_mip);
+    m_createinfo.extent.height = std::max(1U, m_createinfo.extent.height >> base_mip);
+    m_createinfo.extent.depth = std::max(1U, m_createinfo.extent.depth >> base_mip);
+    m_createinfo.mipLevels -= base_mip;
+    m_createinfo.usage |= usage | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    m_createinfo.tiling = tiling;
+    if (queue_families.size() > 0) {
+        std::vector<uint32_t> qfv = unique_queue_families(device, queue_families);
+        m_createinfo.sharingMode = qfv.size() == 1 ? VK_SHARING_MODE_EXCLUSIVE : VK_SHARING_MODE_CONCURRENT;
+        m_createinfo.queueFamilyIndexCount = qfv.size();
+        m_createinfo.pQueueFamilyIndices = qfv.data();
+    }
+
+    if ((res = vkCreateImage(device, &m_createinfo, nullptr, &m_handle[0])) != VK_SUCCESS) {
+        spdlog::critical("vkCreateImage: {}", res);
+        abort();
+    }
+    if (allocator.allocate(m_handle[0], m_mem_usage, m_allocation[0]) == false) {
+        spdlog::critical("could not allocate memory for image");
+        abort();
+    }
+}
+
+template <unsigned int N>
+Image<N>::Image(Allocator& allocator, HostImage& src_image, MemoryUsage mem_usage, VkImageUsageFlags usage, uint32_t base_mip, VkImageTiling tiling, const std::initializer_list<QueueFamilyType>& queue_families, VkImageCreateFlags flags)
+    : m_allocation(allocator)
+{
+    spdlog::critical("Image<{}>::Image(HostImage&, MemoryUsage, uint32_t): invalid usage", N);
+    abort();
+}
+
+template <unsigned int N>
+Image<N>::Image(Image<N>&& other)
+    : m_createinfo(other.m_createinfo)
+    , m_handle(other.m_handle)
+    , m_mem_usage(other.m_mem_usage)
+    , m_allocation(std::move(other.m_allocation))
+    , m_base_mip(other.m_base_mip)
+{
+    other.m_handle.fill(VK_NULL_HANDLE);
+}
+
 template <unsigned int N>
 Image<N>::~Image()
 {
@@ -569,11 +906,28 @@ void Image<N>::copy_from(HostImage& src_image, CommandBuffer& cmd)
     subresource.levelCount = m_createinfo.mipLevels;
     subresource.layerCount = m_createinfo.arrayLayers;
 
-    for (int i = 0; i < N; i++) {
-        cmd.set_image_layout(m_handle[0], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresource);
-        vkCmdCopyBufferToImage(cmd, src_image.m_handle[0], m_handle[0], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, src_image.m_copies.size(), src_image.m_copies.data());
+    const VkBufferImageCopy* copies = src_image.m_copies.data();
+    uint32_t copy_count = src_image.m_copies.size();
+    std::vector<VkBufferImageCopy> rebased;
+    if (m_base_mip != 0) {
+        // streamed image: keep only resident mips, rebased so the floor lands on mip 0
+        rebased.reserve(copy_count);
+        for (const VkBufferImageCopy& copy : src_image.m_copies) {
+            if (copy.imageSubresource.mipLevel < m_base_mip)
+                continue;
+            VkBufferImageCopy& r = rebased.emplace_back(copy);
+            r.imageSubresource.mipLevel -= m_base_mip;
+        }
+        copies = rebased.data();
+        copy_count = rebased.size();
     }
 
+    for (int i = 0; i < N; i++)
+        cmd.defer_image_layout(m_handle[0], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresource);
+    cmd.flush_barriers();
+    for (int i = 0; i < N; i++)
+        vkCmdCopyBufferToImage(cmd, src_image.m_handle[0], m_handle[0], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, copy_count, copies);
+
     if (src_image.m_copies.size() < m_createinfo.mipLevels) {
         generate_mipmaps(cmd, src_image.m_copies.size(), m_createinfo.mipLevels, m_createinfo.extent, m_createinfo.arrayLayers);
     }
@@ -589,7 +943,7 @@ void Image<N>::generate_mipmaps(CommandBuffer& cmd, uint32_t mip_start, uint32_t
         subresource.levelCount = 1;
         subresource.baseArrayLayer = 0;
         subresource.layerCount = layer_count;
-        cmd.set_image_layout(image, initial_layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresource);
+        cmd.defer_image_layout(image, initial_layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresource);
 
         for (uint32_t i = mip_start; i < mip_end; i++) {
             VkImageBlit image_blit {};
@@ -611,10 +965,16 @@ void Image<N>::generate_mipmaps(CommandBuffer& cmd, uint32_t mip_start, uint32_t
             subresource.baseMipLevel = i;
             subresource.levelCount = 1;
 
-            cmd.set_image_layout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresource);
+            // merge this mip's pre-blit transition with the previous mip's
+            // post-blit transition (or the initial one) into a single barrier
+            cmd.defer_image_layout(image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresource);
+            cmd.flush_barriers();
             vkCmdBlitImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_blit, VK_FILTER_LINEAR);
-            cmd.set_image_layout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresource);
+            cmd.defer_image_layout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, subresource);
         }
+        // the last post-blit transition touches the same subresource the
+        // final transition does, so it cannot share its barrier
+        cmd.flush_barriers();
 
         subresource.baseMipLevel = 0;
         subresource.levelCount = mip_end;
@@ -649,13 +1009,138 @@ void Image<N>::set_layout(VkImageLayout from, VkImageLayout to, CommandBuffer& c
     subresource.levelCount = m_createinfo.mipLevels;
     subresource.layerCount = m_createinfo.arrayLayers;
 
-    for (VkImage& image : m_handle) {
-        cmd.set_image_layout(image, from, to, subresource, src_stage_mask, dst_stage_mask);
+    for (VkImage& image : m_handle)
+        cmd.defer_image_layout(image, from, to, subresource, src_stage_mask, dst_stage_mask);
+    cmd.flush_barriers();
+}
+
+template <unsigned int N>
+void Image<N>::stream_in(HostImage& src_image, uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout)
+{
+    rebuild_mips(&src_image, new_base_mip, cmd, gc, current_layout);
+}
+
+template <unsigned int N>
+void Image<N>::evict_to(uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout)
+{
+    if (new_base_mip < m_base_mip) {
+        spdlog::critical("Image<{}>::evict_to: cannot lower the mip floor without a source image", N);
+        abort();
+    }
+    rebuild_mips(nullptr, new_base_mip, cmd, gc, current_layout);
+}
+
+template <unsigned int N>
+void Image<N>::rebuild_mips(HostImage* src_image, uint32_t new_base_mip, CommandBuffer& cmd, GarbageCollector& gc, VkImageLayout current_layout)
+{
+    VkResult res;
+    Allocator& allocator = m_allocation.allocator();
+    uint32_t total_mips = m_createinfo.mipLevels + m_base_mip;
+    if (new_base_mip >= total_mips)
+        new_base_mip = total_mips - 1;
+    if (new_base_mip == m_base_mip)
+        return;
+    if (new_base_mip < m_base_mip && src_image == nullptr) {
+        spdlog::critical("Image<{}>: lowering the mip floor requires the source image", N);
+        abort();
+    }
+
+    VkImageCreateInfo createinfo = m_createinfo;
+    if (src_image != nullptr) {
+        createinfo.extent.width = std::max(1U, src_image->m_createinfo.extent.width >> new_base_mip);
+        createinfo.extent.height = std::max(1U, src_image->m_createinfo.extent.height >> new_base_mip);
+        createinfo.extent.depth = std::max(1U, src_image->m_createinfo.extent.depth >> new_base_mip);
+    } else {
+        uint32_t delta = new_base_mip - m_base_mip;
+        createinfo.extent.width = std::max(1U, m_createinfo.extent.width >> delta);
+        createinfo.extent.height = std::max(1U, m_createinfo.extent.height >> delta);
+        createinfo.extent.depth = std::max(1U, m_createinfo.extent.depth >> delta);
+    }
+    createinfo.mipLevels = total_mips - new_base_mip;
+    createinfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    // mips resident before and after the move are copied on the GPU...
+    uint32_t first_surviving = std::max(m_base_mip, new_base_mip);
+    std::vector<VkImageCopy> survivors;
+    survivors.reserve(total_mips - first_surviving);
+    for (uint32_t mip = first_surviving; mip < total_mips; mip++) {
+        VkImageCopy& copy = survivors.emplace_back();
+        copy.srcSubresource.aspectMask = copy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copy.srcSubresource.mipLevel = mip - m_base_mip;
+        copy.dstSubresource.mipLevel = mip - new_base_mip;
+        copy.srcSubresource.layerCount = copy.dstSubresource.layerCount = m_createinfo.arrayLayers;
+        copy.extent.width = std::max(1U, createinfo.extent.width >> (mip - new_base_mip));
+        copy.extent.height = std::max(1U, createinfo.extent.height >> (mip - new_base_mip));
+        copy.extent.depth = std::max(1U, createinfo.extent.depth >> (mip - new_base_mip));
     }
+
+    // ...while newly resident mips come out of the source's staging buffer.
+    std::vector<VkBufferImageCopy> uploads;
+    if (src_image != nullptr) {
+        for (const VkBufferImageCopy& copy : src_image->m_copies) {
+            if (copy.imageSubresource.mipLevel < new_base_mip || copy.imageSubresource.mipLevel >= m_base_mip)
+                continue;
+            VkBufferImageCopy& rebased = uploads.emplace_back(copy);
+            rebased.imageSubresource.mipLevel -= new_base_mip;
+        }
+    }
+
+    for (int i = 0; i < N; i++) {
+        VkImage fresh;
+        SingleAllocation fresh_allocation;
+        if ((res = vkCreateImage(device(), &createinfo, nullptr, &fresh)) != VK_SUCCESS) {
+            spdlog::critical("vkCreateImage: {}", res);
+            abort();
+        }
+        if (allocator.allocate(fresh, m_mem_usage, fresh_allocation) == false) {
+            spdlog::critical("could not allocate memory for image");
+            abort();
+        }
+
+        VkImageSubresourceRange subresource;
+        subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        subresource.baseMipLevel = subresource.baseArrayLayer = 0;
+        subresource.levelCount = createinfo.mipLevels;
+        subresource.layerCount = createinfo.arrayLayers;
+        cmd.defer_image_layout(fresh, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, subresource);
+
+        VkImageSubresourceRange old_subresource = subresource;
+        old_subresource.levelCount = m_createinfo.mipLevels;
+        cmd.defer_image_layout(m_handle[i], current_layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, old_subresource);
+        cmd.flush_barriers();
+        vkCmdCopyImage(cmd, m_handle[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, fresh, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, survivors.size(), survivors.data());
+        if (uploads.empty() == false)
+            vkCmdCopyBufferToImage(cmd, src_image->m_handle[0], fresh, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, uploads.size(), uploads.data());
+        cmd.set_image_layout(fresh, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, current_layout, subresource);
+
+        gc.add(m_handle[i]);
+        gc.add(allocator, m_allocation[i]);
+        m_handle[i] = fresh;
+        m_allocation[i] = fresh_allocation;
+    }
+
+    m_createinfo = createinfo;
+    m_base_mip = new_base_mip;
 }
 
 template class Image<1>;
 template class Image<2>;
+template class Image<3>;
+
+uint32_t streaming_mip_pressure(const Allocator& allocator)
+{
+    uint32_t pressure = 0;
+    for (const Allocator::HeapStats& heap : allocator.heap_stats()) {
+        VkDeviceSize budget = heap.m_budget != 0 ? heap.m_budget : heap.m_size;
+        VkDeviceSize usage = heap.m_usage != 0 ? heap.m_usage : heap.m_reserved;
+        if (budget == 0 || usage * 10 <= budget * 9)
+            continue;
+        // one mip per 5% of budget past the 90% line, so deeper overshoot sheds faster
+        VkDeviceSize overshoot = usage - budget * 9 / 10;
+        pressure = std::max(pressure, 1 + static_cast<uint32_t>(overshoot / (budget / 20 + 1)));
+    }
+    return pressure;
+}
 
 template <unsigned int N>
 ImageView<N>::ImageView(const vkw::Device& device, vkw::Image<N>& src_image, VkImageViewType type, VkFormat format, VkImageAspectFlags aspect_mask, const std::array<uint32_t, 2>& array_layers, const std::array<uint32_t, 2>& mip_levels)
@@ -701,6 +1186,7 @@ ImageView<N>::operator VkImageView() const
 
 template class ImageView<1>;
 template class ImageView<2>;
+template class ImageView<3>;
 
 constexpr size_t FormatWidth(VkFormat fmt)
 {